@@ -49,6 +49,7 @@
 #include <map>
 #include <iomanip>
 #include <algorithm>
+#include <cmath>
 
 //#include "precomp.hpp"
 #include <opencv2/imgproc/imgproc.hpp>
@@ -70,44 +71,59 @@ protected:
     static float          Tilts[6];
     static unsigned int   NumRolls[6];
     
+    vector<float>         _tilts;                // latitude of every tilt level
     vector< vector<float> > _rolls;              // rolls for every tilt
     vector<float>         _tiltPool, _rollPool;  // all in one vector
+    vector<AffView>       _views;                // all in one vector, with warps
+    vector<unsigned int>  _tiltOffsets;          // id of the first view of every tilt
     
-    void                  formRolls();           // create _rolls
-    void                  formPools();           // create _tiltPool, _rollPool
+    void                  formRolls (const vector<unsigned int>& numRolls); // create _rolls
+    void                  formPools();           // create _tiltPool, _rollPool, _views
     
     
-    unsigned int          _minTilt, _maxTilt;    // control which part of Tilts[] to use
+    unsigned int          _minTilt, _maxTilt;    // control which part of _tilts to use
+    unsigned int          _first, _last;         // active views, follow _minTilt, _maxTilt
     
 private:
-    void                  getActiveViewIds (unsigned int* first, unsigned int* last) const;
+    void                  updateActiveViewIds();
     
 public:
     AffAnglesImpl (unsigned int maxTilt, unsigned int minTilt = 0);
+    AffAnglesImpl (float tiltFactor, float rollSpacing, unsigned int numTilts);
+    AffAnglesImpl (const vector<float>& tilts, const vector<float>& rolls);
     AffAnglesImpl (const AffAnglesImpl& old);
     virtual ~AffAnglesImpl() { }
     
     
     void                  setMinTilt(unsigned int minTilt)
-                                               { CV_Assert (minTilt < MaxPossibleTilt);
+                                               { CV_Assert (minTilt < _tilts.size());
                                                  _minTilt = minTilt;
+                                                 updateActiveViewIds();
                                                }
     unsigned int          getMinTilt() const   { return _minTilt; }
     void                  setMaxTilt(unsigned int maxTilt)
-                                               { CV_Assert (maxTilt <= MaxPossibleTilt);
+                                               { CV_Assert (maxTilt <= _tilts.size());
                                                  _maxTilt = maxTilt;
+                                                 updateActiveViewIds();
                                                }
     unsigned int          getMaxTilt() const   { return _maxTilt; }
 
+    unsigned int          getNumPossibleTilts () const { return _tilts.size(); }
+    unsigned int          getNumPossibleViews () const { return _tiltPool.size(); }
 
-    unsigned int          getNumViews () const { unsigned int first, last;
-                                                 getActiveViewIds (&first, &last);
-                                                 return last - first;
+    unsigned int          getNumViews () const { CV_Assert (_minTilt < _maxTilt);
+                                                 return _last - _first;
                                                }
     unsigned int          getNumTilts () const { return _maxTilt - _minTilt; }
     unsigned int          getNumRolls (unsigned int tilt) const
-                                               { CV_Assert (tilt < MaxPossibleTilt);
-                                                 return NumRolls[tilt];
+                                               { CV_Assert (tilt < _rolls.size());
+                                                 return _rolls[tilt].size();
+                                               }
+    
+    AffViewRange          getActiveViews() const
+                                               { CV_Assert (_minTilt < _maxTilt);
+                                                 return AffViewRange (&_views[0] + _first,
+                                                                      &_views[0] + _last);
                                                }
     
     vector<float>         getActiveTilts() const; // the active subset <= _minTilt, _maxTilt
@@ -121,43 +137,126 @@ Ptr<AffAngles> createAffAngles (unsigned int maxTilt, unsigned int minTilt)
     return new AffAnglesImpl (maxTilt, minTilt);
 }
 
+Ptr<AffAngles> createAffAngles (float tiltFactor, float rollSpacing, unsigned int numTilts)
+{
+    return new AffAnglesImpl (tiltFactor, rollSpacing, numTilts);
+}
+
+Ptr<AffAngles> createAffAngles (const vector<float>& tilts, const vector<float>& rolls)
+{
+    return new AffAnglesImpl (tilts, rolls);
+}
+
+
+// the camera of [asift paper] is turned by tilt and roll and moved infinitely far,
+//   so that the homography between the image and the view becomes affine
+static AffView makeView (float tilt, float roll)
+{
+    const float t = float(tilt / 180 * CV_PI), r = float(roll / 180 * CV_PI);
+    const float ct = cos(t), cr = cos(r), sr = sin(r);
+    
+    AffView view;
+    view.tilt = tilt;
+    view.roll = roll;
+    view.A    = Matx22f ( cr,       sr,
+                         -ct * sr,  ct * cr );
+    view.Ainv = Matx22f ( cr,      -sr / ct,
+                          sr,       cr / ct );
+    return view;
+}
+
 
 float        AffAnglesImpl::Tilts[6] = { 0, 45, 60, 69, 76, 80 };
 unsigned int AffAnglesImpl::NumRolls[6] = { 1, 4, 5, 7, 10, 14 };
 
 
 AffAnglesImpl::AffAnglesImpl (unsigned int maxTilt, unsigned int minTilt)
+    : _minTilt(0), _maxTilt(0), _first(0), _last(0)
 {
     CV_Assert (maxTilt > minTilt);
 
     // create pools of tilt and roll angles
-    formRolls();
+    _tilts = vector<float> (Tilts, Tilts + MaxPossibleTilt);
+    formRolls (vector<unsigned int> (NumRolls, NumRolls + MaxPossibleTilt));
     formPools();
     
     setMinTilt (minTilt);
     setMaxTilt (maxTilt);
 }
 
+AffAnglesImpl::AffAnglesImpl (float tiltFactor, float rollSpacing, unsigned int numTilts)
+    : _minTilt(0), _maxTilt(0), _first(0), _last(0)
+{
+    CV_Assert (tiltFactor > 1 && rollSpacing > 0 && numTilts > 0);
+
+    // tilt t is 1 / cos(latitude), the first level is the original image
+    _tilts = vector<float> (numTilts);
+    vector<unsigned int> numRolls (numTilts);
+    for (int iTilt = 0; iTilt != numTilts; ++iTilt)
+    {
+        double t = std::pow (double(tiltFactor), iTilt);
+        _tilts[iTilt] = float(std::acos (1 / t) * 180 / CV_PI);
+        numRolls[iTilt] = (iTilt == 0) ? 1 : max (1, cvRound (180 * t / rollSpacing));
+    }
+
+    formRolls (numRolls);
+    formPools();
+    CV_Assert (_tiltPool.size() <= MaxNumViews);
+    
+    setMinTilt (0);
+    setMaxTilt (numTilts);
+}
+
+AffAnglesImpl::AffAnglesImpl (const vector<float>& tilts, const vector<float>& rolls)
+    : _minTilt(0), _maxTilt(0), _first(0), _last(0)
+{
+    CV_Assert (!tilts.empty() && tilts.size() == rolls.size());
+    CV_Assert (tilts.size() <= MaxNumViews);
+
+    // group consecutive views with the same tilt into tilt levels
+    for (int i = 0; i != tilts.size(); ++i)
+    {
+        if (_tilts.empty() || tilts[i] != _tilts.back())
+        {
+            CV_Assert (_tilts.empty() || tilts[i] > _tilts.back());
+            CV_Assert (tilts[i] >= 0 && tilts[i] < 90);
+            _tilts.push_back (tilts[i]);
+            _rolls.push_back (vector<float>());
+        }
+        _rolls.back().push_back (rolls[i]);
+    }
+    formPools();
+    
+    setMinTilt (0);
+    setMaxTilt (_tilts.size());
+}
+
 AffAnglesImpl::AffAnglesImpl (const AffAnglesImpl& old)
 {
+    _tilts    = old._tilts;
     _rolls    = old._rolls;
     _tiltPool = old._tiltPool;
     _rollPool = old._rollPool;
+    _views    = old._views;
+    _tiltOffsets = old._tiltOffsets;
     _minTilt  = old._minTilt;
     _maxTilt  = old._maxTilt;
+    _first    = old._first;
+    _last     = old._last;
 }
 
-void AffAnglesImpl::formRolls()
+void AffAnglesImpl::formRolls (const vector<unsigned int>& numRolls)
 {
-    _rolls = vector< vector<float> > (MaxPossibleTilt);
-    for (int iTilt = 0; iTilt != MaxPossibleTilt; ++iTilt)
+    CV_Assert (numRolls.size() == _tilts.size());
+    _rolls = vector< vector<float> > (numRolls.size());
+    for (int iTilt = 0; iTilt != numRolls.size(); ++iTilt)
     {
-        _rolls[iTilt] = vector<float> (NumRolls[iTilt]);
+        _rolls[iTilt] = vector<float> (numRolls[iTilt]);
         float roll = 0;
-        for (int iRoll = 0; iRoll != NumRolls[iTilt]; ++iRoll)
+        for (int iRoll = 0; iRoll != numRolls[iTilt]; ++iRoll)
         {
             _rolls[iTilt][iRoll] = roll;
-            roll += 180.f / NumRolls[iTilt];
+            roll += 180.f / numRolls[iTilt];
         }
     }
 }
@@ -166,40 +265,44 @@ void AffAnglesImpl::formPools()
 {
     _tiltPool.clear();
     _rollPool.clear();
+    _views.clear();
+    _tiltOffsets.clear();
     
-    for (int iTilt = 0; iTilt != MaxPossibleTilt; ++iTilt)
-        for (int iRoll = 0; iRoll != NumRolls[iTilt]; ++iRoll)
+    for (int iTilt = 0; iTilt != _tilts.size(); ++iTilt)
+    {
+        _tiltOffsets.push_back (_views.size());
+        for (int iRoll = 0; iRoll != _rolls[iTilt].size(); ++iRoll)
         {
-            _tiltPool.push_back (Tilts[iTilt]);
+            _tiltPool.push_back (_tilts[iTilt]);
             _rollPool.push_back (_rolls[iTilt][iRoll]);
+            _views.push_back (makeView (_tilts[iTilt], _rolls[iTilt][iRoll]));
         }
+    }
+    _tiltOffsets.push_back (_views.size());
 }
 
-void AffAnglesImpl::getActiveViewIds (unsigned int* first, unsigned int* last) const
+void AffAnglesImpl::updateActiveViewIds()
 {
-    CV_Assert (_minTilt < _maxTilt);
-    CV_Assert (_maxTilt < MaxPossibleTilt);
-
-    // count views till _minTilt and till _maxTilt
-    *first = 0, *last = 0;
-    for (int iTilt = 0; iTilt != _minTilt; ++iTilt)
-        *first += NumRolls[iTilt];
-    for (int iTilt = 0; iTilt != _maxTilt; ++iTilt)
-        *last  += NumRolls[iTilt];
+    // min and max are set one after the other, so the range may be empty in between
+    if (_minTilt < _maxTilt)
+    {
+        _first = _tiltOffsets[_minTilt];
+        _last  = _tiltOffsets[_maxTilt];
+    }
+    else
+        _first = _last = 0;
 }
 
 vector<float> AffAnglesImpl::getActiveTilts() const
 {
-    unsigned int first, last;
-    getActiveViewIds (&first, &last);
-    return vector<float> (_tiltPool.begin() + first, _tiltPool.begin() + last);
+    CV_Assert (_minTilt < _maxTilt);
+    return vector<float> (_tiltPool.begin() + _first, _tiltPool.begin() + _last);
 }
 
 vector<float> AffAnglesImpl::getActiveRolls() const
 {
-    unsigned int first, last;
-    getActiveViewIds (&first, &last);
-    return vector<float> (_rollPool.begin() + first, _rollPool.begin() + last);
+    CV_Assert (_minTilt < _maxTilt);
+    return vector<float> (_rollPool.begin() + _first, _rollPool.begin() + _last);
 }
 
 void AffAnglesImpl::printActiveAngles (std::ostream& os) const
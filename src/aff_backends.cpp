@@ -0,0 +1,177 @@
+/*M///////////////////////////////////////////////////////////////////////////////////////
+//
+//  An OpenCV Implementation of affine-covariant matching (matching with different viewpoints)
+//  Further Information Refer to:
+//  Author: Evgeny Toropov
+//  etoropov@andrew.cmu.edu
+//
+// IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+// 
+// By downloading, copying, installing or using the software you agree to this license.
+// If you do not agree to this license, do not download, install,
+// copy or use the software.
+// 
+// 
+//                           License Agreement
+//                For Open Source Computer Vision Library
+// 
+// Copyright (C) 2000-2008, Intel Corporation, all rights reserved.
+// Copyright (C) 2008-2013, Willow Garage Inc., all rights reserved.
+// Third party copyrights are property of their respective owners.
+// 
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+// 
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+// 
+//   * The name of the copyright holders may not be used to endorse or promote products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is" and
+// any express or implied warranties, including, but not limited to, the implied
+// warranties of merchantability and fitness for a particular purpose are disclaimed.
+// In no event shall the Intel Corporation or contributors be liable for any direct,
+// indirect, incidental, special, exemplary, or consequential damages
+// (including, but not limited to, procurement of substitute goods or services;
+// loss of use, data, or profits; or business interruption) however caused
+// and on any theory of liability, whether in contract, strict liability,
+// or tort (including negligence or otherwise) arising in any way out of
+// the use of this software, even if advised of the possibility of such damage.
+//
+//M*/
+
+#include <cmath>
+#include <algorithm>
+
+#include <opencv2/xfeatures2d.hpp>
+
+#include "aff_features2d.hpp"
+
+
+using namespace std;
+
+namespace cv { namespace affma {
+
+
+
+/*
+ *  AKAZE describes a keypoint on the layer of its nonlinear scale space given by
+ *    KeyPoint::class_id, but affine detection sets class_id to the view id.
+ *    The layer is recovered from the size of keypoint, which the affine extractor
+ *    restores in the warped view: size = 2 * 1.6 * 2^(layer / nOctaveLayers),
+ *    up to subpixel refinement of scale. The view ids are put back after describing
+ */
+class AkazeExtractorAdapter : public Feature2D {
+    Ptr<AKAZE>  _akaze;
+public:
+    AkazeExtractorAdapter (const Ptr<AKAZE>& akaze) : _akaze(akaze) { }
+    
+    virtual int  descriptorSize() const  { return _akaze->descriptorSize(); }
+    virtual int  descriptorType() const  { return _akaze->descriptorType(); }
+    virtual int  defaultNorm() const     { return _akaze->defaultNorm(); }
+    virtual bool empty() const           { return _akaze->empty(); }
+    
+    virtual void detectAndCompute (InputArray image, InputArray mask,
+                                   std::vector<KeyPoint>& keypoints,
+                                   OutputArray descriptors,
+                                   bool useProvidedKeypoints = false)
+    {
+        if (!useProvidedKeypoints)
+        {
+            _akaze->detectAndCompute (image, mask, keypoints, descriptors, false);
+            return;
+        }
+        
+        const int numLayers = _akaze->getNOctaves() * _akaze->getNOctaveLayers();
+        vector<int> classIds (keypoints.size());
+        for (size_t i = 0; i != keypoints.size(); ++i)
+        {
+            KeyPoint& keypoint = keypoints[i];
+            classIds[i] = keypoint.class_id;
+            int layer = cvRound (_akaze->getNOctaveLayers() * std::log (keypoint.size / 3.2f) / std::log (2.f));
+            keypoint.class_id = std::min (std::max (layer, 0), numLayers - 1);
+        }
+        
+        _akaze->detectAndCompute (image, mask, keypoints, descriptors, true);
+        
+        CV_Assert (keypoints.size() == classIds.size());
+        for (size_t i = 0; i != keypoints.size(); ++i)
+            keypoints[i].class_id = classIds[i];
+    }
+};
+
+
+
+vector<string> getFeatureBackendNames ()
+{
+    vector<string> names;
+    names.push_back ("sift");
+    names.push_back ("surf");
+    names.push_back ("orb");
+    names.push_back ("brisk");
+    names.push_back ("akaze");
+    return names;
+}
+
+
+void createFeatureBackend (const string& name,
+                           Ptr<FeatureDetector>& detector,
+                           Ptr<DescriptorExtractor>& extractor,
+                           Ptr<DescriptorMatcher>& matcher,
+                           int maxFeatures)
+{
+    if (name == "sift")
+    {
+        detector  = xfeatures2d::SIFT::create (std::max (maxFeatures, 0));
+        extractor = xfeatures2d::SIFT::create (std::max (maxFeatures, 0));
+    }
+    else if (name == "surf")
+    {
+        detector  = xfeatures2d::SURF::create ();
+        extractor = xfeatures2d::SURF::create ();
+    }
+    else if (name == "orb")
+    {
+        const int numFeatures = maxFeatures > 0 ? maxFeatures : 500;
+        detector  = ORB::create (numFeatures);
+        extractor = ORB::create (numFeatures);
+    }
+    else if (name == "brisk")
+    {
+        detector  = BRISK::create ();
+        extractor = BRISK::create ();
+    }
+    else if (name == "akaze")
+    {
+        detector  = AKAZE::create ();
+        extractor = Ptr<Feature2D> (new AkazeExtractorAdapter (AKAZE::create ()));
+    }
+    else
+        CV_Error (Error::StsBadArg, "createFeatureBackend: unknown feature type " + name);
+    
+    // binary descriptors are compared by Hamming distance, ORB with WTA_K > 2 needs HAMMING2
+    if (extractor->descriptorType() == CV_8U && extractor->defaultNorm() == NORM_HAMMING)
+        matcher = createHammingBFMatcher();
+    else if (extractor->descriptorType() == CV_8U)
+        matcher = new BFMatcher (extractor->defaultNorm());
+    else
+        matcher = createL2BFMatcher();
+}
+
+
+Ptr<DescriptorMatcher> createGlobalIndexMatcher (int descriptorType, int numTrees, int numChecks)
+{
+    Ptr<flann::SearchParams> searchParams = new flann::SearchParams (numChecks);
+    if (descriptorType == CV_8U)
+        return new FlannBasedMatcher (new flann::LshIndexParams (2 * numTrees, 15, 2), searchParams);
+    else
+        return new FlannBasedMatcher (new flann::KDTreeIndexParams (numTrees), searchParams);
+}
+
+
+}} // namespace
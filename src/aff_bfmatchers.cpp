@@ -0,0 +1,610 @@
+/*M///////////////////////////////////////////////////////////////////////////////////////
+//
+//  An OpenCV Implementation of affine-covariant matching (matching with different viewpoints)
+//  Further Information Refer to:
+//  Author: Evgeny Toropov
+//  etoropov@andrew.cmu.edu
+//
+// IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+// 
+// By downloading, copying, installing or using the software you agree to this license.
+// If you do not agree to this license, do not download, install,
+// copy or use the software.
+// 
+// 
+//                           License Agreement
+//                For Open Source Computer Vision Library
+// 
+// Copyright (C) 2000-2008, Intel Corporation, all rights reserved.
+// Copyright (C) 2008-2013, Willow Garage Inc., all rights reserved.
+// Third party copyrights are property of their respective owners.
+// 
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+// 
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+// 
+//   * The name of the copyright holders may not be used to endorse or promote products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is" and
+// any express or implied warranties, including, but not limited to, the implied
+// warranties of merchantability and fitness for a particular purpose are disclaimed.
+// In no event shall the Intel Corporation or contributors be liable for any direct,
+// indirect, incidental, special, exemplary, or consequential damages
+// (including, but not limited to, procurement of substitute goods or services;
+// loss of use, data, or profits; or business interruption) however caused
+// and on any theory of liability, whether in contract, strict liability,
+// or tort (including negligence or otherwise) arising in any way out of
+// the use of this software, even if advised of the possibility of such damage.
+//
+//M*/
+
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <climits>
+#include <algorithm>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "aff_features2d.hpp"
+
+
+using namespace std;
+
+namespace cv { namespace affma {
+
+
+
+/****************************************************************************************\
+*                              Brute-force matchers                                      *
+\****************************************************************************************/
+
+//
+// View pairs have from hundreds to thousands of descriptors, too few for an index
+//   to pay off. These matchers compare all pairs of rows, block by block, so that
+//   a block of train rows stays in cache while a block of query rows goes through it.
+//   Only the k best matches of every query row are kept while scanning, and ratioMatch
+//   applies the ratio test to the two best without building kNN lists.
+//
+
+namespace {
+
+const int QueryBlockRows = 32;
+const int TrainBlockRows = 256;
+
+
+// k best (distance, trainIdx, imgIdx) of every query row, sorted by distance
+template<typename DistT>
+class TopK {
+    const int           _k;
+    vector<DistT>       _dists;
+    vector<int>         _trainIdx, _imgIdx;
+    vector<int>         _counts;
+public:
+    TopK (int numRows, int k)
+      : _k(k), _dists(size_t(numRows) * k), _trainIdx(size_t(numRows) * k),
+        _imgIdx(size_t(numRows) * k), _counts(numRows, 0) { }
+    
+    // worst kept distance, or 'none' while fewer than k are kept
+    DistT bound (int row, DistT none) const
+        { return _counts[row] < _k ? none : _dists[size_t(row) * _k + _k - 1]; }
+    
+    void insert (int row, DistT dist, int trainIdx, int imgIdx)
+    {
+        DistT* dists    = &_dists[size_t(row) * _k];
+        int*   trainIdxs = &_trainIdx[size_t(row) * _k];
+        int*   imgIdxs   = &_imgIdx[size_t(row) * _k];
+        int&   count = _counts[row];
+        
+        // equal distances keep the earlier train row first, as BFMatcher does
+        int pos = std::min (count, _k - 1);
+        if (count == _k && !(dist < dists[pos])) return;
+        for (; pos > 0 && dist < dists[pos-1]; --pos)
+        {
+            dists[pos] = dists[pos-1];
+            trainIdxs[pos] = trainIdxs[pos-1];
+            imgIdxs[pos] = imgIdxs[pos-1];
+        }
+        dists[pos] = dist;
+        trainIdxs[pos] = trainIdx;
+        imgIdxs[pos] = imgIdx;
+        count = std::min (count + 1, _k);
+    }
+    
+    template<class Distance>
+    void getMatches (vector<vector<DMatch> >& matches, bool compactResult) const
+    {
+        const int numRows = int(_counts.size());
+        matches.clear();
+        matches.reserve (numRows);
+        for (int row = 0; row != numRows; ++row)
+        {
+            if (compactResult && _counts[row] == 0) continue;
+            matches.push_back (vector<DMatch>());
+            vector<DMatch>& rowMatches = matches.back();
+            rowMatches.reserve (_counts[row]);
+            for (int i = 0; i != _counts[row]; ++i)
+            {
+                const size_t j = size_t(row) * _k + i;
+                rowMatches.push_back (DMatch (row, _trainIdx[j], _imgIdx[j],
+                                              Distance::toDistance (_dists[j])));
+            }
+        }
+    }
+    
+    // best matches that pass the ratio test, needs k >= 2
+    template<class Distance>
+    void getRatioMatches (vector<DMatch>& matches, float threshNNDR) const
+    {
+        CV_Assert (_k >= 2);
+        for (int row = 0; row != int(_counts.size()); ++row)
+        {
+            if (_counts[row] < 2) continue;
+            const size_t j = size_t(row) * _k;
+            const float dist1 = Distance::toDistance (_dists[j]);
+            const float dist2 = Distance::toDistance (_dists[j + 1]);
+            if (dist2 != 0 && dist1 / dist2 < threshNNDR)
+                matches.push_back (DMatch (row, _trainIdx[j], _imgIdx[j], dist1));
+        }
+    }
+};
+
+
+// best query row of every train row, for cross-check. It is updated with all distances
+//   of the forward scan, so no reverse scan is needed. Equal distances keep the earlier row
+template<typename DistT>
+struct ColumnBest {
+    vector<DistT>  dists;
+    vector<int>    queryIdx;
+    
+    ColumnBest (int numTrainRows, DistT none) : dists(numTrainRows, none), queryIdx(numTrainRows, -1) { }
+    
+    void update (int q, int t, DistT dist)
+        { if (dist < dists[t]) { dists[t] = dist; queryIdx[t] = q; } }
+    
+    bool isMutual (const DMatch& match) const  { return queryIdx[match.trainIdx] == match.queryIdx; }
+};
+
+
+//
+// Hamming distance
+//
+
+inline uint64 load64 (const uchar* p)
+{
+    uint64 value;
+    memcpy (&value, p, sizeof(value));
+    return value;
+}
+
+inline int popcount64 (uint64 x)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll (x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return int((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+
+#ifdef __AVX2__
+// popcount of bytes by nibble lookup, summed into four 64-bit lanes
+inline __m256i popcount256 (__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8 (0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                             0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowMask = _mm256_set1_epi8 (0x0f);
+    const __m256i lo = _mm256_and_si256 (v, lowMask);
+    const __m256i hi = _mm256_and_si256 (_mm256_srli_epi16 (v, 4), lowMask);
+    const __m256i counts = _mm256_add_epi8 (_mm256_shuffle_epi8 (lookup, lo),
+                                            _mm256_shuffle_epi8 (lookup, hi));
+    return _mm256_sad_epu8 (counts, _mm256_setzero_si256());
+}
+#endif
+
+
+// Hamming distance of two rows of 'numBytes' bytes
+//   256 and 512-bit descriptors (ORB, BRISK) go through whole 32-byte chunks with AVX2,
+//   otherwise through 64-bit words with popcount. Tail bytes (AKAZE has 61) are counted last
+inline int hammingDistance (const uchar* a, const uchar* b, int numBytes)
+{
+    int dist = 0, i = 0;
+#ifdef __AVX2__
+    if (numBytes >= 32)
+    {
+        __m256i sum = _mm256_setzero_si256();
+        for (; i + 32 <= numBytes; i += 32)
+        {
+            const __m256i va = _mm256_loadu_si256 ((const __m256i*)(a + i));
+            const __m256i vb = _mm256_loadu_si256 ((const __m256i*)(b + i));
+            sum = _mm256_add_epi64 (sum, popcount256 (_mm256_xor_si256 (va, vb)));
+        }
+        dist = int(_mm256_extract_epi64 (sum, 0) + _mm256_extract_epi64 (sum, 1)
+                 + _mm256_extract_epi64 (sum, 2) + _mm256_extract_epi64 (sum, 3));
+    }
+#endif
+    for (; i + 8 <= numBytes; i += 8)
+        dist += popcount64 (load64 (a + i) ^ load64 (b + i));
+    for (; i < numBytes; ++i)
+        dist += popcount64 (uint64(a[i] ^ b[i]));
+    return dist;
+}
+
+
+struct HammingDistance {
+    typedef int DistT;
+    static const int Type = CV_8U;
+    
+    static float toDistance (int dist)         { return float(dist); }
+    static int   fromDistance (float dist)     // dist < d is the same as dist < ceil(d)
+        { return dist >= float(INT_MAX) ? INT_MAX : int(std::ceil (dist)); }
+    
+    // calls 'visit(queryRow, trainRow, distance)' for pairs closer than bounds[queryRow],
+    //   'visit' returns the new bound for the query row. 'columns' gets all distances, or is null
+    template<typename Visitor>
+    static void scan (const Mat& query, const Mat& train, vector<int>& bounds, Visitor visit,
+                      ColumnBest<int>* columns = 0)
+    {
+        for (int q0 = 0; q0 < query.rows; q0 += QueryBlockRows)
+            for (int t0 = 0; t0 < train.rows; t0 += TrainBlockRows)
+            {
+                const int q1 = std::min (q0 + QueryBlockRows, query.rows);
+                const int t1 = std::min (t0 + TrainBlockRows, train.rows);
+                for (int q = q0; q != q1; ++q)
+                {
+                    const uchar* queryRow = query.ptr<uchar>(q);
+                    int bound = bounds[q];
+                    for (int t = t0; t != t1; ++t)
+                    {
+                        const int dist = hammingDistance (queryRow, train.ptr<uchar>(t), query.cols);
+                        if (columns)
+                            columns->update (q, t, dist);
+                        if (dist < bound)
+                            bound = visit (q, t, dist);
+                    }
+                    bounds[q] = bound;
+                }
+            }
+    }
+};
+
+
+//
+// L2 distance, squared while scanning
+//
+
+// dot products of four query rows with one train row. Lanes are accumulated separately,
+//   so that the compiler vectorizes the loop without reordering of float sums
+inline void dot4 (const float* a0, const float* a1, const float* a2, const float* a3,
+                  const float* b, int n, float dots[4])
+{
+    const int Lanes = 8;
+    float s0[Lanes] = {0}, s1[Lanes] = {0}, s2[Lanes] = {0}, s3[Lanes] = {0};
+    int i = 0;
+    for (; i + Lanes <= n; i += Lanes)
+        for (int l = 0; l != Lanes; ++l)
+        {
+            const float bl = b[i + l];
+            s0[l] += a0[i + l] * bl;
+            s1[l] += a1[i + l] * bl;
+            s2[l] += a2[i + l] * bl;
+            s3[l] += a3[i + l] * bl;
+        }
+    for (int l = 1; l != Lanes; ++l)
+    {
+        s0[0] += s0[l];  s1[0] += s1[l];  s2[0] += s2[l];  s3[0] += s3[l];
+    }
+    for (; i < n; ++i)
+    {
+        s0[0] += a0[i] * b[i];  s1[0] += a1[i] * b[i];  s2[0] += a2[i] * b[i];  s3[0] += a3[i] * b[i];
+    }
+    dots[0] = s0[0];  dots[1] = s1[0];  dots[2] = s2[0];  dots[3] = s3[0];
+}
+
+void squaredNorms (const Mat& descriptors, vector<float>& norms)
+{
+    norms.resize (descriptors.rows);
+    for (int row = 0; row != descriptors.rows; ++row)
+    {
+        const float* p = descriptors.ptr<float>(row);
+        float sum = 0;
+        for (int i = 0; i != descriptors.cols; ++i)
+            sum += p[i] * p[i];
+        norms[row] = sum;
+    }
+}
+
+struct L2Distance {
+    typedef float DistT;
+    static const int Type = CV_32F;
+    
+    static float toDistance (float dist2)      { return std::sqrt (dist2); }
+    static float fromDistance (float dist)     { return dist * dist; }
+    
+    // same as HammingDistance::scan, distances are computed as |a|^2 + |b|^2 - 2ab
+    template<typename Visitor>
+    static void scan (const Mat& query, const Mat& train, vector<float>& bounds, Visitor visit,
+                      ColumnBest<float>* columns = 0)
+    {
+        vector<float> queryNorms, trainNorms;
+        squaredNorms (query, queryNorms);
+        squaredNorms (train, trainNorms);
+        
+        for (int q0 = 0; q0 < query.rows; q0 += QueryBlockRows)
+            for (int t0 = 0; t0 < train.rows; t0 += TrainBlockRows)
+            {
+                const int q1 = std::min (q0 + QueryBlockRows, query.rows);
+                const int t1 = std::min (t0 + TrainBlockRows, train.rows);
+                
+                // four query rows at a time, the last rows are repeated to fill four
+                for (int q = q0; q < q1; q += 4)
+                {
+                    const float* rows[4];
+                    float bound[4];
+                    for (int r = 0; r != 4; ++r)
+                    {
+                        rows[r] = query.ptr<float>(std::min (q + r, q1 - 1));
+                        bound[r] = (q + r < q1) ? bounds[q + r] : -1.f;
+                    }
+                    
+                    for (int t = t0; t != t1; ++t)
+                    {
+                        float dots[4];
+                        dot4 (rows[0], rows[1], rows[2], rows[3], train.ptr<float>(t), query.cols, dots);
+                        for (int r = 0; r != 4 && q + r < q1; ++r)
+                        {
+                            const float dist2 = std::max (0.f, queryNorms[q + r] + trainNorms[t]
+                                                               - 2 * dots[r]);
+                            if (columns)
+                                columns->update (q + r, t, dist2);
+                            if (dist2 < bound[r])
+                                bound[r] = visit (q + r, t, dist2);
+                        }
+                    }
+                    
+                    for (int r = 0; r != 4 && q + r < q1; ++r)
+                        bounds[q + r] = bound[r];
+                }
+            }
+    }
+};
+
+
+//
+// L2 distance on 8-bit codes, e.g. quantized float descriptors. Squared and exact in int
+//
+
+inline int squaredDifference (const uchar* a, const uchar* b, int n)
+{
+    int sum = 0;
+    for (int i = 0; i != n; ++i)
+    {
+        const int d = int(a[i]) - int(b[i]);
+        sum += d * d;
+    }
+    return sum;
+}
+
+struct L2Distance8U {
+    typedef int DistT;
+    static const int Type = CV_8U;
+    
+    static float toDistance (int dist2)        { return std::sqrt (float(dist2)); }
+    static int   fromDistance (float dist)     // dist2 < d^2 is the same as dist2 < ceil(d^2)
+        { return dist >= 46340.f ? INT_MAX : int(std::ceil (dist * dist)); }
+    
+    // same as HammingDistance::scan
+    template<typename Visitor>
+    static void scan (const Mat& query, const Mat& train, vector<int>& bounds, Visitor visit,
+                      ColumnBest<int>* columns = 0)
+    {
+        for (int q0 = 0; q0 < query.rows; q0 += QueryBlockRows)
+            for (int t0 = 0; t0 < train.rows; t0 += TrainBlockRows)
+            {
+                const int q1 = std::min (q0 + QueryBlockRows, query.rows);
+                const int t1 = std::min (t0 + TrainBlockRows, train.rows);
+                for (int q = q0; q != q1; ++q)
+                {
+                    const uchar* queryRow = query.ptr<uchar>(q);
+                    int bound = bounds[q];
+                    for (int t = t0; t != t1; ++t)
+                    {
+                        const int dist2 = squaredDifference (queryRow, train.ptr<uchar>(t), query.cols);
+                        if (columns)
+                            columns->update (q, t, dist2);
+                        if (dist2 < bound)
+                            bound = visit (q, t, dist2);
+                    }
+                    bounds[q] = bound;
+                }
+            }
+    }
+};
+
+} // namespace
+
+
+
+//
+// Brute-force matcher with one of the distances above
+//
+
+template<class Distance>
+class BFMatcherImpl : public AffBFMatcher {
+    typedef typename Distance::DistT DistT;
+    
+    static DistT none()  { return std::numeric_limits<DistT>::max(); }
+    
+    static void checkTypes (const Mat& query, const Mat& train)
+    {
+        CV_Assert (query.type() == Distance::Type && train.type() == Distance::Type);
+        CV_Assert (query.cols == train.cols);
+    }
+    
+public:
+    virtual ~BFMatcherImpl() { }
+    
+    virtual bool isMaskSupported() const  { return false; }
+    
+    virtual Ptr<DescriptorMatcher> clone (bool emptyTrainData = false) const
+    {
+        Ptr<BFMatcherImpl> matcher (new BFMatcherImpl());
+        if (!emptyTrainData)
+            matcher->add (trainDescCollection);
+        return matcher;
+    }
+    
+    virtual void ratioMatch (const Mat& queryDescriptors, const Mat& trainDescriptors,
+                             CV_OUT vector<DMatch>& matches, float threshNNDR,
+                             bool crossCheck = false) const;
+    
+    virtual void crossCheckMatch (const Mat& queryDescriptors, const Mat& trainDescriptors,
+                                  CV_OUT vector<DMatch>& matches) const;
+    
+protected:
+    virtual void knnMatchImpl (InputArray queryDescriptors, vector<vector<DMatch> >& matches, int k,
+                               InputArrayOfArrays masks = noArray(), bool compactResult = false);
+    
+    virtual void radiusMatchImpl (InputArray queryDescriptors, vector<vector<DMatch> >& matches,
+                                  float maxDistance,
+                                  InputArrayOfArrays masks = noArray(), bool compactResult = false);
+};
+
+
+template<class Distance>
+void BFMatcherImpl<Distance>::knnMatchImpl (InputArray queryDescriptors_,
+                                            vector<vector<DMatch> >& matches_, int k_,
+                                            InputArrayOfArrays /*masks*/, bool compactResult_)
+{
+    const Mat query = queryDescriptors_.getMat();
+    CV_Assert (k_ > 0);
+    
+    TopK<DistT> best (query.rows, k_);
+    vector<DistT> bounds (query.rows, none());
+    for (int imgIdx = 0; imgIdx != int(trainDescCollection.size()); ++imgIdx)
+    {
+        const Mat& train = trainDescCollection[imgIdx];
+        if (train.empty() || query.empty()) continue;
+        checkTypes (query, train);
+        Distance::scan (query, train, bounds, [&](int q, int t, DistT dist) {
+            best.insert (q, dist, t, imgIdx);
+            return best.bound (q, none());
+        });
+    }
+    
+    best.template getMatches<Distance> (matches_, compactResult_);
+}
+
+
+template<class Distance>
+void BFMatcherImpl<Distance>::radiusMatchImpl (InputArray queryDescriptors_,
+                                               vector<vector<DMatch> >& matches_, float maxDistance_,
+                                               InputArrayOfArrays /*masks*/, bool compactResult_)
+{
+    const Mat query = queryDescriptors_.getMat();
+    const DistT maxDistance = Distance::fromDistance (maxDistance_);
+    
+    matches_.assign (query.rows, vector<DMatch>());
+    for (int imgIdx = 0; imgIdx != int(trainDescCollection.size()); ++imgIdx)
+    {
+        const Mat& train = trainDescCollection[imgIdx];
+        if (train.empty() || query.empty()) continue;
+        checkTypes (query, train);
+        vector<DistT> bounds (query.rows, maxDistance);
+        Distance::scan (query, train, bounds, [&](int q, int t, DistT dist) {
+            matches_[q].push_back (DMatch (q, t, imgIdx, Distance::toDistance (dist)));
+            return maxDistance;
+        });
+    }
+    
+    for (size_t q = 0; q != matches_.size(); ++q)
+        std::stable_sort (matches_[q].begin(), matches_[q].end());
+    if (compactResult_)
+        matches_.erase (std::remove_if (matches_.begin(), matches_.end(),
+                                        [](const vector<DMatch>& row) { return row.empty(); }),
+                        matches_.end());
+}
+
+
+// the two best are found while scanning, and only the matches that pass are written
+template<class Distance>
+void BFMatcherImpl<Distance>::ratioMatch (const Mat& query, const Mat& train,
+                                          CV_OUT vector<DMatch>& matches_, float threshNNDR,
+                                          bool crossCheck) const
+{
+    matches_.clear();
+    if (query.empty() || train.empty() || threshNNDR <= 0) return;
+    checkTypes (query, train);
+    
+    TopK<DistT> best (query.rows, 2);
+    vector<DistT> bounds (query.rows, none());
+    ColumnBest<DistT> columns (crossCheck ? train.rows : 0, none());
+    Distance::scan (query, train, bounds, [&](int q, int t, DistT dist) {
+        best.insert (q, dist, t, 0);
+        return best.bound (q, none());
+    }, crossCheck ? &columns : 0);
+    
+    best.template getRatioMatches<Distance> (matches_, threshNNDR);
+    if (crossCheck)
+        matches_.erase (std::remove_if (matches_.begin(), matches_.end(),
+                                        [&](const DMatch& m) { return !columns.isMutual (m); }),
+                        matches_.end());
+}
+
+
+// nearest neighbours both ways, in one scan
+template<class Distance>
+void BFMatcherImpl<Distance>::crossCheckMatch (const Mat& query, const Mat& train,
+                                               CV_OUT vector<DMatch>& matches_) const
+{
+    matches_.clear();
+    if (query.empty() || train.empty()) return;
+    checkTypes (query, train);
+    
+    TopK<DistT> best (query.rows, 1);
+    vector<DistT> bounds (query.rows, none());
+    ColumnBest<DistT> columns (train.rows, none());
+    Distance::scan (query, train, bounds, [&](int q, int t, DistT dist) {
+        best.insert (q, dist, t, 0);
+        return best.bound (q, none());
+    }, &columns);
+    
+    vector<vector<DMatch> > matchesKnn;
+    best.template getMatches<Distance> (matchesKnn, true);
+    for (size_t i = 0; i != matchesKnn.size(); ++i)
+        if (columns.isMutual (matchesKnn[i][0]))
+            matches_.push_back (matchesKnn[i][0]);
+}
+
+
+
+Ptr<DescriptorMatcher> createHammingBFMatcher ()
+{
+    return Ptr<DescriptorMatcher> (new BFMatcherImpl<HammingDistance>());
+}
+
+
+Ptr<DescriptorMatcher> createL2BFMatcher (int descriptorType)
+{
+    CV_Assert (descriptorType == CV_32F || descriptorType == CV_8U);
+    if (descriptorType == CV_8U)
+        return Ptr<DescriptorMatcher> (new BFMatcherImpl<L2Distance8U>());
+    return Ptr<DescriptorMatcher> (new BFMatcherImpl<L2Distance>());
+}
+
+
+
+
+}} // namespaces
@@ -0,0 +1,798 @@
+/*M///////////////////////////////////////////////////////////////////////////////////////
+//
+//  An OpenCV Implementation of affine-covariant matching (matching with different viewpoints)
+//  Further Information Refer to:
+//  Author: Evgeny Toropov
+//  etoropov@andrew.cmu.edu
+//
+// IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+// 
+// By downloading, copying, installing or using the software you agree to this license.
+// If you do not agree to this license, do not download, install,
+// copy or use the software.
+// 
+// 
+//                           License Agreement
+//                For Open Source Computer Vision Library
+// 
+// Copyright (C) 2000-2008, Intel Corporation, all rights reserved.
+// Copyright (C) 2008-2013, Willow Garage Inc., all rights reserved.
+// Third party copyrights are property of their respective owners.
+// 
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+// 
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+// 
+//   * The name of the copyright holders may not be used to endorse or promote products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is" and
+// any express or implied warranties, including, but not limited to, the implied
+// warranties of merchantability and fitness for a particular purpose are disclaimed.
+// In no event shall the Intel Corporation or contributors be liable for any direct,
+// indirect, incidental, special, exemplary, or consequential damages
+// (including, but not limited to, procurement of substitute goods or services;
+// loss of use, data, or profits; or business interruption) however caused
+// and on any theory of liability, whether in contract, strict liability,
+// or tort (including negligence or otherwise) arising in any way out of
+// the use of this software, even if advised of the possibility of such damage.
+//
+//M*/
+
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <memory>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <opencv2/flann/miniflann.hpp>
+
+#include "aff_features2d.hpp"
+
+
+using namespace std;
+
+namespace cv { namespace affma {
+
+
+
+/****************************************************************************************\
+*                                  Image database                                        *
+\****************************************************************************************/
+
+
+namespace {
+
+using boost::interprocess::mapped_region;
+
+const char     DatabaseMagic[4] = { 'A', 'F', 'D', 'B' };
+const int32_t  DatabaseVersion  = 3;
+
+// candidates per query descriptor: the best one and enough others to get past
+//   its duplicates in other views of the same image
+const int   KnnPerQuery = 16;
+
+// rows of one block, indices of its FLANN index and rows of its Mat-s are int
+const int64 MaxBlockRows = int64(1) << 30;
+
+// keypoints of a block as (x, y, size, angle, response) floats and (octave, class_id) ints
+const int   NumPointFields = 5;
+const int   NumIdFields    = 2;
+
+struct DatabaseHeader {
+    char      magic[4];
+    int32_t   version;
+    int32_t   numImages;
+    int32_t   descriptorType;
+    int32_t   descriptorCols;
+    int32_t   maxTilt;
+    int32_t   featureTypeLength;    // chars follow the header
+    int32_t   numWords;             // of the inverted files, 0 without them
+    int32_t   numBlocks;
+    int32_t   reserved;
+    int64_t   numKeypoints;
+    int64_t   offsetsOffset;        // image offsets, all offsets are from the start of file
+    int64_t   blocksOffset;         // table of BlockRecord
+};
+static_assert (sizeof(DatabaseHeader) == 64, "DatabaseHeader must take 64 bytes");
+
+struct BlockRecord {
+    int32_t   firstImage;
+    int32_t   numRows;
+    int64_t   pointsOffset;
+    int64_t   idsOffset;
+    int64_t   descriptorsOffset;
+    int64_t   wordsOffset;          // word offsets then postings, 0 without an inverted file
+};
+static_assert (sizeof(BlockRecord) == 40, "BlockRecord must take 40 bytes");
+
+int64 alignUp (int64 offset, int64 alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+void padTo (ofstream& ofs, int64 offset)
+{
+    const int64 position = int64(ofs.tellp());
+    CV_Assert (position <= offset);
+    const vector<char> zeros (size_t(offset - position), 0);
+    if (!zeros.empty()) ofs.write (&zeros[0], zeros.size());
+}
+
+template<typename T> void writeRaw (ofstream& ofs, const T* data, size_t n)
+    { if (n) ofs.write ((const char*)data, n * sizeof(T)); }
+
+void writeMat (ofstream& ofs, const Mat& m)
+{
+    for (int row = 0; row != m.rows; ++row)
+        writeRaw (ofs, m.ptr<char>(row), m.cols * m.elemSize());
+}
+
+// Mat-s over the mapping share it, the last of them and the database unmap the file
+class MappedRegionAllocator : public MatAllocator {
+public:
+    UMatData* allocate (int, const int*, int, void*, size_t*, int, UMatUsageFlags) const
+    {
+        return 0;
+    }
+    bool allocate (UMatData*, int, UMatUsageFlags) const
+    {
+        return false;
+    }
+    void deallocate (UMatData* u) const
+    {
+        if (!u) return;
+        CV_Assert (u->urefcount == 0 && u->refcount == 0);
+        delete static_cast<std::shared_ptr<mapped_region>*>(u->userdata);
+        delete u;
+    }
+};
+
+Mat mapMat (const std::shared_ptr<mapped_region>& region, int64 offset, int rows, int cols, int type)
+{
+    if (!rows || !cols) return Mat();
+    static const MappedRegionAllocator* allocator = new MappedRegionAllocator;
+    UMatData* u = new UMatData (allocator);
+    u->data = u->origdata = static_cast<uchar*>(region->get_address()) + offset;
+    u->size = size_t(rows) * cols * CV_ELEM_SIZE(type);
+    u->userdata = new std::shared_ptr<mapped_region> (region);
+    u->refcount = 1;
+    
+    Mat m (rows, cols, type, u->data);
+    m.u = u;
+    return m;
+}
+
+// FLANN index of block b goes next to the database file
+string indexPath (const string& filepath, int block)
+{
+    ostringstream path;
+    path << filepath << ".flann" << block;
+    return path.str();
+}
+
+bool byNumMatches (const AffImageCandidate& a, const AffImageCandidate& b)
+    { return a.matches.size() > b.matches.size(); }
+
+// a match of a query descriptor with a row of all images
+struct IndexMatch {
+    float  distance;
+    int64  row;
+    IndexMatch (float _distance, int64 _row) : distance(_distance), row(_row) { }
+    bool operator< (const IndexMatch& other) const { return distance < other.distance; }
+};
+
+// the KnnPerQuery best ones, sorted
+void keepBest (vector<IndexMatch>& matches)
+{
+    std::stable_sort (matches.begin(), matches.end());
+    if (matches.size() > KnnPerQuery) matches.erase (matches.begin() + KnnPerQuery, matches.end());
+}
+
+} // namespace
+
+
+
+class AffImageDatabaseImpl : public AffImageDatabase {
+private:
+
+    // images [firstImage, firstImage of the next block), heap Mat-s when added, mapped when loaded
+    struct Block {
+        int                firstImage;
+        Mat                points;        // rows x NumPointFields, CV_32F
+        Mat                ids;           // rows x NumIdFields, CV_32S
+        Mat                descriptors;
+        Mat                wordOffsets;   // 1 x (numWords + 1), CV_32S, empty without inverted file
+        Mat                postings;      // 1 x rows, CV_32S, rows of word w are from wordOffsets[w]
+        Ptr<flann::Index>  index;         // without inverted file
+    };
+
+    const float             _duplicateRadius;
+    const int               _numTrees, _numChecks;
+    string                  _featureType;
+    int                     _maxTilt;
+    
+    // features of all images one after another, image i has rows [_offsets[i], _offsets[i+1])
+    vector<int64>           _offsets;
+    vector<Block>           _blocks;
+    int                     _descriptorType;    // -1 before the first descriptors
+    int                     _descriptorCols;
+    int                     _numWords;          // of the inverted files, 0 without them
+    bool                    _trained;
+    string                  _mappedPath;        // the loaded file, it is mapped
+    
+    Ptr<AffVocabulary>      _vocabulary;
+    
+    int   imageOf (int64 row) const
+        { return int(upper_bound (_offsets.begin(), _offsets.end(), row) - _offsets.begin()) - 1; }
+    int   blockOf (int image) const;
+    int64 blockBegin (int block) const
+        { return _offsets[_blocks[block].firstImage]; }
+    Point2f pointOf (int64 row) const;
+    
+    Ptr<flann::Index>  buildIndex (const Mat& descriptors) const;
+    
+    // up to KnnPerQuery candidates of every query descriptor, sorted
+    void  searchBlocks (const Mat& queryDescriptors, vector<vector<IndexMatch> >& matchesKnn) const;
+    void  searchInvertedFile (const Mat& queryDescriptors, vector<vector<IndexMatch> >& matchesKnn) const;
+    
+    // the ratio test of the sorted candidates of one query descriptor,
+    //   against the best candidate that is not a duplicate of the best one
+    bool  passesRatio (const vector<IndexMatch>& candidates, float threshNNDR) const;
+    
+    // drops matches between the same points as a better match of the image
+    void  filterDuplicates (const vector<KeyPoint>& queryKeypoints, int imageId,
+                            vector<DMatch>& matches) const;
+
+public:
+    AffImageDatabaseImpl (float duplicateRadius, int numTrees, int numChecks)
+        : _duplicateRadius(duplicateRadius), _numTrees(numTrees), _numChecks(numChecks), _maxTilt(0),
+          _offsets(1, 0), _descriptorType(-1), _descriptorCols(0), _numWords(0), _trained(false)
+        { CV_Assert(_numTrees > 0 && _numChecks > 0); }
+    
+    void  setFeatureType (const string& featureType)  { _featureType = featureType; }
+    string getFeatureType () const                     { return _featureType; }
+    void  setMaxTilt (int maxTilt)                     { _maxTilt = maxTilt; }
+    int   getMaxTilt () const                          { return _maxTilt; }
+    void  setVocabulary (const Ptr<AffVocabulary>& vocabulary)  { _vocabulary = vocabulary; }
+    
+    int   addImage (const vector<KeyPoint>& keypoints, const Mat& descriptors);
+    int   getNumImages () const    { return int(_offsets.size()) - 1; }
+    void  getImageFeatures (int imageId, vector<KeyPoint>& keypoints, Mat& descriptors) const;
+    
+    void  train ();
+    bool  isTrained () const       { return _trained; }
+    
+    void  query (const vector<KeyPoint>& queryKeypoints, const Mat& queryDescriptors,
+                 vector<AffImageCandidate>& candidates, float threshNNDR,
+                 int numCandidates, int minMatches) const;
+    
+    void  save (const string& filepath) const;
+    void  load (const string& filepath);
+};
+
+
+int AffImageDatabaseImpl::blockOf (int image) const
+{
+    int first = 0, last = int(_blocks.size());
+    while (last - first > 1)
+    {
+        const int middle = (first + last) / 2;
+        if (_blocks[middle].firstImage <= image) first = middle; else last = middle;
+    }
+    return first;
+}
+
+
+Point2f AffImageDatabaseImpl::pointOf (int64 row) const
+{
+    const int block = blockOf (imageOf (row));
+    const float* fields = _blocks[block].points.ptr<float>(int(row - blockBegin(block)));
+    return Point2f (fields[0], fields[1]);
+}
+
+
+int AffImageDatabaseImpl::addImage (const vector<KeyPoint>& keypoints, const Mat& descriptors)
+{
+    CV_Assert (keypoints.size() == descriptors.rows && descriptors.rows <= MaxBlockRows);
+    CV_Assert (_descriptorType < 0 || descriptors.empty() ||
+               (descriptors.type() == _descriptorType && descriptors.cols == _descriptorCols));
+    
+    // an image that does not fit into the last block starts a new one
+    _offsets.push_back (_offsets.back() + int64(keypoints.size()));
+    if (_blocks.empty() || _offsets.back() - blockBegin (int(_blocks.size()) - 1) > MaxBlockRows)
+    {
+        _blocks.push_back (Block());
+        _blocks.back().firstImage = getNumImages() - 1;
+    }
+    
+    Block& block = _blocks.back();
+    const int n = int(keypoints.size());
+    if (n)
+    {
+        Mat points (n, NumPointFields, CV_32F), ids (n, NumIdFields, CV_32S);
+        for (int i = 0; i != n; ++i)
+        {
+            const KeyPoint& kp = keypoints[i];
+            float* fields = points.ptr<float>(i);
+            fields[0] = kp.pt.x;  fields[1] = kp.pt.y;  fields[2] = kp.size;
+            fields[3] = kp.angle; fields[4] = kp.response;
+            ids.at<int>(i, 0) = kp.octave;
+            ids.at<int>(i, 1) = kp.class_id;
+        }
+        block.points.push_back (points);
+        block.ids.push_back (ids);
+        block.descriptors.push_back (descriptors);
+        _descriptorType = descriptors.type();
+        _descriptorCols = descriptors.cols;
+    }
+    _trained = false;
+    return getNumImages() - 1;
+}
+
+
+void AffImageDatabaseImpl::getImageFeatures (int imageId, vector<KeyPoint>& keypoints,
+                                             Mat& descriptors) const
+{
+    CV_Assert (imageId >= 0 && imageId < getNumImages());
+    const int block = blockOf (imageId);
+    const int begin = int(_offsets[imageId] - blockBegin(block));
+    const int end = int(_offsets[imageId + 1] - blockBegin(block));
+    
+    keypoints.resize (end - begin);
+    for (int row = begin; row != end; ++row)
+    {
+        const float* fields = _blocks[block].points.ptr<float>(row);
+        const int* ids = _blocks[block].ids.ptr<int>(row);
+        keypoints[row - begin] = KeyPoint (fields[0], fields[1], fields[2], fields[3], fields[4],
+                                           ids[0], ids[1]);
+    }
+    descriptors = (begin == end) ? Mat() : _blocks[block].descriptors.rowRange(begin, end).clone();
+}
+
+
+// as createGlobalIndexMatcher, with a cv::flann::Index that can be saved
+Ptr<flann::Index> AffImageDatabaseImpl::buildIndex (const Mat& descriptors) const
+{
+    if (_descriptorType == CV_8U)
+        return new flann::Index (descriptors, flann::LshIndexParams (2 * _numTrees, 15, 2),
+                                 cvflann::FLANN_DIST_HAMMING);
+    else
+        return new flann::Index (descriptors, flann::KDTreeIndexParams (_numTrees),
+                                 cvflann::FLANN_DIST_L2);
+}
+
+
+void AffImageDatabaseImpl::train ()
+{
+    _numWords = _vocabulary ? _vocabulary->getNumWords() : 0;
+    for (int b = 0; b != _blocks.size(); ++b)
+    {
+        Block& block = _blocks[b];
+        block.index.release();
+        block.wordOffsets = Mat();
+        block.postings = Mat();
+        if (block.descriptors.empty()) continue;
+        
+        if (!_vocabulary)
+        {
+            block.index = buildIndex (block.descriptors);
+            continue;
+        }
+        
+        // words of all rows, then rows of every word in the order of rows
+        vector<int> words;
+        _vocabulary->quantize (block.descriptors, words);
+        block.wordOffsets = Mat::zeros (1, _numWords + 1, CV_32S);
+        int* wordOffsets = block.wordOffsets.ptr<int>();
+        for (int i = 0; i != words.size(); ++i)
+            ++wordOffsets[words[i] + 1];
+        for (int w = 0; w != _numWords; ++w)
+            wordOffsets[w + 1] += wordOffsets[w];
+        
+        block.postings.create (1, int(words.size()), CV_32S);
+        int* postings = block.postings.ptr<int>();
+        vector<int> filled (wordOffsets, wordOffsets + _numWords);
+        for (int i = 0; i != words.size(); ++i)
+            postings[filled[words[i]]++] = i;
+    }
+    _trained = true;
+}
+
+
+void AffImageDatabaseImpl::searchBlocks (const Mat& queryDescriptors,
+                                         vector<vector<IndexMatch> >& matchesKnn) const
+{
+    matchesKnn.assign (queryDescriptors.rows, vector<IndexMatch>());
+    
+    // rows of the index of a block are rows of its descriptors
+    Mat indices, distances;
+    for (int b = 0; b != _blocks.size(); ++b)
+    {
+        if (!_blocks[b].index) continue;
+        const int knn = std::min (KnnPerQuery, _blocks[b].descriptors.rows);
+        _blocks[b].index->knnSearch (queryDescriptors, indices, distances, knn,
+                                     flann::SearchParams (_numChecks));
+        
+        // Hamming distances are int, L2 ones are squared
+        for (int i = 0; i != indices.rows; ++i)
+            for (int j = 0; j != knn; ++j)
+            {
+                const int row = indices.at<int>(i, j);
+                if (row < 0) continue;
+                const float distance = (distances.type() == CV_32S) ? float(distances.at<int>(i, j))
+                                                                    : std::sqrt (distances.at<float>(i, j));
+                matchesKnn[i].push_back (IndexMatch (distance, blockBegin(b) + row));
+            }
+    }
+    
+    for (int i = 0; i != matchesKnn.size(); ++i)
+        keepBest (matchesKnn[i]);
+}
+
+
+void AffImageDatabaseImpl::searchInvertedFile (const Mat& queryDescriptors,
+                                               vector<vector<IndexMatch> >& matchesKnn) const
+{
+    if (!_vocabulary || _vocabulary->getNumWords() != _numWords)
+        CV_Error (Error::StsError, "AffImageDatabase::query: set the vocabulary of the inverted file");
+    CV_Assert (queryDescriptors.type() == _descriptorType && queryDescriptors.cols == _descriptorCols);
+    
+    vector<int> words;
+    _vocabulary->quantize (queryDescriptors, words);
+    
+    // exact distances to the rows of the same word, block by block
+    const int normType = (_descriptorType == CV_8U) ? NORM_HAMMING : NORM_L2;
+    matchesKnn.assign (queryDescriptors.rows, vector<IndexMatch>());
+    for (int b = 0; b != _blocks.size(); ++b)
+    {
+        const Block& block = _blocks[b];
+        if (block.postings.empty()) continue;
+        const int* wordOffsets = block.wordOffsets.ptr<int>();
+        const int* postings = block.postings.ptr<int>();
+        for (int i = 0; i != queryDescriptors.rows; ++i)
+        {
+            const Mat queryRow = queryDescriptors.row(i);
+            for (int p = wordOffsets[words[i]]; p != wordOffsets[words[i] + 1]; ++p)
+            {
+                if (postings[p] < 0 || postings[p] >= block.descriptors.rows)
+                    CV_Error (Error::StsError, "AffImageDatabase::query: broken inverted file");
+                const float distance = float(norm (queryRow, block.descriptors.row(postings[p]), normType));
+                matchesKnn[i].push_back (IndexMatch (distance, blockBegin(b) + postings[p]));
+            }
+            keepBest (matchesKnn[i]);
+        }
+    }
+}
+
+
+bool AffImageDatabaseImpl::passesRatio (const vector<IndexMatch>& candidates, float threshNNDR) const
+{
+    if (candidates.empty()) return false;
+    
+    const float radius2 = _duplicateRadius * _duplicateRadius;
+    const int bestImage = imageOf (candidates[0].row);
+    const Point2f bestPoint = pointOf (candidates[0].row);
+    for (unsigned long j = 1; j != candidates.size(); ++j)
+    {
+        const Point2f offset = pointOf (candidates[j].row) - bestPoint;
+        if (imageOf (candidates[j].row) == bestImage && offset.dot(offset) <= radius2) continue;
+        return candidates[j].distance != 0 &&
+               candidates[0].distance / candidates[j].distance < threshNNDR;
+    }
+    
+    // all candidates are duplicates, the 2nd best is not closer than the last of them
+    return candidates.size() == KnnPerQuery && candidates.back().distance != 0 &&
+           candidates[0].distance / candidates.back().distance < threshNNDR;
+}
+
+
+void AffImageDatabaseImpl::filterDuplicates (const vector<KeyPoint>& queryKeypoints, int imageId,
+                                             vector<DMatch>& matches) const
+{
+    std::stable_sort (matches.begin(), matches.end());
+    
+    const float radius2 = _duplicateRadius * _duplicateRadius;
+    vector<DMatch> kept;
+    vector<Point2f> keptTrainPoints;
+    for (unsigned long i = 0; i != matches.size(); ++i)
+    {
+        const Point2f queryPoint = queryKeypoints[matches[i].queryIdx].pt;
+        const Point2f trainPoint = pointOf (_offsets[imageId] + matches[i].trainIdx);
+        bool duplicate = false;
+        for (unsigned long j = 0; j != kept.size() && !duplicate; ++j)
+        {
+            const Point2f queryOffset = queryKeypoints[kept[j].queryIdx].pt - queryPoint;
+            const Point2f trainOffset = keptTrainPoints[j] - trainPoint;
+            duplicate = queryOffset.dot(queryOffset) <= radius2 && trainOffset.dot(trainOffset) <= radius2;
+        }
+        if (duplicate) continue;
+        kept.push_back (matches[i]);
+        keptTrainPoints.push_back (trainPoint);
+    }
+    matches.swap (kept);
+}
+
+
+void AffImageDatabaseImpl::query (const vector<KeyPoint>& queryKeypoints, const Mat& queryDescriptors,
+                                  vector<AffImageCandidate>& candidates, float threshNNDR,
+                                  int numCandidates, int minMatches) const
+{
+    if (!_trained)
+        CV_Error (Error::StsError, "AffImageDatabase::query: train() the database first");
+    CV_Assert (queryKeypoints.size() == queryDescriptors.rows);
+    
+    candidates.clear();
+    if (_descriptorType < 0 || queryDescriptors.empty()) return;
+    
+    // one search for all query descriptors
+    vector<vector<IndexMatch> > matchesKnn;
+    if (_numWords)
+        searchInvertedFile (queryDescriptors, matchesKnn);
+    else
+        searchBlocks (queryDescriptors, matchesKnn);
+    
+    // votes of matches for their images, trainIdx in keypoints of the image
+    map<int, vector<DMatch> > votes;
+    for (int i = 0; i != matchesKnn.size(); ++i)
+    {
+        if (!passesRatio (matchesKnn[i], threshNNDR)) continue;
+        const int imageId = imageOf (matchesKnn[i][0].row);
+        votes[imageId].push_back (DMatch (i, int(matchesKnn[i][0].row - _offsets[imageId]), imageId,
+                                          matchesKnn[i][0].distance));
+    }
+    
+    for (map<int, vector<DMatch> >::iterator it = votes.begin(); it != votes.end(); ++it)
+    {
+        if (it->second.size() < minMatches) continue;
+        filterDuplicates (queryKeypoints, it->first, it->second);
+        if (it->second.size() < minMatches) continue;
+        
+        AffImageCandidate candidate;
+        candidate.imageId = it->first;
+        candidate.matches.swap (it->second);
+        candidates.push_back (candidate);
+    }
+    
+    std::stable_sort (candidates.begin(), candidates.end(), byNumMatches);
+    if (numCandidates >= 0 && candidates.size() > numCandidates)
+        candidates.resize (numCandidates);
+}
+
+
+/*
+ *  File layout: DatabaseHeader, the feature type, int64 image offsets, a BlockRecord per block,
+ *    then every block: keypoints as rows of (x, y, size, angle, response) floats, rows of
+ *    (octave, class_id) ints, descriptors row by row, and if there is an inverted file,
+ *    int word offsets and postings. Arrays of blocks are aligned to 64 bytes for mapping.
+ *    In the byte order of the machine
+ */
+
+void AffImageDatabaseImpl::save (const string& filepath) const
+{
+    // the file may be mapped by this database
+    if (filepath == _mappedPath)
+        CV_Error (Error::StsError, "AffImageDatabase::save: cannot overwrite the loaded file " + filepath);
+    
+    DatabaseHeader header;
+    memset (&header, 0, sizeof(header));
+    memcpy (header.magic, DatabaseMagic, sizeof(header.magic));
+    header.version           = DatabaseVersion;
+    header.numImages         = getNumImages();
+    header.descriptorType    = _descriptorType < 0 ? CV_32F : _descriptorType;
+    header.descriptorCols    = _descriptorCols;
+    header.maxTilt           = _maxTilt;
+    header.featureTypeLength = int32_t(_featureType.size());
+    header.numWords          = _numWords;
+    header.numBlocks         = int32_t(_blocks.size());
+    header.numKeypoints      = _offsets.back();
+    header.offsetsOffset     = alignUp (sizeof(header) + _featureType.size(), 8);
+    header.blocksOffset      = header.offsetsOffset + int64(_offsets.size() * sizeof(int64));
+    
+    vector<BlockRecord> records (_blocks.size());
+    int64 position = header.blocksOffset + int64(records.size() * sizeof(BlockRecord));
+    for (int b = 0; b != _blocks.size(); ++b)
+    {
+        const Block& block = _blocks[b];
+        BlockRecord& record = records[b];
+        const int64 numRows = block.points.rows;
+        record.firstImage = block.firstImage;
+        record.numRows = int32_t(numRows);
+        record.pointsOffset = alignUp (position, 64);
+        record.idsOffset = alignUp (record.pointsOffset + numRows * NumPointFields * 4, 64);
+        record.descriptorsOffset = alignUp (record.idsOffset + numRows * NumIdFields * 4, 64);
+        position = record.descriptorsOffset + numRows * _descriptorCols * CV_ELEM_SIZE(header.descriptorType);
+        record.wordsOffset = 0;
+        if (!block.postings.empty())
+        {
+            record.wordsOffset = alignUp (position, 64);
+            position = record.wordsOffset + (_numWords + 1 + numRows) * 4;
+        }
+    }
+    
+    ofstream ofs (filepath.c_str(), ios::binary);
+    if (!ofs)
+        CV_Error (Error::StsError, "AffImageDatabase::save: cannot open file " + filepath);
+    
+    writeRaw (ofs, &header, 1);
+    writeRaw (ofs, _featureType.c_str(), _featureType.size());
+    padTo (ofs, header.offsetsOffset);
+    writeRaw (ofs, &_offsets[0], _offsets.size());
+    writeRaw (ofs, records.empty() ? 0 : &records[0], records.size());
+    for (int b = 0; b != _blocks.size(); ++b)
+    {
+        padTo (ofs, records[b].pointsOffset);
+        writeMat (ofs, _blocks[b].points);
+        padTo (ofs, records[b].idsOffset);
+        writeMat (ofs, _blocks[b].ids);
+        padTo (ofs, records[b].descriptorsOffset);
+        writeMat (ofs, _blocks[b].descriptors);
+        if (records[b].wordsOffset)
+        {
+            padTo (ofs, records[b].wordsOffset);
+            writeMat (ofs, _blocks[b].wordOffsets);
+            writeMat (ofs, _blocks[b].postings);
+        }
+    }
+    if (!ofs)
+        CV_Error (Error::StsError, "AffImageDatabase::save: failed writing file " + filepath);
+    ofs.close();
+    
+    // FLANN indices in their own files, stale ones are removed
+    for (int b = 0; b != _blocks.size(); ++b)
+        if (_blocks[b].index)
+            _blocks[b].index->save (indexPath (filepath, b));
+        else
+            std::remove (indexPath (filepath, b).c_str());
+}
+
+
+void AffImageDatabaseImpl::load (const string& filepath)
+{
+    using namespace boost::interprocess;
+    
+    // writes to the Mat-s of blocks go to private pages and never to the file
+    std::shared_ptr<mapped_region> region;
+    try {
+        file_mapping file (filepath.c_str(), read_only);
+        region.reset (new mapped_region (file, copy_on_write));
+    } catch (interprocess_exception&) {
+        CV_Error (Error::StsError, "AffImageDatabase::load: cannot open file " + filepath);
+    }
+    const char* data = static_cast<const char*>(region->get_address());
+    const int64 fileSize = int64(region->get_size());
+    
+    DatabaseHeader header;
+    if (fileSize < int64(sizeof(header)))
+        CV_Error (Error::StsError, "AffImageDatabase::load: not a database file " + filepath);
+    memcpy (&header, data, sizeof(header));
+    if (memcmp (header.magic, DatabaseMagic, 4) != 0)
+        CV_Error (Error::StsError, "AffImageDatabase::load: not a database file " + filepath);
+    if (header.version != DatabaseVersion)
+        CV_Error (Error::StsError, "AffImageDatabase::load: unknown version of file " + filepath);
+    
+    const int numImages = header.numImages, numBlocks = header.numBlocks;
+    const int64 numKeypoints = header.numKeypoints;
+    if (numImages < 0 || numBlocks < 0 || numBlocks > numImages || numKeypoints < 0 ||
+        header.descriptorCols < 0 || header.numWords < 0 ||
+        (header.descriptorType != CV_8U && header.descriptorType != CV_32F) ||
+        header.featureTypeLength < 0 || header.featureTypeLength > 256 ||
+        int64(sizeof(header)) + header.featureTypeLength > fileSize ||
+        header.offsetsOffset < 0 || header.offsetsOffset + int64(numImages + 1) * 8 > fileSize ||
+        header.blocksOffset < 0 || header.blocksOffset + int64(numBlocks) * int64(sizeof(BlockRecord)) > fileSize)
+        CV_Error (Error::StsError, "AffImageDatabase::load: broken header of file " + filepath);
+    
+    const string featureType (data + sizeof(header), header.featureTypeLength);
+    
+    // offsets go up by at most the rows of one block
+    vector<int64> offsets (numImages + 1);
+    memcpy (&offsets[0], data + header.offsetsOffset, offsets.size() * sizeof(int64));
+    bool valid = offsets.front() == 0 && offsets.back() == numKeypoints;
+    for (int i = 0; i != numImages && valid; ++i)
+        valid = offsets[i] <= offsets[i + 1] && offsets[i + 1] - offsets[i] <= MaxBlockRows;
+    if (!valid)
+        CV_Error (Error::StsError, "AffImageDatabase::load: broken image offsets in file " + filepath);
+    
+    // blocks cover all images in order, and their arrays are in the file
+    vector<BlockRecord> records (numBlocks);
+    if (numBlocks)
+        memcpy (&records[0], data + header.blocksOffset, records.size() * sizeof(BlockRecord));
+    const int64 descriptorSize = int64(header.descriptorCols) * CV_ELEM_SIZE(header.descriptorType);
+    valid = (numBlocks > 0) == (numImages > 0);
+    for (int b = 0; b != numBlocks && valid; ++b)
+    {
+        const BlockRecord& record = records[b];
+        const int end = (b + 1 == numBlocks) ? numImages : records[b + 1].firstImage;
+        const int64 numRows = record.numRows;
+        valid = (b ? record.firstImage > records[b - 1].firstImage : record.firstImage == 0) &&
+                record.firstImage < end && end <= numImages &&
+                numRows == offsets[end] - offsets[record.firstImage];
+        valid = valid && record.pointsOffset >= 0 && record.pointsOffset + numRows * NumPointFields * 4 <= fileSize &&
+                record.idsOffset >= 0 && record.idsOffset + numRows * NumIdFields * 4 <= fileSize &&
+                record.descriptorsOffset >= 0 && record.descriptorsOffset + numRows * descriptorSize <= fileSize;
+        valid = valid && (record.wordsOffset == 0 ||
+                          (header.numWords && record.wordsOffset > 0 &&
+                           record.wordsOffset + (header.numWords + 1 + numRows) * 4 <= fileSize));
+    }
+    if (!valid)
+        CV_Error (Error::StsError, "AffImageDatabase::load: broken blocks in file " + filepath);
+    
+    vector<Block> blocks (numBlocks);
+    for (int b = 0; b != numBlocks; ++b)
+    {
+        const BlockRecord& record = records[b];
+        Block& block = blocks[b];
+        block.firstImage = record.firstImage;
+        block.points = mapMat (region, record.pointsOffset, record.numRows, NumPointFields, CV_32F);
+        block.ids = mapMat (region, record.idsOffset, record.numRows, NumIdFields, CV_32S);
+        block.descriptors = mapMat (region, record.descriptorsOffset, record.numRows,
+                                    header.descriptorCols, header.descriptorType);
+        if (!record.wordsOffset) continue;
+        
+        // every row is in the list of one word
+        block.wordOffsets = mapMat (region, record.wordsOffset, 1, header.numWords + 1, CV_32S);
+        block.postings = mapMat (region, record.wordsOffset + int64(header.numWords + 1) * 4,
+                                 1, record.numRows, CV_32S);
+        const int* wordOffsets = block.wordOffsets.ptr<int>();
+        valid = wordOffsets[0] == 0 && wordOffsets[header.numWords] == record.numRows;
+        for (int w = 0; w != header.numWords && valid; ++w)
+            valid = wordOffsets[w] <= wordOffsets[w + 1];
+        if (!valid)
+            CV_Error (Error::StsError, "AffImageDatabase::load: broken inverted file in file " + filepath);
+    }
+    
+    // FLANN indices over the mapped descriptors, built again by train() if one is missing
+    bool indexed = true;
+    for (int b = 0; b != numBlocks && !header.numWords; ++b)
+    {
+        if (blocks[b].descriptors.empty()) continue;
+        if (!std::ifstream (indexPath (filepath, b).c_str()))
+        {
+            indexed = false;
+            break;
+        }
+        try {
+            blocks[b].index = new flann::Index();
+            indexed = blocks[b].index->load (blocks[b].descriptors, indexPath (filepath, b));
+        } catch (cv::Exception&) {
+            indexed = false;
+        }
+        if (!indexed) break;
+    }
+    if (!indexed)
+        for (int b = 0; b != numBlocks; ++b)
+            blocks[b].index.release();
+    
+    _featureType = featureType;
+    _maxTilt = header.maxTilt;
+    _offsets.swap (offsets);
+    _blocks.swap (blocks);
+    _descriptorType = (numKeypoints && header.descriptorCols) ? header.descriptorType : -1;
+    _descriptorCols = header.descriptorCols;
+    _numWords = header.numWords;
+    _trained = indexed;
+    _mappedPath = filepath;
+}
+
+
+
+Ptr<AffImageDatabase> createAffImageDatabase (float duplicateRadius, int numTrees, int numChecks)
+{
+    return new AffImageDatabaseImpl (duplicateRadius, numTrees, numChecks);
+}
+
+
+}} // namespace
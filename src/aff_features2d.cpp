@@ -49,6 +49,7 @@
 #include <map>
 #include <iomanip>
 #include <algorithm>
+#include <cmath>
 
 //#include "precomp.hpp"
 #include <opencv2/imgproc/imgproc.hpp>
@@ -64,63 +65,52 @@ namespace cv { namespace affma {
 
 
 /****************************************************************************************\
-*                                  Geometry helpers                                      *
+*                                  Keypoint helpers                                      *
 \****************************************************************************************/
 
-Matx33f rotAxisX (const float angle)
-{
-    return Matx33f (1,  0,           0,
-                    0,  cos(angle), -sin(angle),
-                    0,  sin(angle),  cos(angle) );
-}
 
-Matx33f rotAxisY (const float angle)
+// maps keypoints with the affine warp M. Positions are transformed in one batch,
+//   size follows the change of area, and angle (clockwise, in degrees) turns with M.
+//   Angles use std::atan2, so that a warp and its inverse give back the angle exactly
+static void warpKeypoints (vector<KeyPoint>& keypoints, const Matx23f& M)
 {
-    return Matx33f (cos(angle),  0,  sin(angle),
-                    0,           1,  0,
-                   -sin(angle),  0,  cos(angle) );
+    if (keypoints.empty()) return;
+    
+    vector<Point2f> points (keypoints.size());
+    for (size_t i = 0; i != keypoints.size(); ++i)
+        points[i] = keypoints[i].pt;
+    transform (points, points, M);
+    
+    const float scale = std::sqrt (std::abs (M(0,0) * M(1,1) - M(0,1) * M(1,0)));
+    for (size_t i = 0; i != keypoints.size(); ++i)
+    {
+        KeyPoint& key = keypoints[i];
+        key.pt = points[i];
+        key.size *= scale;
+        if (key.angle >= 0)
+        {
+            const float angle = float(key.angle / 180 * CV_PI);
+            const float c = cos(angle), s = sin(angle);
+            float warpedAngle = float(std::atan2 (M(1,0) * c + M(1,1) * s, M(0,0) * c + M(0,1) * s)
+                                      * 180 / CV_PI);
+            if (warpedAngle < 0) warpedAngle += 360;
+            key.angle = (warpedAngle >= 360) ? 0 : warpedAngle;
+        }
+    }
 }
 
-Matx33f rotAxisZ (const float angle)
-{
-    return Matx33f (cos(angle), -sin(angle),  0,
-                    sin(angle),  cos(angle),  0,
-                    0,           0,           1 );
-}
 
-Matx33f cameraK (const Size& imageSize, const float f)
-{
-    return Matx33f(f, 0, imageSize.width / 2,
-                   0, f, imageSize.height / 2,
-                   0, 0, 1 );
-}
+// with a shared pyramid, the pyramid level goes to the bits of KeyPoint::octave above 24.
+//   The lower 24 bits keep the octave of the wrapped detector, which extractors read as their own
+//   (SIFT packs octave, layer and sub-layer there, ORB its pyramid level)
+static const int PyramidLevelShift = 24;
+static const int DetectorOctaveMask = (1 << PyramidLevelShift) - 1;
 
-Matx44f makePose (const Matx33f& R)
-{
-    return Matx44f (R(0,0), R(0,1), R(0,2), 0,
-                    R(1,0), R(1,1), R(1,2), 0,
-                    R(2,0), R(2,1), R(2,2), 0,
-                    0,      0,      0,      1  );
-}
+static inline int pyramidLevel (const KeyPoint& keypoint)
+    { return keypoint.octave >> PyramidLevelShift; }
 
-Matx33f pose2H (const Matx33f& K0, const Matx44f& p, const Matx33f& K)
-{
-    // init R and t separately
-    Matx33f absR (p(0,0),p(0,1),p(0,2), p(1,0),p(1,1),p(1,2), p(2,0),p(2,1),p(2,2));
-    Matx31f absT (p(0,3),p(1,3),p(2,3));
-    // camera cannot be on the ground (z!=0)
-    CV_Assert (absT(2) != 0);
-    // from absolute reference frame to relative reference frame
-    Matx33f R = absR.t();
-    Matx31f t = - absR.t() * absT;
-    // build H
-    Matx33f H = R;
-    H(0,2) = t(0);
-    H(1,2) = t(1);
-    H(2,2) = t(2);
-    H = K * H * K0.inv();
-    return H;
-}
+static inline int packPyramidLevel (int detectorOctave, int level)
+    { return (level << PyramidLevelShift) | (detectorOctave & DetectorOctaveMask); }
 
 
 
@@ -140,20 +130,28 @@ protected:
     //! _angles contain information about viewpoints
     const Ptr<AffAngles> _angles;
     
+    //! if above 1, every octave of the image pyramid is warped and passed to _detector
+    const unsigned int _numOctaves;
+    
 private:
     //! used by computeImpl to process a single viewpoint
-    vector<KeyPoint> detectFromView (const Mat& im_, const Matx33f& H_, const int viewId_) const;
+    template<typename ImageT>
+    vector<KeyPoint> detectFromView (const vector<ImageT>& pyramid_, const AffView& view_,
+                                     const int viewId_) const;
     
 protected:
+    //! ImageT is Mat, or UMat to keep the pyramid and warped views in OpenCL buffers
     // TODO: implement mask
-    void detectImpl (const Mat& image, vector<KeyPoint>& keypoints,
+    template<typename ImageT>
+    void detectImpl (const ImageT& image, vector<KeyPoint>& keypoints,
                      const Mat& mask=Mat()) const;
 
 public:
     explicit AffFeatureDetectorImpl (const Ptr<FeatureDetector>& detector_,
-                                     const Ptr<AffAngles>& angles_)
-        : _detector(detector_), _angles(angles_)
-        { CV_Assert(_detector); CV_Assert(_angles); }
+                                     const Ptr<AffAngles>& angles_,
+                                     unsigned int numOctaves_ = 1)
+        : _detector(detector_), _angles(angles_), _numOctaves(numOctaves_)
+        { CV_Assert(_detector); CV_Assert(_angles); CV_Assert(_numOctaves > 0); }
 
  /** Detects keypoints and computes the descriptors */
  void detectAndCompute( InputArray image, InputArray mask,
@@ -166,16 +164,20 @@ public:
 
 virtual void detect( InputArray image, std::vector<KeyPoint>& keypoints,InputArray mask=noArray() )
                                  {
-                                     detectImpl(image.getMat(),keypoints,mask.getMat());
+                                     if (image.isUMat())
+                                         detectImpl(image.getUMat(),keypoints,mask.getMat());
+                                     else
+                                         detectImpl(image.getMat(),keypoints,mask.getMat());
                                  }
 
 };
 
 Ptr<AffFeatureDetector>
 createAffFeatureDetector (const Ptr<FeatureDetector>& detector,
-                          const Ptr<AffAngles>& angles)
+                          const Ptr<AffAngles>& angles,
+                          unsigned int numOctaves)
 {
-    return new AffFeatureDetectorImpl (detector, angles);
+    return new AffFeatureDetectorImpl (detector, angles, numOctaves);
 }
 
 Ptr<AffFeatureDetector>
@@ -186,69 +188,68 @@ createAffFeatureDetector (const Ptr<FeatureDetector>& detector,
 }
 
 
-vector<KeyPoint> AffFeatureDetectorImpl::detectFromView (const Mat& im_, const Matx33f& H_,
+template<typename ImageT>
+vector<KeyPoint> AffFeatureDetectorImpl::detectFromView (const vector<ImageT>& pyramid_,
+                                                         const AffView& view_,
                                                          const int viewId_) const
 {
-    Mat imWarped;
-    warpPerspective (im_, imWarped, H_, im_.size());
+    const ImageT& im_ = pyramid_[0];
+    vector<KeyPoint> keypoints;
     
-    std::vector<cv::KeyPoint> keypointsWarped;
-    _detector->detect( imWarped, keypointsWarped );
+    // the border is as wide as in the view, where size does not grow with tilt
+    const float viewScale = std::sqrt (std::abs (view_.A(0,0) * view_.A(1,1) - view_.A(0,1) * view_.A(1,0)));
     
-    // transform CPs with H and assign viewId
-    Matx33f H_inv = H_.inv();
-    for (int i = 0; i != keypointsWarped.size(); ++i)
+    for (int octave = 0; octave != pyramid_.size(); ++octave)
     {
-        // transform the keypoint according to the inverse homography
-        Point2f point = keypointsWarped[i].pt;
-        Matx31f homog (point.x, point.y, 1);
-        homog = H_inv * homog;
-        homog = homog * (1 / homog(2));
-        keypointsWarped[i].pt = Point2f (homog(0), homog(1));
-        // assign viewId
-        keypointsWarped[i].class_id = viewId_;
-    }
-
-    // filter points that turned out to be on the border or outside the image
-    vector<KeyPoint> keypoints;
-    keypoints.reserve (keypointsWarped.size());
-    for (int i = 0; i != keypointsWarped.size(); ++i)
-    {
-        Point2f& point (keypointsWarped[i].pt);
-        int offset = keypointsWarped[i].size * 2;
-        if (point.x > offset  &&  point.x < im_.cols - offset &&
-            point.y > offset  &&  point.y < im_.rows - offset)
-            keypoints.push_back (keypointsWarped[i]);
+        const ImageT& imOctave = pyramid_[octave];
+        ImageT imWarped;
+        warpAffine (imOctave, imWarped, view_.getAffine (imOctave.size()), imOctave.size());
+        
+        std::vector<cv::KeyPoint> keypointsWarped;
+        _detector->detect( imWarped, keypointsWarped );
+        
+        // transform CPs with the inverse warp, and from the octave to the full resolution
+        const float scale = float(1 << octave);
+        warpKeypoints (keypointsWarped, view_.getInverseAffine (imOctave.size()) * scale);
+
+        // filter points that turned out to be on the border or outside the image, assign viewId
+        for (unsigned long i = 0; i != keypointsWarped.size(); ++i)
+        {
+            const Point2f& point (keypointsWarped[i].pt);
+            int offset = keypointsWarped[i].size * viewScale * 2;
+            if (point.x > offset  &&  point.x < im_.cols - offset &&
+                point.y > offset  &&  point.y < im_.rows - offset)
+            {
+                keypoints.push_back (keypointsWarped[i]);
+                keypoints.back().class_id = viewId_;
+                if (_numOctaves > 1)
+                    keypoints.back().octave = packPyramidLevel (keypoints.back().octave, octave);
+            }
+        }
     }
     
     return keypoints;
 }
 
 
-void AffFeatureDetectorImpl::detectImpl (const Mat& image, vector<KeyPoint>& keypoints,
+template<typename ImageT>
+void AffFeatureDetectorImpl::detectImpl (const ImageT& image, vector<KeyPoint>& keypoints,
                                          const Mat& mask) const
 {
     keypoints.clear();
 
-    // initialize pose, H, K
-    Matx33f H;
-    Matx33f K = cameraK (image.size(), (image.rows + image.cols) * 1000);
-    Matx44f pose0 (1,0,0,0, 0,1,0,0, 0,0,-1,1, 0,0,0,1);
+    // views with precomputed warps
+    AffViewRange views = _angles->getActiveViews();
     
-    // create vectors of all pitches and rolls
-    std::vector<float> tiltPool = _angles->getActiveTilts();
-    std::vector<float> rollPool = _angles->getActiveRolls();
+    // the image pyramid is built once and shared by all views
+    vector<ImageT> pyramid (1, image);
+    if (_numOctaves > 1)
+        buildPyramid (image, pyramid, _numOctaves - 1);
     
     // collect keypoints
-    for (int i = 0; i != tiltPool.size(); ++i)
+    for (unsigned int i = 0; i != views.size(); ++i)
     {
-        // turn camera with pitch and roll
-        Matx44f pose;
-        pose = makePose(rotAxisX (float(tiltPool[i] / 180 * CV_PI))) * pose0;
-        pose = makePose(rotAxisZ (float(rollPool[i] / 180 * CV_PI))) * pose;
-        H = pose2H (K, pose, K);
-
-        vector<KeyPoint> keypointsView = detectFromView (image, H, i);
+        vector<KeyPoint> keypointsView = detectFromView (pyramid, views[i], i);
 
         // add keypointsView to the pool
         keypoints.insert (keypoints.end(), keypointsView.begin(), keypointsView.end());
@@ -275,25 +276,34 @@ protected:
     const Ptr<DescriptorExtractor> _extractor;
     Ptr<AffAngles> _angles;
     
+    //! if above 1, keypoints are described on the warped octave given by KeyPoint::octave
+    const unsigned int _numOctaves;
+    
     //! helper to extractAllViews for processing a single viewpoint
-    Mat extractFromView (const Mat& im_, const Matx33f& H_, vector<KeyPoint>& keypoints_) const;
+    template<typename ImageT>
+    Mat extractFromView (const vector<ImageT>& pyramid_, const AffView& view_,
+                         vector<KeyPoint>& keypoints_) const;
     
     //! helper to computeImpl
     KeypointsByViewType splitKeypointsByView (const vector<KeyPoint>& keypoints_) const;
     
     //! helper to computeImpl for collecting all descriptors after all initial filtering
-    Mat extractAllViews (const Mat& im_,
+    template<typename ImageT>
+    Mat extractAllViews (const ImageT& im_,
                          KeypointsByViewType& keypointsByView_,
                          vector<KeyPoint>& keypoints_) const;
 
-    //! implements actual computing descriptors
-    void computeImpl (const Mat& im_, vector<KeyPoint>& keypoints_, Mat& descriptors_) const;
+    //! implements actual computing descriptors. ImageT is Mat or UMat as in the detector,
+    //    descriptors are always a Mat
+    template<typename ImageT>
+    void computeImpl (const ImageT& im_, vector<KeyPoint>& keypoints_, Mat& descriptors_) const;
 
 public:
     explicit AffDescriptorExtractorImpl (const Ptr<DescriptorExtractor>& extractor_,
-                                         const Ptr<AffAngles>& angles_)
-        : _extractor(extractor_), _angles(angles_)
-        { CV_Assert(_extractor != NULL); }
+                                         const Ptr<AffAngles>& angles_,
+                                         unsigned int numOctaves_ = 1)
+        : _extractor(extractor_), _angles(angles_), _numOctaves(numOctaves_)
+        { CV_Assert(_extractor != NULL); CV_Assert(_numOctaves > 0); }
     
     //! returns the descriptor size
     int descriptorSize() const { return _extractor->descriptorSize(); }
@@ -311,15 +321,19 @@ public:
                                            }
 virtual void compute( InputArray image,std::vector<KeyPoint>& keypoints,OutputArray descriptors )
 {
-    computeImpl(image.getMat(),keypoints,descriptors.getMatRef());
+    if (image.isUMat())
+        computeImpl(image.getUMat(),keypoints,descriptors.getMatRef());
+    else
+        computeImpl(image.getMat(),keypoints,descriptors.getMatRef());
 }
 };
 
 Ptr<AffDescriptorExtractor>
 createAffDescriptorExtractor (const Ptr<DescriptorExtractor>& extractor,
-                              const Ptr<AffAngles>& angles)
+                              const Ptr<AffAngles>& angles,
+                              unsigned int numOctaves)
 {
-    return new AffDescriptorExtractorImpl (extractor, angles);
+    return new AffDescriptorExtractorImpl (extractor, angles, numOctaves);
 }
 
 Ptr<AffDescriptorExtractor>
@@ -349,45 +363,59 @@ void AffDescriptorExtractorImpl::initAngles (const vector<KeyPoint>& keypoints)
 }
 
 
-Mat AffDescriptorExtractorImpl::extractFromView (const Mat& im_, const Matx33f& H_,
+template<typename ImageT>
+Mat AffDescriptorExtractorImpl::extractFromView (const vector<ImageT>& pyramid_, const AffView& view_,
                                                  vector<KeyPoint>& keypoints_) const
 {
-    // TODO: this warping duplicates warping in featureDetector. It is slow
-    Mat imWarped;
-    warpPerspective (im_, imWarped, H_, im_.size());
-
-    // transform CPs with H
-    vector<KeyPoint> keypointsWarped (keypoints_.size());
-    for (int i = 0; i != keypoints_.size(); ++i)
-    {
-        // transform the keypoint according to the homography
-        Point2f point = keypoints_[i].pt;
-        Matx31f homog (point.x, point.y, 1);
-        homog = H_ * homog;
-        assert (homog(2) != 0);
-        homog = homog * (1 / homog(2));
-        // fill in warped keypoints object
-        keypointsWarped[i] = keypoints_[i];
-        keypointsWarped[i].pt = Point2f (homog(0), homog(1));
-    }
+    // split keypoints by the octave where they are described
+    const int numOctaves = int(pyramid_.size());
+    vector< vector<KeyPoint> > keypointsByOctave (numOctaves);
+    if (numOctaves == 1)
+        keypointsByOctave[0].swap (keypoints_);
+    else
+        for (unsigned long i = 0; i != keypoints_.size(); ++i)
+        {
+            int octave = std::min (std::max (pyramidLevel (keypoints_[i]), 0), numOctaves - 1);
+            keypointsByOctave[octave].push_back (keypoints_[i]);
+        }
+    keypoints_.clear();
 
     Mat descriptors;
-    _extractor->compute(imWarped, keypointsWarped, descriptors);
-    
-    // keypoints or their number may change (like in BRISK), so need to get them back
-    keypoints_ = vector<KeyPoint> (keypointsWarped.size());
-    Matx33f inverseH = H_.inv();
-    for (int i = 0; i != keypointsWarped.size(); ++i)
+    for (int octave = 0; octave != numOctaves; ++octave)
     {
-        // transform the keypoint according to the inverse homography
-        Point2f point = keypointsWarped[i].pt;
-        Matx31f homog (point.x, point.y, 1);
-        homog = inverseH * homog;
-        assert (homog(2) != 0);
-        homog = homog * (1 / homog(2));
-        // fill in warped keypoints object
-        keypoints_[i] = keypointsWarped[i];
-        keypoints_[i].pt = Point2f (homog(0), homog(1));
+        vector<KeyPoint>& keypointsWarped = keypointsByOctave[octave];
+        if (numOctaves > 1 && keypointsWarped.empty()) continue;
+        
+        // TODO: this warping duplicates warping in featureDetector. It is slow
+        const ImageT& imOctave = pyramid_[octave];
+        ImageT imWarped;
+        warpAffine (imOctave, imWarped, view_.getAffine (imOctave.size()), imOctave.size());
+
+        // transform CPs from the full resolution to the octave, and with the warp
+        const float scale = float(1 << octave);
+        Matx23f M = view_.getAffine (imOctave.size());
+        for (int row = 0; row != 2; ++row)
+        {
+            M(row, 0) /= scale;
+            M(row, 1) /= scale;
+        }
+        warpKeypoints (keypointsWarped, M);
+
+        // the wrapped extractor sees the octave of its detector only, the level is set back after
+        if (numOctaves > 1)
+            for (unsigned long i = 0; i != keypointsWarped.size(); ++i)
+                keypointsWarped[i].octave &= DetectorOctaveMask;
+
+        Mat descriptorsOctave;
+        _extractor->compute(imWarped, keypointsWarped, descriptorsOctave);
+        
+        // keypoints or their number may change (like in BRISK), so need to get them back
+        warpKeypoints (keypointsWarped, view_.getInverseAffine (imOctave.size()) * scale);
+        if (numOctaves > 1)
+            for (unsigned long i = 0; i != keypointsWarped.size(); ++i)
+                keypointsWarped[i].octave = packPyramidLevel (keypointsWarped[i].octave, octave);
+        keypoints_.insert (keypoints_.end(), keypointsWarped.begin(), keypointsWarped.end());
+        descriptors.push_back (descriptorsOctave);
     }
 
     CV_Assert (keypoints_.size() == descriptors.rows);
@@ -412,35 +440,29 @@ AffDescriptorExtractorImpl::splitKeypointsByView (const vector<KeyPoint>& keypoi
 
 
 //! helper to computeImpl for collecting all descriptors after all initial filtering
-Mat AffDescriptorExtractorImpl::extractAllViews (const Mat& im_,
+template<typename ImageT>
+Mat AffDescriptorExtractorImpl::extractAllViews (const ImageT& im_,
                                                  vector< vector<KeyPoint> >& keypointsByView_,
                                                  vector<KeyPoint>& keypoints_) const
 {
     keypoints_.clear();
     Mat descriptors (0, 0, CV_8U);
 
-    // create sets of all pitches and rolls
-    std::vector<float> tiltPool = _angles->getActiveTilts();
-    std::vector<float> rollPool = _angles->getActiveRolls();
-    unsigned long numViews = _angles->getNumViews();
-    CV_Assert(numViews == tiltPool.size());
+    // views with precomputed warps
+    AffViewRange views = _angles->getActiveViews();
+    unsigned long numViews = views.size();
+    CV_Assert(numViews == keypointsByView_.size());
     
-    // initialize pose, H, K
-    // FIXME: make an affine camera
-    Matx33f H;
-    Matx33f K = cameraK (im_.size(), (im_.rows + im_.cols) * 1000);
-    Matx44f pose0 (1,0,0,0, 0,1,0,0, 0,0,-1,1, 0,0,0,1);
+    // the image pyramid is built once and shared by all views
+    vector<ImageT> pyramid (1, im_);
+    if (_numOctaves > 1)
+        buildPyramid (im_, pyramid, _numOctaves - 1);
     
     // extract descriptors by view
     vector<Mat> descriptorsByView (numViews);
     for (int view = 0; view != numViews; ++view)
     {
-        // turn camera with pitch and roll
-        Matx44f pose;
-        pose = makePose(rotAxisX (float(tiltPool[view] / 180 * CV_PI))) * pose0;
-        pose = makePose(rotAxisZ (float(rollPool[view] / 180 * CV_PI))) * pose;
-        H = pose2H (K, pose, K);
-        descriptorsByView[view] = extractFromView (im_, H, keypointsByView_[view]);
+        descriptorsByView[view] = extractFromView (pyramid, views[view], keypointsByView_[view]);
         CV_Assert (keypointsByView_[view].size() == descriptorsByView[view].rows);
     }
 
@@ -457,7 +479,8 @@ Mat AffDescriptorExtractorImpl::extractAllViews (const Mat& im_,
 }
 
 
-void AffDescriptorExtractorImpl::computeImpl (const Mat& im_, vector<KeyPoint>& keypoints_,
+template<typename ImageT>
+void AffDescriptorExtractorImpl::computeImpl (const ImageT& im_, vector<KeyPoint>& keypoints_,
                                               Mat& descriptors_) const
 {
     KeypointsByViewType keypointsByView = splitKeypointsByView (keypoints_);
@@ -60,6 +60,67 @@ namespace cv { namespace affma {
 
 
 
+/*
+ *  AffView is a precomputed viewpoint: its angles and the affine warp that simulates it.
+ *    The warp is about the image centre c = (cols/2, rows/2):  x' = A * (x - c) + c
+ *    A = diag(1, cos(tilt)) * rotation(-roll), the limit of the camera model of [asift paper]
+ */
+struct AffView {
+    float    tilt, roll;    // latitude and longitude, in degrees
+    Matx22f  A, Ainv;       // linear part of the warp and its inverse
+
+    // image -> view and view -> image, for an image of the given size
+    Matx23f  getAffine (const Size& imageSize) const;
+    Matx23f  getInverseAffine (const Size& imageSize) const;
+    Matx33f  getHomography (const Size& imageSize) const;
+    Matx33f  getInverseHomography (const Size& imageSize) const;
+};
+
+inline Matx23f affineAboutCentre (const Matx22f& A, const Size& imageSize)
+{
+    const float cx = float(imageSize.width / 2), cy = float(imageSize.height / 2);
+    return Matx23f (A(0,0), A(0,1), cx - A(0,0) * cx - A(0,1) * cy,
+                    A(1,0), A(1,1), cy - A(1,0) * cx - A(1,1) * cy);
+}
+
+inline Matx23f AffView::getAffine (const Size& imageSize) const
+    { return affineAboutCentre (A, imageSize); }
+
+inline Matx23f AffView::getInverseAffine (const Size& imageSize) const
+    { return affineAboutCentre (Ainv, imageSize); }
+
+inline Matx33f AffView::getHomography (const Size& imageSize) const
+{
+    Matx23f M = getAffine (imageSize);
+    return Matx33f (M(0,0), M(0,1), M(0,2), M(1,0), M(1,1), M(1,2), 0, 0, 1);
+}
+
+inline Matx33f AffView::getInverseHomography (const Size& imageSize) const
+{
+    Matx23f M = getInverseAffine (imageSize);
+    return Matx33f (M(0,0), M(0,1), M(0,2), M(1,0), M(1,1), M(1,2), 0, 0, 1);
+}
+
+
+/*
+ *  AffViewRange is a read-only window onto views stored inside AffAngles.
+ *    It does not allocate. It stays valid while AffAngles lives,
+ *    but does not follow later changes of minTilt and maxTilt
+ */
+class AffViewRange {
+    const AffView *_begin, *_end;
+public:
+    AffViewRange (const AffView* begin_ = 0, const AffView* end_ = 0)
+        : _begin(begin_), _end(end_) { }
+
+    const AffView*  begin() const { return _begin; }
+    const AffView*  end()   const { return _end; }
+    unsigned int    size()  const { return (unsigned int)(_end - _begin); }
+    bool            empty() const { return _begin == _end; }
+    const AffView&  operator[] (unsigned int i) const { return _begin[i]; }
+};
+
+
 /*
  *  AffAngles manages viewpoints [see asift paper].
  *    It is used by FeatureDetector and DescriptorExtractor to decide how to warp image
@@ -70,18 +131,25 @@ public:
 
     virtual ~AffAngles() { }
 
+    // bounds of the default sampling from [asift paper]
     static const unsigned int MaxPossibleTilt = 6;
     static const unsigned int MaxPossibleNumViews = 41; // = 1 + 4 + 5 + 7 + 10 + 14
+    
+    // bound for any user-supplied sampling. KeyPoint::class_id above it is not a view id
+    static const unsigned int MaxNumViews = 4096;
 
     /*
      * tilt (latitude) is the level of image affine distortion. Image(tilt=0) == Image
-     * the following should hold: 0 <= minTilt <= tilt < maxTilt <= MaxPossibleTilt == 6
+     * the following should hold: 0 <= minTilt <= tilt < maxTilt <= getNumPossibleTilts()
      *   'minTilt', 'maxTilt' - are set by the user and can be changed
      *                          by default, minTilt=begin() and maxTilt=begin()+3
      *   'tilt' goes through all available values during matching
      *
      * roll (longitude) goes through a set of predefined values, different for every tilt
      *   roll is not controlled by the user
+     *
+     * The set of available tilts and rolls is the 'sampling'. It is fixed at creation,
+     *   either the default one from [asift paper], or a user-supplied one (see createAffAngles)
      */
     
     virtual void          setMinTilt(unsigned int minTilt) = 0;
@@ -89,27 +157,54 @@ public:
     virtual void          setMaxTilt(unsigned int maxTilt) = 0;
     virtual unsigned int  getMaxTilt() const = 0;
     
+    virtual unsigned int  getNumPossibleTilts() const = 0;   // tilt levels in the sampling
+    virtual unsigned int  getNumPossibleViews() const = 0;   // views in the sampling
+    
     virtual unsigned int  getNumViews() const = 0;
     virtual unsigned int  getNumTilts() const = 0;
     virtual unsigned int  getNumRolls(unsigned int tilt) const = 0;
     
+    // active views, in the order of view ids (KeyPoint::class_id). Does not allocate
+    virtual AffViewRange  getActiveViews() const = 0;
+    
+    // copies of tilts and rolls of active views. Prefer getActiveViews() in loops
     virtual std::vector<float>  getActiveTilts() const = 0;
     virtual std::vector<float>  getActiveRolls() const = 0;
     
     virtual void          printActiveAngles (std::ostream& os) const = 0;
 };
 
+// the default sampling from [asift paper], see MaxPossibleTilt
 CV_EXPORTS Ptr<AffAngles> createAffAngles (unsigned int maxTilt = 1, unsigned int minTilt = 0);
 
+// sampling by rule from [asift paper]: tilt level k has tilt t = tiltFactor^k,
+//   that is latitude = acos(1/t), and its rolls are spaced by rollSpacing/t degrees.
+//   tiltFactor = sqrt(2), rollSpacing = 72, numTilts = 6 is close to the default sampling.
+//   All tilts are active after creation
+CV_EXPORTS Ptr<AffAngles> createAffAngles (float tiltFactor, float rollSpacing,
+                                           unsigned int numTilts);
+
+// explicit list of views, 'tilts' are latitudes and 'rolls' are longitudes in degrees.
+//   Views must be sorted by tilt, views with the same tilt make up one tilt level.
+//   All tilts are active after creation
+CV_EXPORTS Ptr<AffAngles> createAffAngles (const std::vector<float>& tilts,
+                                           const std::vector<float>& rolls);
+
 
 
 class AffFeatureDetector : public FeatureDetector {
     public: virtual ~AffFeatureDetector() { }
 };
 
+// 'image' of detect may be a UMat, then the pyramid and warped views stay UMat as well.
+// numOctaves > 1 builds the image pyramid once per image and warps every octave for every view,
+//   instead of making 'detector' build a pyramid for each view. 'detector' should then be
+//   single-scale, e.g. ORB with nlevels = 1, FAST or GFTT. The octave of the pyramid goes to the
+//   bits of KeyPoint::octave from 24 up, the lower ones keep the octave of 'detector'
 CV_EXPORTS Ptr<AffFeatureDetector> createAffFeatureDetector
     (const Ptr<FeatureDetector>& detector,
-     const Ptr<AffAngles>& angles);
+     const Ptr<AffAngles>& angles,
+     unsigned int numOctaves = 1);
 
 CV_EXPORTS Ptr<AffFeatureDetector> createAffFeatureDetector
     (const Ptr<FeatureDetector>& detector,
@@ -121,10 +216,15 @@ class AffDescriptorExtractor : public DescriptorExtractor {
     public: virtual ~AffDescriptorExtractor() { }
 };
 
+// 'image' of compute may be a UMat as with the detector, descriptors are a Mat.
+// numOctaves > 1 describes every keypoint on the warped octave from KeyPoint::octave,
+//   to be used with the keypoints of the detector with the same numOctaves. 'extractor' gets
+//   keypoints with the octave of the wrapped detector only
 // TODO: make angles optional
 CV_EXPORTS Ptr<AffDescriptorExtractor> createAffDescriptorExtractor
     (const Ptr<DescriptorExtractor>& extractor,
-     const Ptr<AffAngles>& angles);
+     const Ptr<AffAngles>& angles,
+     unsigned int numOctaves = 1);
 
 CV_EXPORTS Ptr<AffDescriptorExtractor> createAffDescriptorExtractor
     (const Ptr<DescriptorExtractor>& detector,
@@ -153,6 +253,28 @@ public:
     virtual bool isMaskSupported() const = 0;
     
     virtual void setViewPairsPool (std::set< std::pair<int, int> > viewPairsPool) = 0;
+    
+    // ratio test of ratioMatch over all train views: the best match of a query keypoint is
+    //   searched in all train views matched with its view, and compared with the best match
+    //   farther than 'duplicateRadius' pixels from it in the train image, since closer ones
+    //   are usually the same point seen from another view. Candidates are the few best of
+    //   every train view, not of one index as with setGlobalIndex, so the 2nd best is taken
+    //   no farther than the last candidate of any view. Off by default
+    virtual void setCrossViewRatio (bool enable, float duplicateRadius = 2.f) = 0;
+    
+    // one index for all views: 'indexMatcher' is trained once on all train descriptors and
+    //   queried once by all query descriptors, instead of a search for every view pair.
+    //   View ids stay in KeyPoint::class_id. The view pairs pool is not used, and ratioMatch
+    //   skips near duplicates as with setCrossViewRatio. Empty matcher to match view pairs
+    virtual void setGlobalIndex (const Ptr<DescriptorMatcher>& indexMatcher) = 0;
+    
+    // match and ratioMatch keep only matches whose query keypoint is also the nearest one to
+    //   their train keypoint. Per view pair, brute-force matchers of this library find both
+    //   in one pass. With setCrossViewRatio or setGlobalIndex the reverse search goes over
+    //   all query views, and a near duplicate of the query keypoint also counts. It is exact,
+    //   by the matcher of view pairs, even with an approximate global index. Off by default.
+    //   match with a cross-check does not take a mask
+    virtual void setCrossCheck (bool enable) = 0;
 
     virtual void match(       const std::vector<KeyPoint>& queryKeypoints,
                               const std::vector<KeyPoint>& trainKeypoints,
@@ -170,11 +292,49 @@ public:
                               const Mat& queryDescriptors, const Mat& trainDescriptors,
                               std::vector<std::vector<DMatch> >& matches, float maxDistance,
                               const Mat& mask=Mat(), bool compactResult=false ) const = 0;
+
+    // best matches that pass the ratio test: distance / distance of the 2nd best < threshNNDR.
+    //   One flat list, at most one match per query keypoint. Uses AffBFMatcher::ratioMatch
+    //   when the underlying matcher is one, otherwise knnMatch with k = 2
+    virtual void ratioMatch(  const std::vector<KeyPoint>& queryKeypoints,
+                              const std::vector<KeyPoint>& trainKeypoints,
+                              const Mat& queryDescriptors, const Mat& trainDescriptors,
+                              CV_OUT std::vector<DMatch>& matches, float threshNNDR ) const = 0;
 };
 
 CV_EXPORTS Ptr<AffDescriptorMatcher> createAffDescriptorMatcher
      (const Ptr<DescriptorMatcher>& matcher);
 
+// matchers of createHammingBFMatcher and createL2BFMatcher. Besides DescriptorMatcher methods,
+//   they apply the ratio test while scanning, without building lists of kNN matches
+class AffBFMatcher : public DescriptorMatcher {
+public:
+    virtual ~AffBFMatcher() { }
+    
+    // imgIdx of matches is 0, see AffDescriptorMatcher::ratioMatch
+    //   crossCheck keeps matches whose query descriptor is also the nearest one to their train
+    //   descriptor. It is found in the same pass over distances
+    virtual void ratioMatch (const Mat& queryDescriptors, const Mat& trainDescriptors,
+                             CV_OUT std::vector<DMatch>& matches, float threshNNDR,
+                             bool crossCheck = false) const = 0;
+    
+    // nearest neighbours of each other, as BFMatcher with crossCheck
+    virtual void crossCheckMatch (const Mat& queryDescriptors, const Mat& trainDescriptors,
+                                  CV_OUT std::vector<DMatch>& matches) const = 0;
+};
+
+// exact brute-force kNN on binary descriptors (CV_8U) with Hamming distance,
+//   to be passed to createAffDescriptorMatcher. Faster than an LSH index on the
+//   small sets of one view pair. Uses AVX2 when compiled for it. Masks are not supported
+CV_EXPORTS Ptr<DescriptorMatcher> createHammingBFMatcher();
+
+// exact brute-force kNN on float descriptors (CV_32F) with L2 distance, for SIFT and SURF.
+//   Distances of a view pair are computed block by block as |a|^2 + |b|^2 - 2ab.
+//   Unlike FLANN, results do not depend on randomized trees. Masks are not supported.
+//   descriptorType CV_8U is for 8-bit codes of quantized float descriptors, matched with L2
+//   as they are, without converting back to float
+CV_EXPORTS Ptr<DescriptorMatcher> createL2BFMatcher (int descriptorType = CV_32F);
+
 
 
 
@@ -213,18 +373,198 @@ public:
                                       const float subsamplingFactor = 0.33f,
                                       const unsigned int numViewPairs = 5) = 0;
     
+    // pipeline from [2] in two steps, for when an image takes part in several pairs:
+    //   compute affine features of every image once, then match them pair by pair
+    virtual void computeFeatures(     const cv::Mat& im,
+                                      std::vector<cv::KeyPoint>& keypoints,
+                                      cv::Mat& descriptors,
+                                      const unsigned int maxTilt) = 0;
+    
+    virtual void matchFeatures(       const std::vector<cv::KeyPoint>& keypoints1,
+                                      const std::vector<cv::KeyPoint>& keypoints2,
+                                      const cv::Mat& descriptors1, const cv::Mat& descriptors2,
+                                      std::vector<cv::DMatch>& matches,
+                                      const float threshNNDR) = 0;
+    
     // use this function to collect descriptors after matching if necessary
     virtual void getDescriptors(      cv::Mat& queryDescr, cv::Mat& trainDescr ) = 0;
+    
+    // see AffDescriptorMatcher::setCrossViewRatio, setGlobalIndex and setCrossCheck
+    virtual void setCrossViewRatio(   bool enable, float duplicateRadius = 2.f) = 0;
+    virtual void setGlobalIndex(      const Ptr<DescriptorMatcher>& indexMatcher) = 0;
+    virtual void setCrossCheck(       bool enable) = 0;
+    
+    // view pairs for matchFeatures, e.g. from selectViewPairs. Empty for all pairs.
+    //   matchMultiRes sets its own
+    virtual void setViewPairsPool(    const std::set< std::pair<int, int> >& viewPairsPool) = 0;
+    
+    // images go to the detector and extractor as UMat, so that warping of views, and detection
+    //   where the detector supports it, run through OpenCL (also on a CPU OpenCL runtime).
+    //   Images stay Mat when cv::ocl::useOpenCL() is false. Off by default
+    virtual void setUseOpenCL(        bool enable) = 0;
 
     virtual void setVerbosity(        int verbosity) = 0;
 };
 
+// if 'angles' is not set, the default sampling is used. maxTilt arguments of the helper
+//   methods are bounded by angles->getNumPossibleTilts()
+// numOctaves is passed to createAffFeatureDetector and createAffDescriptorExtractor
 CV_EXPORTS Ptr<AffMatcherHelper> createAffMatcherHelper
        (Ptr<FeatureDetector> detector,
         Ptr<DescriptorExtractor> extractor,
-        Ptr<DescriptorMatcher> matcher);
+        Ptr<DescriptorMatcher> matcher,
+        Ptr<AffAngles> angles = Ptr<AffAngles>(),
+        unsigned int numOctaves = 1);
+
+
+
+/*
+ *  Feature backends by name: "sift", "surf", "orb", "brisk", "akaze".
+ *    All are matched exactly by brute force, which is faster than an index on view pairs:
+ *    float descriptors (sift, surf) with L2, binary ones (orb, brisk, akaze) with Hamming.
+ *    maxFeatures bounds the number of keypoints per view for sift and orb, 0 for the default.
+ *    Throws cv::Exception for an unknown name
+ */
+CV_EXPORTS std::vector<std::string> getFeatureBackendNames();
+
+CV_EXPORTS void createFeatureBackend (const std::string& name,
+                                      Ptr<FeatureDetector>& detector,
+                                      Ptr<DescriptorExtractor>& extractor,
+                                      Ptr<DescriptorMatcher>& matcher,
+                                      int maxFeatures = 0);
+
+// index for AffDescriptorMatcher::setGlobalIndex: a FLANN forest of 'numTrees' KD-trees
+//   for float descriptors, or LSH with 2 * numTrees tables for binary ones (CV_8U).
+//   numChecks trades speed for recall
+CV_EXPORTS Ptr<DescriptorMatcher> createGlobalIndexMatcher (int descriptorType,
+                                                            int numTrees = 4, int numChecks = 64);
+
+
 
 
+/*
+ *  AffImageDatabase finds the images of a large collection that a query image matches,
+ *    without matching the query with every image. Affine features of all images
+ *    (see AffMatcherHelper::computeFeatures) go into one index, and every query descriptor
+ *    is searched in it once. Matches that pass the ratio test vote for their image.
+ *    The ratio test skips near duplicates of the best match in the same image, which are
+ *    usually the same point seen from another view, as AffDescriptorMatcher::setCrossViewRatio.
+ *    Images are split into blocks of at most 2^30 descriptors with a FLANN index each
+ *    (as createGlobalIndexMatcher), so that collections may have more than INT_MAX descriptors.
+ *    With a vocabulary (setVocabulary), the index is an inverted file of visual words instead:
+ *    descriptors are compared with those of the same word only.
+ *    save() writes the FLANN indices next to the file, as <filepath>.flann<block>. load() maps
+ *    the file into memory instead of reading it, and the index or inverted file is ready
+ *    without train() (FLANN builds the hash tables of LSH again when loading them).
+ *    The loaded file stays mapped, so the database cannot be saved over it
+ */
+struct AffImageCandidate {
+    int                   imageId;
+    std::vector<DMatch>   matches;   // trainIdx is in keypoints of the image, imgIdx is imageId
+};
+
+class AffVocabulary;
+
+class AffImageDatabase : public Algorithm {
+public:
+    virtual ~AffImageDatabase() { }
+    
+    // features the images were described with, saved in the file for checks before queries
+    virtual void        setFeatureType (const std::string& featureType) = 0;
+    virtual std::string getFeatureType() const = 0;
+    virtual void        setMaxTilt (int maxTilt) = 0;
+    virtual int         getMaxTilt() const = 0;
+    
+    // train() builds an inverted file of its words if set. It is not saved with the database,
+    //   and must be set again before querying a loaded one
+    virtual void setVocabulary (const Ptr<AffVocabulary>& vocabulary) = 0;
+    
+    // features of one image, view ids in KeyPoint::class_id. Returns the id of the image,
+    //   ids go from 0 in the order of adding
+    virtual int  addImage (const std::vector<KeyPoint>& keypoints, const Mat& descriptors) = 0;
+    
+    virtual int  getNumImages() const = 0;
+    virtual void getImageFeatures (int imageId, CV_OUT std::vector<KeyPoint>& keypoints,
+                                   CV_OUT Mat& descriptors) const = 0;
+    
+    // builds the index of all added images. Needed before query after adding images,
+    //   or after load of a file saved without it
+    virtual void train() = 0;
+    virtual bool isTrained() const = 0;
+    
+    // images with at least minMatches matches, at most numCandidates of them, the ones with
+    //   most matches first. Repeated matches between the same points in other views are dropped
+    virtual void query (const std::vector<KeyPoint>& queryKeypoints, const Mat& queryDescriptors,
+                        CV_OUT std::vector<AffImageCandidate>& candidates, float threshNNDR,
+                        int numCandidates = 10, int minMatches = 4) const = 0;
+    
+    // throw cv::Exception when the file cannot be written or read
+    virtual void save (const std::string& filepath) const = 0;
+    virtual void load (const std::string& filepath) = 0;
+};
+
+// 'duplicateRadius' in pixels is the same as in AffDescriptorMatcher::setCrossViewRatio,
+//   numTrees and numChecks are those of createGlobalIndexMatcher
+CV_EXPORTS Ptr<AffImageDatabase> createAffImageDatabase (float duplicateRadius = 2.f,
+                                                         int numTrees = 4, int numChecks = 64);
+
+
+
+/*
+ *  AffVocabulary is a vocabulary tree [Nister and Stewenius 2006] for a cheap prefilter
+ *    before descriptor matching: images (or views) are compared by TF-IDF weighted histograms
+ *    of visual words. Words are leaves of a tree built by hierarchical k-means.
+ *    Binary descriptors (CV_8U) are clustered as vectors of bits, that is by Hamming distance
+ */
+
+// sparse histogram of words: (word, weight) sorted by word, of unit L2 norm
+typedef std::vector<std::pair<int, float> > AffBowVector;
+
+class AffVocabulary : public Algorithm {
+public:
+    virtual ~AffVocabulary() { }
+    
+    // 'descriptors' are a sample of the collection. At most branching^depth words
+    virtual void train (const Mat& descriptors, int branching = 10, int depth = 4) = 0;
+    virtual int  getNumWords() const = 0;
+    
+    virtual void quantize (const Mat& descriptors, CV_OUT std::vector<int>& words) const = 0;
+    
+    // inverse document frequencies log(N / N_word), where 'documents' are word lists of N images,
+    //   or of N views for comparing views. All weights are 1 before it
+    virtual void trainIdf (const std::vector<std::vector<int> >& documents) = 0;
+    
+    virtual void computeBow (const std::vector<int>& words, CV_OUT AffBowVector& bow) const = 0;
+    
+    // one histogram per view id of KeyPoint::class_id, empty for views without keypoints
+    virtual void computeViewBows (const std::vector<KeyPoint>& keypoints, const Mat& descriptors,
+                                  CV_OUT std::vector<AffBowVector>& bows) const = 0;
+    
+    // throw cv::Exception when the file cannot be written or read
+    virtual void save (const std::string& filepath) const = 0;
+    virtual void load (const std::string& filepath) = 0;
+};
+
+CV_EXPORTS Ptr<AffVocabulary> createAffVocabulary();
+
+// cosine similarity of two histograms, in [0, 1]
+CV_EXPORTS float bowSimilarity (const AffBowVector& bow1, const AffBowVector& bow2);
+
+// candidate pairs of a collection: the numPairsPerImage most similar images of every image.
+//   Pairs (i, j) have i < j, the most similar first. Uses an inverted file of words
+CV_EXPORTS void rankImagePairs (const std::vector<AffBowVector>& bows, int numPairsPerImage,
+                                CV_OUT std::vector<std::pair<int, int> >& pairs,
+                                CV_OUT std::vector<float>& similarities);
+
+// the numViewPairs most similar pairs of (query view id, train view id),
+//   for AffDescriptorMatcher::setViewPairsPool. Never empty when both images have views,
+//   because an empty pool means all pairs: the best pair is kept even if it shares no words.
+//   Empty when either image has no views, do not match the images then
+CV_EXPORTS std::set<std::pair<int, int> > selectViewPairs
+    (const std::vector<AffBowVector>& queryViewBows,
+     const std::vector<AffBowVector>& trainViewBows,
+     int numViewPairs);
+
 
 
 ///    Helper functions    ///
@@ -240,6 +580,12 @@ void printMatchHistogram( const std::vector<KeyPoint>& queryKeypoints,
                           const std::vector<DMatch>& matches,
                           const unsigned int maxTilt );
 
+// same for keypoints from views of a user-supplied sampling
+void printMatchHistogram( const std::vector<KeyPoint>& queryKeypoints,
+                          const std::vector<KeyPoint>& trainKeypoints,
+                          const std::vector<DMatch>& matches,
+                          const Ptr<AffAngles>& angles );
+
 
 }} // namespace
 #endif
@@ -50,6 +50,7 @@
 #include <iomanip>
 
 #include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/core/ocl.hpp>
 
 //#include "precomp.hpp"
 #include "aff_features2d.hpp"
@@ -126,6 +127,10 @@ protected:
     Ptr<AffDescriptorMatcher>   _amatcher;
     
     int                         _verbosity;
+    bool                        _useOpenCL;
+    
+    // detection and description of the active views, through UMat if _useOpenCL
+    void detectAndExtract( const Mat& im, vector<KeyPoint>& keypoints, Mat& descriptors );
     
     void withMaxTiltImpl( const Mat& im1, const Mat& im2,
                           vector<KeyPoint>& keypoints1, vector<KeyPoint>& keypoints2,
@@ -138,7 +143,9 @@ public:
 
     AffMatcherHelperImpl( Ptr<FeatureDetector> detector_,
                           Ptr<DescriptorExtractor> extractor_,
-                          Ptr<DescriptorMatcher> matcher_ );
+                          Ptr<DescriptorMatcher> matcher_,
+                          Ptr<AffAngles> angles_,
+                          unsigned int numOctaves_ );
     
     void matchWithMaxTilt(    const Mat& im1, const Mat& im2,
                               vector<KeyPoint>& keypoints1, vector<KeyPoint>& keypoints2,
@@ -160,28 +167,56 @@ public:
                               const float subsamplingFactor = 0.33f,
                               const unsigned int keepViewPairs = 5);
     
+    void computeFeatures(     const Mat& im,
+                              vector<KeyPoint>& keypoints, Mat& descriptors,
+                              const unsigned int maxTilt);
+    
+    void matchFeatures(       const vector<KeyPoint>& keypoints1, const vector<KeyPoint>& keypoints2,
+                              const Mat& descriptors1, const Mat& descriptors2,
+                              vector<DMatch>& matches,
+                              const float threshNNDR);
+    
     void getDescriptors(      cv::Mat& queryDescr, cv::Mat& trainDescr );
 
     inline void setVerbosity(int verbosity) { _verbosity = verbosity; }
+    
+    void setCrossViewRatio(   bool enable, float duplicateRadius )
+        { _amatcher->setCrossViewRatio (enable, duplicateRadius); }
+    
+    void setGlobalIndex(      const Ptr<DescriptorMatcher>& indexMatcher )
+        { _amatcher->setGlobalIndex (indexMatcher); }
+    
+    void setCrossCheck(       bool enable )
+        { _amatcher->setCrossCheck (enable); }
+    
+    void setViewPairsPool(    const std::set< std::pair<int, int> >& viewPairsPool )
+        { _amatcher->setViewPairsPool (viewPairsPool); }
+    
+    void setUseOpenCL(        bool enable )    { _useOpenCL = enable; }
 };
 
 CV_EXPORTS Ptr<AffMatcherHelper> createAffMatcherHelper
        (Ptr<FeatureDetector> detector,
         Ptr<DescriptorExtractor> extractor,
-        Ptr<DescriptorMatcher> matcher)
+        Ptr<DescriptorMatcher> matcher,
+        Ptr<AffAngles> angles,
+        unsigned int numOctaves)
 {
-    return new AffMatcherHelperImpl( detector, extractor, matcher );
+    return new AffMatcherHelperImpl( detector, extractor, matcher, angles, numOctaves );
 }
 
 
 AffMatcherHelperImpl::AffMatcherHelperImpl( Ptr<FeatureDetector> detector_,
                                             Ptr<DescriptorExtractor> extractor_,
-                                            Ptr<DescriptorMatcher> matcher_ )
-    : _angles     (createAffAngles (AffAngles::MaxPossibleTilt, 0)),
-      _adetector  (createAffFeatureDetector (detector_, _angles)),
-      _aextractor (createAffDescriptorExtractor (extractor_, _angles)),
+                                            Ptr<DescriptorMatcher> matcher_,
+                                            Ptr<AffAngles> angles_,
+                                            unsigned int numOctaves_ )
+    : _angles     (angles_.empty() ? createAffAngles (AffAngles::MaxPossibleTilt, 0) : angles_),
+      _adetector  (createAffFeatureDetector (detector_, _angles, numOctaves_)),
+      _aextractor (createAffDescriptorExtractor (extractor_, _angles, numOctaves_)),
       _amatcher   (createAffDescriptorMatcher (matcher_)),
-      _verbosity  (0)
+      _verbosity  (0),
+      _useOpenCL  (false)
     { }
 
 
@@ -190,31 +225,10 @@ void AffMatcherHelperImpl::matchImpl
                      const Mat& queryDescriptors, const Mat& trainDescriptors,
                      vector<DMatch>& matches, const float threshNNDR)
 {
-    vector<vector<DMatch> > matchesKnn;
-    _amatcher->knnMatch( queryKeypoints, trainKeypoints, queryDescriptors, trainDescriptors,
-                         matchesKnn, 2 );
-    
-    // keep only good matches
-    matches.clear();
-    for (int i = 0; i != matchesKnn.size(); ++i)
-    {
-        if (matchesKnn[i].size() < 2)
-        {
-            if (_verbosity > 1)
-                cout << "AffMatcherHelperImpl::matchImpl warning: less than 2 matches found" << endl;
-            continue;
-        }
-        if (matchesKnn[i][1].distance == 0)
-        {
-            if (_verbosity > 1)
-                cout << "AffMatcherHelperImpl::matchImpl warning: match distance = 0 detected" << endl;
-            continue;
-        }
-        
-        // finally comparing two closest matches
-        if (matchesKnn[i][0].distance / matchesKnn[i][1].distance < threshNNDR)
-            matches.push_back (matchesKnn[i][0]);
-    }
+    // keep only good matches: comparing two closest matches. Queries with less than
+    //   2 matches or with the 2nd distance = 0 are skipped
+    _amatcher->ratioMatch( queryKeypoints, trainKeypoints, queryDescriptors, trainDescriptors,
+                           matches, threshNNDR );
     
     if (_verbosity) cout << matches.size() << " matches" << endl;
 }
@@ -225,38 +239,68 @@ void AffMatcherHelperImpl::withMaxTiltImpl
                      vector<KeyPoint>& queryKeypoints, vector<KeyPoint>& trainKeypoints,
                      vector<DMatch>& matches, const float threshNNDR, const unsigned int maxTilt )
 {
-    cout << "with " << endl;
-    _queryDescriptors = Mat();
-    _trainDescriptors = Mat();
-    
-    queryKeypoints.clear();
-    trainKeypoints.clear();
     matches.clear();
 
-    CV_Assert (maxTilt <= AffAngles::MaxPossibleTilt);
-    _angles->setMinTilt(0);
-    _angles->setMaxTilt(maxTilt);
-
-    _adetector->detect (im1, queryKeypoints);
-    _adetector->detect (im2, trainKeypoints);
+    computeFeatures (im1, queryKeypoints, _queryDescriptors, maxTilt);
+    computeFeatures (im2, trainKeypoints, _trainDescriptors, maxTilt);
     if (_verbosity)
+    {
         cout << queryKeypoints.size() << " vs " << trainKeypoints.size() << " keypoints, " << flush;
-    
-    _aextractor->compute( im1, queryKeypoints, _queryDescriptors );
-    _aextractor->compute( im2, trainKeypoints, _trainDescriptors );
-    if (_verbosity)
         cout << _queryDescriptors.rows << " vs " << _trainDescriptors.rows << " descr., " << flush;
+    }
 
     matchImpl(queryKeypoints, trainKeypoints, _queryDescriptors, _trainDescriptors, matches, threshNNDR);
 }
 
 
+void AffMatcherHelperImpl::computeFeatures
+                   ( const Mat& im, vector<KeyPoint>& keypoints, Mat& descriptors,
+                     const unsigned int maxTilt )
+{
+    keypoints.clear();
+    descriptors = Mat();
+
+    CV_Assert (maxTilt <= _angles->getNumPossibleTilts());
+    _angles->setMinTilt(0);
+    _angles->setMaxTilt(maxTilt);
+
+    detectAndExtract (im, keypoints, descriptors);
+}
+
+
+void AffMatcherHelperImpl::detectAndExtract
+                   ( const Mat& im, vector<KeyPoint>& keypoints, Mat& descriptors )
+{
+    // without an OpenCL device UMat would only add copies
+    if (_useOpenCL && ocl::useOpenCL())
+    {
+        // the image is uploaded once, views are warped and detected on the device
+        UMat imDevice = im.getUMat (ACCESS_READ);
+        _adetector->detect (imDevice, keypoints);
+        _aextractor->compute (imDevice, keypoints, descriptors);
+    }
+    else
+    {
+        _adetector->detect (im, keypoints);
+        _aextractor->compute (im, keypoints, descriptors);
+    }
+}
+
+
+void AffMatcherHelperImpl::matchFeatures
+                   ( const vector<KeyPoint>& keypoints1, const vector<KeyPoint>& keypoints2,
+                     const Mat& descriptors1, const Mat& descriptors2,
+                     vector<DMatch>& matches, const float threshNNDR )
+{
+    matchImpl (keypoints1, keypoints2, descriptors1, descriptors2, matches, threshNNDR);
+}
+
+
 void AffMatcherHelperImpl::matchWithMaxTilt
                 (const Mat& im1, const Mat& im2,
                  vector<KeyPoint>& queryKeypoints, vector<KeyPoint>& trainKeypoints,
                  vector<DMatch>& matches, const float knnThresh, const unsigned int maxPitch)
 {
-    cout << "tttt" << endl;
     withMaxTiltImpl (im1, im2, queryKeypoints, trainKeypoints, matches, knnThresh, maxPitch);
 }
 
@@ -273,7 +317,7 @@ void AffMatcherHelperImpl::matchIncreasingTilt
     trainKeypoints.clear();
     matches.clear();
     
-    for (int tilt = 1; tilt != AffAngles::MaxPossibleTilt; ++tilt)
+    for (int tilt = 1; tilt <= _angles->getNumPossibleTilts(); ++tilt)
     {
         _angles->setMinTilt (tilt - 1);
         _angles->setMaxTilt (tilt);
@@ -284,11 +328,8 @@ void AffMatcherHelperImpl::matchIncreasingTilt
         
         if (_verbosity) cout << "tilt " << tilt << ", " << flush;
  
-        _adetector->detect( im1, queryKeypointsLevel );
-        _adetector->detect( im2, trainKeypointsLevel );
-
-        _aextractor->compute( im1, queryKeypointsLevel, queryDescriptorLevel );
-        _aextractor->compute( im2, trainKeypointsLevel, trainDescriptorLevel );
+        detectAndExtract( im1, queryKeypointsLevel, queryDescriptorLevel );
+        detectAndExtract( im2, trainKeypointsLevel, trainDescriptorLevel );
     
         queryKeypoints.insert( queryKeypoints.end(),
                                queryKeypointsLevel.begin(), queryKeypointsLevel.end() );
@@ -453,11 +494,16 @@ void filterDuplicateMatches   (const std::vector<cv::KeyPoint>& queryKeypoints,
 
 void printMatchHistogram (const vector<KeyPoint>& keypoints1, const vector<KeyPoint>& keypoints2,
                           const vector<DMatch>& matches, const unsigned int maxTilt )
+{
+    printMatchHistogram (keypoints1, keypoints2, matches, createAffAngles (maxTilt));
+}
+
+
+void printMatchHistogram (const vector<KeyPoint>& keypoints1, const vector<KeyPoint>& keypoints2,
+                          const vector<DMatch>& matches, const Ptr<AffAngles>& angles )
 {
     cout << "affma::printMatchHistogram: total matches number: " << matches.size() << endl;
     
-    Ptr<AffAngles> angles = createAffAngles (maxTilt); 
-    
     // get histogram of matches
     int numViews = angles->getNumViews();
     Mat histogram = Mat::zeros (numViews, numViews, CV_32S);
@@ -466,11 +512,11 @@ void printMatchHistogram (const vector<KeyPoint>& keypoints1, const vector<KeyPo
                              keypoints2[matches[i].trainIdx].class_id);
     
     const int MaxNumPrinted = 15;
-    int iTilt1 = 0, iRoll1 = 0;
+    int iTilt1 = angles->getMinTilt(), iRoll1 = 0;
     for (int iView1 = 0; iView1 != numViews && iView1 != MaxNumPrinted; ++iView1)
     {
         // print a line of numbers
-        int iTilt2 = 0, iRoll2 = 0;
+        int iTilt2 = angles->getMinTilt(), iRoll2 = 0;
         for (int iView2 = 0; iView2 != numViews && iView2 != MaxNumPrinted; ++iView2)
         {
             int num = histogram.at<int>(iView1, iView2);
@@ -490,7 +536,7 @@ void printMatchHistogram (const vector<KeyPoint>& keypoints1, const vector<KeyPo
             iRoll1 = 0;
             
             // print a separation line
-            int iTilt2 = 0, iRoll2 = 0;
+            int iTilt2 = angles->getMinTilt(), iRoll2 = 0;
             for (int iView2 = 0; iView2 != numViews && iView2 != MaxNumPrinted; ++iView2)
             {
                 cout << "----";
@@ -46,6 +46,7 @@
 //M*/
 
 #include <iostream>
+#include <cfloat>
 #include <map>
 #include <algorithm>
 
@@ -92,6 +93,30 @@ private:
                                     (const map<ViewIdPair, DMatchesVector>& matchesByView,
                                      const vector<View>& queryViews, const vector<View>& trainViews,
                                      CV_OUT vector<vector<DMatch> >& matches) const;
+    
+    void               crossViewRatioMatch
+                                    (const vector<View>& queryViews, const vector<View>& trainViews,
+                                     const vector<KeyPoint>& trainKeypoints, float threshNNDR,
+                                     CV_OUT vector<DMatch>& matches) const;
+    
+    // ratio test of the best candidate against the best one at another location.
+    //   'unseenDistance' bounds from below distances of candidates the search did not return
+    bool               passesCrossViewRatio
+                                    (vector<DMatch>& candidates, const vector<KeyPoint>& trainKeypoints,
+                                     float threshNNDR, float unseenDistance) const;
+    
+    // matches of one view pair with local indices: the best that pass the ratio test
+    //   if ratioTest, otherwise the nearest. Cross-checked if _crossCheck
+    void               matchViewPair    (const Mat& queryDescriptors, const Mat& trainDescriptors,
+                                         bool ratioTest, float threshNNDR,
+                                         CV_OUT vector<DMatch>& matches) const;
+    
+    // cross-check of matches over all views, with a reverse search by 'matcher'
+    void               crossCheckAllViews
+                                    (const vector<KeyPoint>& queryKeypoints,
+                                     const Mat& queryDescriptors, const Mat& trainDescriptors,
+                                     const DescriptorMatcher& matcher,
+                                     CV_OUT vector<DMatch>& matches) const;
 
 private:
 
@@ -101,16 +126,35 @@ private:
     // view pairs that are actually matched
     std::set<ViewIdPair>   _viewPairsPool;
     
+    // ratio test across train views, see setCrossViewRatio
+    bool                   _crossViewRatio;
+    float                  _duplicateRadius;
+    
+    // one index for all train views, see setGlobalIndex
+    Ptr<DescriptorMatcher> _indexMatcher;
+    
+    // keep only mutual nearest neighbours, see setCrossCheck
+    bool                   _crossCheck;
+    
     
 public:
     AffDescriptorMatcherImpl (const Ptr<DescriptorMatcher>& matcher_)
-       : _matcher(matcher_) { CV_Assert(_matcher != NULL); }
+       : _matcher(matcher_), _crossViewRatio(false), _duplicateRadius(2.f), _crossCheck(false)
+       { CV_Assert(_matcher != NULL); }
     
     virtual ~AffDescriptorMatcherImpl() { }
     
     bool    isMaskSupported() const      { return _matcher->isMaskSupported(); }
 
     void    setViewPairsPool( std::set< ViewIdPair > viewPairsPool );
+    
+    void    setCrossViewRatio( bool enable, float duplicateRadius )
+                { _crossViewRatio = enable; _duplicateRadius = duplicateRadius; }
+    
+    void    setGlobalIndex( const Ptr<DescriptorMatcher>& indexMatcher )
+                { _indexMatcher = indexMatcher; }
+    
+    void    setCrossCheck( bool enable )    { _crossCheck = enable; }
 
     void    match(       const vector<KeyPoint>& queryKeypoints,
                          const vector<KeyPoint>& trainKeypoints,
@@ -128,6 +172,11 @@ public:
                          const Mat& queryDescriptors, const Mat& trainDescriptors,
                          vector<vector<DMatch> >& matches, float maxDistance,
                          const Mat& mask=Mat(), bool compactResult=false ) const;
+
+    void    ratioMatch(  const vector<KeyPoint>& queryKeypoints,
+                         const vector<KeyPoint>& trainKeypoints,
+                         const Mat& queryDescriptors, const Mat& trainDescriptors,
+                         CV_OUT vector<DMatch>& matches, float threshNNDR ) const;
 };
 
 
@@ -180,15 +229,15 @@ void AffDescriptorMatcherImpl::splitByViews (const vector<KeyPoint>& queryKeypoi
     trainNumViews++;
     
     // make sure numView is resonable and KeyPoint::class_id is not used for something else
-    if (queryNumViews < 0 || queryNumViews > AffAngles::MaxPossibleNumViews ||
-        trainNumViews < 0 || trainNumViews > AffAngles::MaxPossibleNumViews)
+    if (queryNumViews < 0 || queryNumViews > AffAngles::MaxNumViews ||
+        trainNumViews < 0 || trainNumViews > AffAngles::MaxNumViews)
     {
         cerr << "AffDescriptorMatcherImpl::splitByViews: queryNumViews == " << queryNumViews
              << ", trainNumViews == " << trainNumViews
              << ". The KeyPoint::class_id is probably used by some other tool" << endl;
     }
-    CV_Assert (queryNumViews <= AffAngles::MaxPossibleNumViews && queryNumViews >= 0);
-    CV_Assert (trainNumViews <= AffAngles::MaxPossibleNumViews && trainNumViews >= 0);
+    CV_Assert (queryNumViews <= AffAngles::MaxNumViews && queryNumViews >= 0);
+    CV_Assert (trainNumViews <= AffAngles::MaxNumViews && trainNumViews >= 0);
     
     queryViews = vector<View>(queryNumViews);
     trainViews = vector<View>(trainNumViews);
@@ -253,6 +302,52 @@ void AffDescriptorMatcherImpl::match( const std::vector<KeyPoint>& queryKeypoint
                                       const Mat& queryDescriptors, const Mat& trainDescriptors,
                                       CV_OUT std::vector<DMatch>& matches_, const Mat& mask ) const
 {
+    if (_crossCheck)
+    {
+        // the reverse search has no mask to follow
+        CV_Assert (mask.empty());
+        
+        // the reverse search is exact, by _matcher, also with a global index
+        if (!_indexMatcher.empty())
+        {
+            _indexMatcher->match (queryDescriptors, trainDescriptors, matches_);
+            crossCheckAllViews (queryKeypoints, queryDescriptors, trainDescriptors, *_matcher,
+                                matches_);
+            return;
+        }
+        
+        vector<View> queryViews, trainViews;
+        splitByViews (queryKeypoints, trainKeypoints, queryDescriptors, trainDescriptors,
+                      queryViews, trainViews);
+        
+        // with the cross-view ratio, matches are checked back over all query views at the end
+        matches_.clear();
+        vector<DMatch> viewPairMatches;
+        for (int iView1 = 0; iView1 != queryViews.size(); ++iView1)
+            for (int iView2 = 0; iView2 != trainViews.size(); ++iView2)
+            {
+                if ( !_viewPairsPool.empty() && !_viewPairsPool.count(make_pair(iView1, iView2)) )
+                    continue;
+                if (_crossViewRatio)
+                    _matcher->match (queryViews[iView1].getDescriptors(),
+                                     trainViews[iView2].getDescriptors(), viewPairMatches);
+                else
+                    matchViewPair (queryViews[iView1].getDescriptors(),
+                                   trainViews[iView2].getDescriptors(), false, 0, viewPairMatches);
+                for (unsigned long i = 0; i != viewPairMatches.size(); ++i)
+                {
+                    DMatch match = viewPairMatches[i];
+                    match.queryIdx = queryViews[iView1].getGlobalIdx(match.queryIdx);
+                    match.trainIdx = trainViews[iView2].getGlobalIdx(match.trainIdx);
+                    matches_.push_back (match);
+                }
+            }
+        if (_crossViewRatio)
+            crossCheckAllViews (queryKeypoints, queryDescriptors, trainDescriptors, *_matcher,
+                                matches_);
+        return;
+    }
+    
     vector<vector<DMatch> > matchesKnn;
     knnMatch( queryKeypoints, trainKeypoints, queryDescriptors, trainDescriptors,
               matchesKnn, 1, mask, true );
@@ -271,6 +366,13 @@ void AffDescriptorMatcherImpl::knnMatch( const vector<KeyPoint>& queryKeypoints_
                                          CV_OUT vector<vector<DMatch> >& matches_, int k_,
                                          const Mat& mask_, bool compactResult_) const
 {
+    // train indices of one index are the global ones
+    if (!_indexMatcher.empty())
+    {
+        _indexMatcher->knnMatch (queryDescriptors_, trainDescriptors_, matches_, k_);
+        return;
+    }
+    
     // split by view pairs
     vector<View> queryViews, trainViews;
     splitByViews (queryKeypoints_, trainKeypoints_, queryDescriptors_, trainDescriptors_,
@@ -298,6 +400,12 @@ void AffDescriptorMatcherImpl::radiusMatch
            std::vector<std::vector<DMatch> >& matches_,
            float maxDistance_, const Mat& mask_, bool compactResult_ ) const
 {
+    if (!_indexMatcher.empty())
+    {
+        _indexMatcher->radiusMatch (queryDescriptors_, trainDescriptors_, matches_, maxDistance_);
+        return;
+    }
+    
     // split by view pairs
     vector<View> queryViews, trainViews;
     splitByViews (queryKeypoints_, trainKeypoints_, queryDescriptors_, trainDescriptors_,
@@ -319,6 +427,237 @@ void AffDescriptorMatcherImpl::radiusMatch
 }
 
 
+void AffDescriptorMatcherImpl::ratioMatch( const vector<KeyPoint>& queryKeypoints_,
+                                           const vector<KeyPoint>& trainKeypoints_,
+                                           const Mat& queryDescriptors_, const Mat& trainDescriptors_,
+                                           CV_OUT vector<DMatch>& matches_, float threshNNDR_) const
+{
+    // all query descriptors against one index of all train descriptors. The 2nd best is then
+    //   mostly the same point from another view, so the ratio test skips near duplicates
+    if (!_indexMatcher.empty())
+    {
+        const int KnnGlobal = 8;
+        vector<vector<DMatch> > matchesKnn;
+        _indexMatcher->knnMatch (queryDescriptors_, trainDescriptors_, matchesKnn, KnnGlobal);
+        matches_.clear();
+        for (int i = 0; i != matchesKnn.size(); ++i)
+        {
+            // a point seen from many views may fill all KnnGlobal candidates with duplicates
+            const float unseenDistance = (matchesKnn[i].size() == KnnGlobal)
+                                       ? matchesKnn[i].back().distance : FLT_MAX;
+            if (passesCrossViewRatio (matchesKnn[i], trainKeypoints_, threshNNDR_, unseenDistance))
+            {
+                matches_.push_back (matchesKnn[i][0]);
+                matches_.back().imgIdx = 0;
+            }
+        }
+        if (_crossCheck)
+            crossCheckAllViews (queryKeypoints_, queryDescriptors_, trainDescriptors_, *_matcher,
+                                matches_);
+        return;
+    }
+    
+    // split by view pairs
+    vector<View> queryViews, trainViews;
+    splitByViews (queryKeypoints_, trainKeypoints_, queryDescriptors_, trainDescriptors_,
+                  queryViews, trainViews);
+    
+    if (_crossViewRatio)
+    {
+        crossViewRatioMatch (queryViews, trainViews, trainKeypoints_, threshNNDR_, matches_);
+        if (_crossCheck)
+            crossCheckAllViews (queryKeypoints_, queryDescriptors_, trainDescriptors_, *_matcher,
+                                matches_);
+        return;
+    }
+    
+    matches_.clear();
+    vector<DMatch> viewPairMatches;
+    
+    // if _viewPairsPool is empty viewpairs have not been set. Then match all pairs
+    for (int iView1 = 0; iView1 != queryViews.size(); ++iView1)
+        for (int iView2 = 0; iView2 != trainViews.size(); ++iView2)
+        {
+            if ( !_viewPairsPool.empty() && !_viewPairsPool.count(make_pair(iView1, iView2)) )
+                continue;
+            
+            matchViewPair (queryViews[iView1].getDescriptors(), trainViews[iView2].getDescriptors(),
+                           true, threshNNDR_, viewPairMatches);
+            
+            for (unsigned long i = 0; i != viewPairMatches.size(); ++i)
+            {
+                DMatch match = viewPairMatches[i];
+                match.queryIdx = queryViews[iView1].getGlobalIdx(match.queryIdx);
+                match.trainIdx = trainViews[iView2].getGlobalIdx(match.trainIdx);
+                matches_.push_back (match);
+            }
+        }
+}
+
+
+void AffDescriptorMatcherImpl::crossViewRatioMatch
+                               (const vector<View>& queryViews, const vector<View>& trainViews,
+                                const vector<KeyPoint>& trainKeypoints, float threshNNDR_,
+                                CV_OUT vector<DMatch>& matches_) const
+{
+    // a few best of every train view, in case the 2nd best of a view is also a duplicate
+    const int KnnPerView = 3;
+    
+    matches_.clear();
+    vector<vector<DMatch> > candidates, matchesKnn;
+    vector<float> unseenDistances;
+    
+    // query views one by one, so that candidates of only one view are kept
+    for (int iView1 = 0; iView1 != queryViews.size(); ++iView1)
+    {
+        const Mat queryDescriptors = queryViews[iView1].getDescriptors();
+        candidates.assign (queryDescriptors.rows, vector<DMatch>());
+        unseenDistances.assign (queryDescriptors.rows, FLT_MAX);
+        
+        for (int iView2 = 0; iView2 != trainViews.size(); ++iView2)
+        {
+            if ( !_viewPairsPool.empty() && !_viewPairsPool.count(make_pair(iView1, iView2)) )
+                continue;
+            _matcher->knnMatch (queryDescriptors, trainViews[iView2].getDescriptors(),
+                                matchesKnn, KnnPerView);
+            for (int i = 0; i != matchesKnn.size(); ++i)
+            {
+                for (unsigned long j = 0; j != matchesKnn[i].size(); ++j)
+                {
+                    DMatch match = matchesKnn[i][j];
+                    match.trainIdx = trainViews[iView2].getGlobalIdx(match.trainIdx);
+                    candidates[match.queryIdx].push_back (match);
+                }
+                // the rest of a full list of the view is not closer than its last
+                if (matchesKnn[i].size() == KnnPerView)
+                {
+                    float& unseenDistance = unseenDistances[matchesKnn[i][0].queryIdx];
+                    unseenDistance = std::min (unseenDistance, matchesKnn[i].back().distance);
+                }
+            }
+        }
+        
+        for (int i = 0; i != candidates.size(); ++i)
+            if (passesCrossViewRatio (candidates[i], trainKeypoints, threshNNDR_, unseenDistances[i]))
+            {
+                DMatch match = candidates[i][0];
+                match.queryIdx = queryViews[iView1].getGlobalIdx(i);
+                match.imgIdx = 0;
+                matches_.push_back (match);
+            }
+    }
+}
+
+
+// candidates are sorted, and the best is compared with the best at another location.
+//   Candidates merged from per-view lists are not the global top ones: a closer one of a view
+//   may be past its list, and is bounded only by unseenDistance
+bool AffDescriptorMatcherImpl::passesCrossViewRatio
+                               (vector<DMatch>& candidates, const vector<KeyPoint>& trainKeypoints,
+                                float threshNNDR_, float unseenDistance) const
+{
+    if (candidates.empty()) return false;
+    std::stable_sort (candidates.begin(), candidates.end());
+    
+    const float radius2 = _duplicateRadius * _duplicateRadius;
+    const Point2f bestPoint = trainKeypoints[candidates[0].trainIdx].pt;
+    for (unsigned long j = 1; j != candidates.size(); ++j)
+    {
+        const Point2f offset = trainKeypoints[candidates[j].trainIdx].pt - bestPoint;
+        if (offset.dot(offset) <= radius2) continue;
+        const float secondDistance = std::min (candidates[j].distance, unseenDistance);
+        return secondDistance != 0 && candidates[0].distance / secondDistance < threshNNDR_;
+    }
+    
+    // all candidates are duplicates of the best, as for a point detected in many views.
+    //   The 2nd best at another location is among unseen ones, if any
+    return unseenDistance != FLT_MAX && unseenDistance != 0 &&
+           candidates[0].distance / unseenDistance < threshNNDR_;
+}
+
+
+void AffDescriptorMatcherImpl::matchViewPair (const Mat& queryDescriptors, const Mat& trainDescriptors,
+                                              bool ratioTest, float threshNNDR_,
+                                              CV_OUT vector<DMatch>& matches_) const
+{
+    // brute-force matchers of this library do the ratio test and the cross-check while scanning
+    const AffBFMatcher* bfMatcher = dynamic_cast<const AffBFMatcher*>(_matcher.get());
+    if (bfMatcher && ratioTest)
+    {
+        bfMatcher->ratioMatch (queryDescriptors, trainDescriptors, matches_, threshNNDR_, _crossCheck);
+        return;
+    }
+    if (bfMatcher && _crossCheck)
+    {
+        bfMatcher->crossCheckMatch (queryDescriptors, trainDescriptors, matches_);
+        return;
+    }
+    
+    matches_.clear();
+    vector<vector<DMatch> > matchesKnn;
+    _matcher->knnMatch (queryDescriptors, trainDescriptors, matchesKnn, ratioTest ? 2 : 1);
+    for (int i = 0; i != matchesKnn.size(); ++i)
+    {
+        if (ratioTest)
+        {
+            if (matchesKnn[i].size() >= 2 && matchesKnn[i][1].distance != 0 &&
+                matchesKnn[i][0].distance / matchesKnn[i][1].distance < threshNNDR_)
+                matches_.push_back (matchesKnn[i][0]);
+        }
+        else if (!matchesKnn[i].empty())
+            matches_.push_back (matchesKnn[i][0]);
+    }
+    
+    // other matchers need a reverse search
+    if (_crossCheck && !matches_.empty())
+    {
+        _matcher->knnMatch (trainDescriptors, queryDescriptors, matchesKnn, 1);
+        vector<int> bestQuery (trainDescriptors.rows, -1);
+        for (int i = 0; i != matchesKnn.size(); ++i)
+            if (!matchesKnn[i].empty())
+                bestQuery[matchesKnn[i][0].queryIdx] = matchesKnn[i][0].trainIdx;
+        
+        vector<DMatch> mutualMatches;
+        for (unsigned long i = 0; i != matches_.size(); ++i)
+            if (bestQuery[matches_[i].trainIdx] == matches_[i].queryIdx)
+                mutualMatches.push_back (matches_[i]);
+        matches_.swap (mutualMatches);
+    }
+}
+
+
+// the nearest query descriptor to the train descriptor of a match may be the same point
+//   in another query view, so it is accepted within _duplicateRadius of the query keypoint
+void AffDescriptorMatcherImpl::crossCheckAllViews
+                               (const vector<KeyPoint>& queryKeypoints,
+                                const Mat& queryDescriptors, const Mat& trainDescriptors,
+                                const DescriptorMatcher& matcher,
+                                CV_OUT vector<DMatch>& matches_) const
+{
+    if (matches_.empty()) return;
+    
+    // only train descriptors of matches are searched back
+    Mat matchedDescriptors (int(matches_.size()), trainDescriptors.cols, trainDescriptors.type());
+    for (unsigned long i = 0; i != matches_.size(); ++i)
+        trainDescriptors.row(matches_[i].trainIdx).copyTo (matchedDescriptors.row(int(i)));
+    
+    vector<vector<DMatch> > reverseKnn;
+    matcher.knnMatch (matchedDescriptors, queryDescriptors, reverseKnn, 1);
+    
+    const float radius2 = _duplicateRadius * _duplicateRadius;
+    vector<DMatch> mutualMatches;
+    for (unsigned long i = 0; i != matches_.size() && i != reverseKnn.size(); ++i)
+    {
+        if (reverseKnn[i].empty()) continue;
+        const int bestQuery = reverseKnn[i][0].trainIdx;
+        const Point2f offset = queryKeypoints[bestQuery].pt - queryKeypoints[matches_[i].queryIdx].pt;
+        if (bestQuery == matches_[i].queryIdx || offset.dot(offset) <= radius2)
+            mutualMatches.push_back (matches_[i]);
+    }
+    matches_.swap (mutualMatches);
+}
+
+
 
 
 }} // namespaces
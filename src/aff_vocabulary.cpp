@@ -0,0 +1,440 @@
+/*M///////////////////////////////////////////////////////////////////////////////////////
+//
+//  An OpenCV Implementation of affine-covariant matching (matching with different viewpoints)
+//  Further Information Refer to:
+//  Author: Evgeny Toropov
+//  etoropov@andrew.cmu.edu
+//
+// IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+// 
+// By downloading, copying, installing or using the software you agree to this license.
+// If you do not agree to this license, do not download, install,
+// copy or use the software.
+// 
+// 
+//                           License Agreement
+//                For Open Source Computer Vision Library
+// 
+// Copyright (C) 2000-2008, Intel Corporation, all rights reserved.
+// Copyright (C) 2008-2013, Willow Garage Inc., all rights reserved.
+// Third party copyrights are property of their respective owners.
+// 
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+// 
+//   * Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+// 
+//   * Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+// 
+//   * The name of the copyright holders may not be used to endorse or promote products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is" and
+// any express or implied warranties, including, but not limited to, the implied
+// warranties of merchantability and fitness for a particular purpose are disclaimed.
+// In no event shall the Intel Corporation or contributors be liable for any direct,
+// indirect, incidental, special, exemplary, or consequential damages
+// (including, but not limited to, procurement of substitute goods or services;
+// loss of use, data, or profits; or business interruption) however caused
+// and on any theory of liability, whether in contract, strict liability,
+// or tort (including negligence or otherwise) arising in any way out of
+// the use of this software, even if advised of the possibility of such damage.
+//
+//M*/
+
+#include <cmath>
+#include <map>
+#include <algorithm>
+#include <functional>
+
+#include "aff_features2d.hpp"
+
+
+using namespace std;
+
+namespace cv { namespace affma {
+
+
+
+/****************************************************************************************\
+*                                  Vocabulary tree                                       *
+\****************************************************************************************/
+
+
+namespace {
+
+// rows as CV_32F, binary descriptors as one float 0 or 1 per bit,
+//   so that L2 distance between rows is the square root of Hamming distance
+void toFloatRows (const Mat& descriptors, Mat& rows)
+{
+    if (descriptors.type() != CV_8U)
+    {
+        descriptors.convertTo (rows, CV_32F);
+        return;
+    }
+    rows.create (descriptors.rows, descriptors.cols * 8, CV_32F);
+    for (int i = 0; i != descriptors.rows; ++i)
+    {
+        const uchar* src = descriptors.ptr<uchar>(i);
+        float* dst = rows.ptr<float>(i);
+        for (int j = 0; j != descriptors.cols; ++j)
+            for (int bit = 0; bit != 8; ++bit)
+                dst[j * 8 + bit] = float((src[j] >> bit) & 1);
+    }
+}
+
+float squaredDistance (const float* a, const float* b, int n)
+{
+    float sum = 0;
+    for (int i = 0; i != n; ++i)
+        sum += (a[i] - b[i]) * (a[i] - b[i]);
+    return sum;
+}
+
+bool bySimilarity (const pair<float, pair<int, int> >& a, const pair<float, pair<int, int> >& b)
+    { return a.first > b.first; }
+
+} // namespace
+
+
+
+class AffVocabularyImpl : public AffVocabulary {
+private:
+
+    // nodes of the tree, node 0 is the root. Children of a node are stored together
+    Mat          _centers;          // one row per node, the row of the root is not used
+    vector<int>  _firstChild;       // -1 for leaves
+    vector<int>  _numChildren;
+    vector<int>  _words;            // word of a leaf, -1 for other nodes
+    int          _numWords;
+    
+    vector<float>  _idf;
+    
+    int   addNodes (const Mat& centers);
+    void  trainNode (int node, const Mat& rows, int branching, int levelsLeft);
+    int   quantizeRow (const float* row) const;
+
+public:
+    AffVocabularyImpl () : _numWords(0) { }
+    
+    void  train (const Mat& descriptors, int branching, int depth);
+    int   getNumWords () const    { return _numWords; }
+    
+    void  quantize (const Mat& descriptors, vector<int>& words) const;
+    void  trainIdf (const vector<vector<int> >& documents);
+    void  computeBow (const vector<int>& words, AffBowVector& bow) const;
+    void  computeViewBows (const vector<KeyPoint>& keypoints, const Mat& descriptors,
+                           vector<AffBowVector>& bows) const;
+    
+    void  save (const string& filepath) const;
+    void  load (const string& filepath);
+};
+
+
+// appends nodes with 'centers' as leaves, returns the index of the first one
+int AffVocabularyImpl::addNodes (const Mat& centers)
+{
+    const int first = int(_firstChild.size());
+    _centers.push_back (centers);
+    _firstChild.insert (_firstChild.end(), centers.rows, -1);
+    _numChildren.insert (_numChildren.end(), centers.rows, 0);
+    _words.insert (_words.end(), centers.rows, -1);
+    return first;
+}
+
+
+void AffVocabularyImpl::trainNode (int node, const Mat& rows, int branching, int levelsLeft)
+{
+    if (levelsLeft == 0 || rows.rows < branching)
+    {
+        _words[node] = _numWords++;
+        return;
+    }
+    
+    Mat labels, centers;
+    kmeans (rows, branching, labels, TermCriteria (TermCriteria::COUNT + TermCriteria::EPS, 10, 1e-3),
+            1, KMEANS_PP_CENTERS, centers);
+    
+    const int first = addNodes (centers);
+    _firstChild[node] = first;
+    _numChildren[node] = branching;
+    
+    for (int child = 0; child != branching; ++child)
+    {
+        Mat childRows;
+        for (int i = 0; i != rows.rows; ++i)
+            if (labels.at<int>(i) == child)
+                childRows.push_back (rows.row(i));
+        if (childRows.empty())
+            _words[first + child] = _numWords++;
+        else
+            trainNode (first + child, childRows, branching, levelsLeft - 1);
+    }
+}
+
+
+void AffVocabularyImpl::train (const Mat& descriptors, int branching, int depth)
+{
+    CV_Assert (branching >= 2 && depth >= 1 && !descriptors.empty());
+    
+    Mat rows;
+    toFloatRows (descriptors, rows);
+    
+    _centers.release();
+    _firstChild.clear();
+    _numChildren.clear();
+    _words.clear();
+    _numWords = 0;
+    addNodes (Mat::zeros (1, rows.cols, CV_32F));
+    trainNode (0, rows, branching, depth);
+    
+    _idf.assign (_numWords, 1.f);
+}
+
+
+int AffVocabularyImpl::quantizeRow (const float* row) const
+{
+    int node = 0;
+    while (_firstChild[node] >= 0)
+    {
+        int best = _firstChild[node];
+        float bestDistance = squaredDistance (row, _centers.ptr<float>(best), _centers.cols);
+        for (int child = best + 1; child != _firstChild[node] + _numChildren[node]; ++child)
+        {
+            const float distance = squaredDistance (row, _centers.ptr<float>(child), _centers.cols);
+            if (distance < bestDistance)
+            {
+                best = child;
+                bestDistance = distance;
+            }
+        }
+        node = best;
+    }
+    return _words[node];
+}
+
+
+void AffVocabularyImpl::quantize (const Mat& descriptors, vector<int>& words) const
+{
+    if (!_numWords)
+        CV_Error (Error::StsError, "AffVocabulary::quantize: train() or load() the vocabulary first");
+    
+    words.resize (descriptors.rows);
+    if (descriptors.empty()) return;
+    
+    Mat rows;
+    toFloatRows (descriptors, rows);
+    CV_Assert (rows.cols == _centers.cols);
+    for (int i = 0; i != rows.rows; ++i)
+        words[i] = quantizeRow (rows.ptr<float>(i));
+}
+
+
+void AffVocabularyImpl::trainIdf (const vector<vector<int> >& documents)
+{
+    CV_Assert (_numWords > 0 && !documents.empty());
+    
+    // in how many documents every word is
+    vector<int> numDocuments (_numWords, 0);
+    vector<int> lastDocument (_numWords, -1);
+    for (int d = 0; d != documents.size(); ++d)
+        for (int i = 0; i != documents[d].size(); ++i)
+        {
+            const int word = documents[d][i];
+            CV_Assert (word >= 0 && word < _numWords);
+            if (lastDocument[word] == d) continue;
+            lastDocument[word] = d;
+            ++numDocuments[word];
+        }
+    
+    // words of no document are as rare as it gets
+    _idf.resize (_numWords);
+    for (int word = 0; word != _numWords; ++word)
+        _idf[word] = log (float(documents.size()) / float(std::max (numDocuments[word], 1)));
+}
+
+
+void AffVocabularyImpl::computeBow (const vector<int>& words, AffBowVector& bow) const
+{
+    bow.clear();
+    if (words.empty()) return;
+    
+    map<int, int> counts;
+    for (int i = 0; i != words.size(); ++i)
+        ++counts[words[i]];
+    
+    // tf-idf, the common factor 1 / words.size() of tf goes away in normalization
+    float norm = 0;
+    for (map<int, int>::const_iterator it = counts.begin(); it != counts.end(); ++it)
+    {
+        const float weight = it->second * _idf[it->first];
+        if (weight <= 0) continue;
+        bow.push_back (make_pair (it->first, weight));
+        norm += weight * weight;
+    }
+    
+    norm = sqrt (norm);
+    for (int i = 0; i != bow.size(); ++i)
+        bow[i].second /= norm;
+}
+
+
+void AffVocabularyImpl::computeViewBows (const vector<KeyPoint>& keypoints, const Mat& descriptors,
+                                         vector<AffBowVector>& bows) const
+{
+    CV_Assert (keypoints.size() == descriptors.rows);
+    
+    vector<int> words;
+    quantize (descriptors, words);
+    
+    vector<vector<int> > viewWords;
+    for (int i = 0; i != keypoints.size(); ++i)
+    {
+        const int view = std::max (keypoints[i].class_id, 0);
+        if (view >= viewWords.size()) viewWords.resize (view + 1);
+        viewWords[view].push_back (words[i]);
+    }
+    
+    bows.resize (viewWords.size());
+    for (int view = 0; view != viewWords.size(); ++view)
+        computeBow (viewWords[view], bows[view]);
+}
+
+
+void AffVocabularyImpl::save (const string& filepath) const
+{
+    FileStorage fs (filepath, FileStorage::WRITE);
+    if (!fs.isOpened())
+        CV_Error (Error::StsError, "AffVocabulary::save: cannot open file " + filepath);
+    fs << "numWords" << _numWords;
+    fs << "centers" << _centers;
+    fs << "firstChild" << _firstChild;
+    fs << "numChildren" << _numChildren;
+    fs << "words" << _words;
+    fs << "idf" << _idf;
+}
+
+
+void AffVocabularyImpl::load (const string& filepath)
+{
+    FileStorage fs (filepath, FileStorage::READ);
+    if (!fs.isOpened())
+        CV_Error (Error::StsError, "AffVocabulary::load: cannot open file " + filepath);
+    int numWords = 0;
+    fs["numWords"] >> numWords;
+    fs["centers"] >> _centers;
+    fs["firstChild"] >> _firstChild;
+    fs["numChildren"] >> _numChildren;
+    fs["words"] >> _words;
+    fs["idf"] >> _idf;
+    
+    const size_t numNodes = _firstChild.size();
+    if (numWords <= 0 || _centers.rows != numNodes || _centers.type() != CV_32F ||
+        _numChildren.size() != numNodes || _words.size() != numNodes || _idf.size() != numWords)
+    {
+        _numWords = 0;
+        CV_Error (Error::StsError, "AffVocabulary::load: bad vocabulary in file " + filepath);
+    }
+    _numWords = numWords;
+}
+
+
+
+Ptr<AffVocabulary> createAffVocabulary()
+{
+    return new AffVocabularyImpl();
+}
+
+
+
+float bowSimilarity (const AffBowVector& bow1, const AffBowVector& bow2)
+{
+    // both are sorted by word
+    float similarity = 0;
+    AffBowVector::const_iterator it1 = bow1.begin(), it2 = bow2.begin();
+    while (it1 != bow1.end() && it2 != bow2.end())
+    {
+        if      (it1->first < it2->first) ++it1;
+        else if (it2->first < it1->first) ++it2;
+        else    similarity += (it1++)->second * (it2++)->second;
+    }
+    return similarity;
+}
+
+
+void rankImagePairs (const vector<AffBowVector>& bows, int numPairsPerImage,
+                     vector<pair<int, int> >& pairs, vector<float>& similarities)
+{
+    pairs.clear();
+    similarities.clear();
+    
+    // inverted file: images and weights of every word
+    map<int, vector<pair<int, float> > > invertedFile;
+    for (int image = 0; image != bows.size(); ++image)
+        for (int i = 0; i != bows[image].size(); ++i)
+            invertedFile[bows[image][i].first].push_back (make_pair (image, bows[image][i].second));
+    
+    // best pairs of every image, similarity of a pair is accumulated over shared words
+    map<pair<int, int>, float> bestPairs;
+    vector<float> scores (bows.size());
+    vector<pair<float, int> > ranked;
+    for (int image = 0; image != bows.size(); ++image)
+    {
+        std::fill (scores.begin(), scores.end(), 0.f);
+        for (int i = 0; i != bows[image].size(); ++i)
+        {
+            const vector<pair<int, float> >& postings = invertedFile[bows[image][i].first];
+            for (int j = 0; j != postings.size(); ++j)
+                scores[postings[j].first] += bows[image][i].second * postings[j].second;
+        }
+        
+        ranked.clear();
+        for (int other = 0; other != bows.size(); ++other)
+            if (other != image && scores[other] > 0)
+                ranked.push_back (make_pair (scores[other], other));
+        const int numBest = std::max (std::min (int(ranked.size()), numPairsPerImage), 0);
+        std::partial_sort (ranked.begin(), ranked.begin() + numBest, ranked.end(),
+                           std::greater<pair<float, int> >());
+        for (int i = 0; i != numBest; ++i)
+            bestPairs[make_pair (std::min (image, ranked[i].second),
+                                 std::max (image, ranked[i].second))] = ranked[i].first;
+    }
+    
+    vector<pair<float, pair<int, int> > > sorted;
+    for (map<pair<int, int>, float>::const_iterator it = bestPairs.begin(); it != bestPairs.end(); ++it)
+        sorted.push_back (make_pair (it->second, it->first));
+    std::stable_sort (sorted.begin(), sorted.end(), bySimilarity);
+    
+    for (int i = 0; i != sorted.size(); ++i)
+    {
+        pairs.push_back (sorted[i].second);
+        similarities.push_back (sorted[i].first);
+    }
+}
+
+
+set<pair<int, int> > selectViewPairs (const vector<AffBowVector>& queryViewBows,
+                                      const vector<AffBowVector>& trainViewBows,
+                                      int numViewPairs)
+{
+    // pairs without shared words too, so that there is always a best one
+    vector<pair<float, pair<int, int> > > viewPairs;
+    for (int view1 = 0; view1 != queryViewBows.size(); ++view1)
+        for (int view2 = 0; view2 != trainViewBows.size(); ++view2)
+            viewPairs.push_back (make_pair (bowSimilarity (queryViewBows[view1], trainViewBows[view2]),
+                                            make_pair (view1, view2)));
+    
+    const int numBest = std::min (int(viewPairs.size()), std::max (numViewPairs, 1));
+    std::stable_sort (viewPairs.begin(), viewPairs.end(), bySimilarity);
+    
+    set<pair<int, int> > bestViewPairs;
+    for (int i = 0; i != numBest; ++i)
+        bestViewPairs.insert (viewPairs[i].second);
+    return bestViewPairs;
+}
+
+
+}} // namespace
@@ -0,0 +1,261 @@
+//
+//  aff_image_database.cpp
+//
+//  Build a database of affine features of many images, and find images that a query matches
+//  or pairs of its images worth matching
+//
+
+#include <iostream>
+#include <fstream>
+
+#include <boost/filesystem.hpp>
+
+#include <tclap/CmdLine.h>
+
+#include "aff_features2d.hpp"
+
+#include "mediaIO.h"
+
+using namespace std;
+using namespace cv;
+using namespace boost::filesystem;
+using namespace TCLAP;
+
+
+// image paths from a text file, one per line. Their order gives image ids in the database
+static bool readImageList (const std::string& listPath, vector<string>& imagePaths)
+{
+    std::ifstream ifs (listPath.c_str());
+    if (!ifs)
+    {
+        cerr << "cannot open image list " << listPath << endl;
+        return false;
+    }
+    imagePaths.clear();
+    string line;
+    while (getline (ifs, line))
+        if (!line.empty())
+            imagePaths.push_back (line);
+    return true;
+}
+
+
+// vocabulary trained on about maxRows descriptors spread over all images of the database
+static Ptr<affma::AffVocabulary> trainVocabulary (const affma::AffImageDatabase& database,
+                                                  int64 numKeypoints, int maxRows)
+{
+    const int64 step = std::max (numKeypoints / maxRows, int64(1));
+    Mat sample;
+    int64 row = 0;
+    for (int i = 0; i != database.getNumImages(); ++i)
+    {
+        vector<KeyPoint> keypoints;
+        Mat descriptors;
+        database.getImageFeatures (i, keypoints, descriptors);
+        for (int j = 0; j != descriptors.rows; ++j, ++row)
+            if (row % step == 0)
+                sample.push_back (descriptors.row(j));
+    }
+    
+    Ptr<affma::AffVocabulary> vocabulary = affma::createAffVocabulary();
+    vocabulary->train (sample);
+    return vocabulary;
+}
+
+
+// the numPairsPerImage most similar images of every image, by words of all its views.
+//   Images of the database are the documents of IDF
+static void rankDatabasePairs (const affma::AffImageDatabase& database, affma::AffVocabulary& vocabulary,
+                               int numPairsPerImage, vector<pair<int, int> >& pairs,
+                               vector<float>& similarities)
+{
+    vector<vector<int> > documents (database.getNumImages());
+    for (int i = 0; i != database.getNumImages(); ++i)
+    {
+        vector<KeyPoint> keypoints;
+        Mat descriptors;
+        database.getImageFeatures (i, keypoints, descriptors);
+        if (!descriptors.empty())
+            vocabulary.quantize (descriptors, documents[i]);
+    }
+    vocabulary.trainIdf (documents);
+    
+    vector<affma::AffBowVector> bows (documents.size());
+    for (int i = 0; i != documents.size(); ++i)
+        vocabulary.computeBow (documents[i], bows[i]);
+    affma::rankImagePairs (bows, numPairsPerImage, pairs, similarities);
+}
+
+
+int main(int argc, const char * argv[])
+{
+    // parse input
+    CmdLine cmd ("build a database of affine features of images, or query it with an image");
+    
+    vector<string> featureTypes = affma::getFeatureBackendNames();
+    ValuesConstraint<string> cmdFeatureTypes( featureTypes );
+    ValueArg<string> cmdFeature("f", "feature", "feature type", true, "", &cmdFeatureTypes, cmd);
+    
+    ValueArg<int>    cmdMaxFeatures ("", "max_features", "max number of keypoints per view for sift "
+                                     "and orb, 0 for the default", false, 0, "int", cmd);
+    ValueArg<int>    cmdTilt ("", "max_tilt", "max tilt of views, the same for building and querying",
+                              false, 2, "int", cmd);
+    ValueArg<string> cmdDatabase ("d", "database", "database file path", true, "", "string", cmd);
+    ValueArg<string> cmdImages ("i", "images", "text file with image paths, one per line, "
+                                "the same for building and querying", true, "", "string", cmd);
+    ValueArg<string> cmdQuery ("q", "query", "query image file path. If not set, the database is built",
+                               false, "", "string", cmd);
+    ValueArg<float>  cmdThresh ("t", "threshold", "threshold for matcher in interval [0 1]", false, 0.7f, "float", cmd);
+    ValueArg<int>    cmdNumCandidates ("n", "num_candidates", "max number of images to report",
+                                       false, 10, "int", cmd);
+    ValueArg<int>    cmdMinMatches ("", "min_matches", "min number of matches of a reported image",
+                                    false, 4, "int", cmd);
+    ValueArg<string> cmdVocabulary ("", "vocabulary", "vocabulary tree file for an inverted file index. "
+                                    "When building, it is trained on the images and saved there "
+                                    "if the file does not exist", false, "", "string", cmd);
+    ValueArg<int>    cmdRankPairs ("", "rank_pairs", "instead of a query, print pairs of images of the "
+                                   "database worth matching: the given number of most similar images "
+                                   "of every image by words of the vocabulary", false, 0, "int", cmd);
+    MultiSwitchArg   cmdVerbose ("v", "", "level of verbosity of output", cmd);
+    
+    cmd.parse(argc, argv);
+    string           featureType    = cmdFeature.getValue();
+    int              maxFeatures    = cmdMaxFeatures.getValue();
+    int              maxTilt        = cmdTilt.getValue();
+    string           databaseName   = cmdDatabase.getValue();
+    string           listName       = cmdImages.getValue();
+    string           queryName      = cmdQuery.getValue();
+    float            thres          = cmdThresh.getValue();
+    int              numCandidates  = cmdNumCandidates.getValue();
+    int              minMatches     = cmdMinMatches.getValue();
+    string           vocabularyName = cmdVocabulary.getValue();
+    int              rankPairs      = cmdRankPairs.getValue();
+    int              verbose        = cmdVerbose.getValue();
+    
+    if (rankPairs > 0 && (vocabularyName.empty() || !queryName.empty()))
+    {
+        cerr << "--rank_pairs needs --vocabulary and no --query" << endl;
+        return -1;
+    }
+    
+    vector<string> imagePaths;
+    if (!readImageList (listName, imagePaths)) return -1;
+    
+    Ptr<FeatureDetector> detector;
+    Ptr<DescriptorExtractor> extractor;
+    Ptr<DescriptorMatcher> matcher;
+    affma::createFeatureBackend (featureType, detector, extractor, matcher, maxFeatures);
+    Ptr<affma::AffMatcherHelper> affMatcherHelper = affma::createAffMatcherHelper (detector, extractor, matcher);
+    affMatcherHelper->setVerbosity (verbose);
+    
+    Ptr<affma::AffImageDatabase> database = affma::createAffImageDatabase();
+    
+    try {
+        
+        // build
+        if (queryName.empty() && rankPairs <= 0)
+        {
+            database->setFeatureType (featureType);
+            database->setMaxTilt (maxTilt);
+            int64 numKeypoints = 0;
+            for (int i = 0; i != imagePaths.size(); ++i)
+            {
+                Mat image;
+                vector<KeyPoint> keypoints;
+                Mat descriptors;
+                if (evg::loadImage (imagePaths[i], image))
+                    affMatcherHelper->computeFeatures (image, keypoints, descriptors, maxTilt);
+                database->addImage (keypoints, descriptors);
+                numKeypoints += keypoints.size();
+                if (verbose)
+                    cout << "image " << i << ": " << keypoints.size() << " keypoints" << endl;
+            }
+            
+            // the inverted file or the FLANN indices are saved with the database
+            if (!vocabularyName.empty())
+            {
+                Ptr<affma::AffVocabulary> vocabulary;
+                if (exists(path(vocabularyName)))
+                {
+                    vocabulary = affma::createAffVocabulary();
+                    vocabulary->load (vocabularyName);
+                }
+                else
+                {
+                    vocabulary = trainVocabulary (*database, numKeypoints, 100000);
+                    vocabulary->save (vocabularyName);
+                }
+                if (verbose)
+                    cout << "vocabulary of " << vocabulary->getNumWords() << " words" << endl;
+                database->setVocabulary (vocabulary);
+            }
+            database->train();
+            database->save (databaseName);
+            return 0;
+        }
+        
+        // query or rank pairs
+        if (!exists(path(databaseName)))
+        {
+            cerr << "database " << databaseName << " doesn't exist." << endl;
+            return -1;
+        }
+        database->load (databaseName);
+        if (database->getNumImages() != imagePaths.size())
+        {
+            cerr << "database has " << database->getNumImages() << " images, but the list has "
+                 << imagePaths.size() << endl;
+            return -1;
+        }
+        if (database->getFeatureType() != featureType || database->getMaxTilt() != maxTilt)
+        {
+            cerr << "database was built with " << database->getFeatureType() << " features and max_tilt "
+                 << database->getMaxTilt() << ", but the query uses " << featureType
+                 << " and max_tilt " << maxTilt << endl;
+            return -1;
+        }
+        Ptr<affma::AffVocabulary> vocabulary;
+        if (!vocabularyName.empty())
+        {
+            vocabulary = affma::createAffVocabulary();
+            vocabulary->load (vocabularyName);
+            database->setVocabulary (vocabulary);
+        }
+        
+        // similarity, image ids, image paths
+        if (rankPairs > 0)
+        {
+            vector<pair<int, int> > pairs;
+            vector<float> similarities;
+            rankDatabasePairs (*database, *vocabulary, rankPairs, pairs, similarities);
+            for (int i = 0; i != pairs.size(); ++i)
+                cout << similarities[i] << " " << pairs[i].first << " " << pairs[i].second << " "
+                     << imagePaths[pairs[i].first] << " " << imagePaths[pairs[i].second] << endl;
+            return 0;
+        }
+        
+        // the saved inverted file or indices are ready
+        if (!database->isTrained())
+            database->train();
+        
+        Mat image;
+        if (!evg::loadImage (queryName, image)) return -1;
+        vector<KeyPoint> keypoints;
+        Mat descriptors;
+        affMatcherHelper->computeFeatures (image, keypoints, descriptors, maxTilt);
+        
+        vector<affma::AffImageCandidate> candidates;
+        database->query (keypoints, descriptors, candidates, thres, numCandidates, minMatches);
+        
+        // rank, image id, number of matches, image path
+        for (int i = 0; i != candidates.size(); ++i)
+            cout << i << " " << candidates[i].imageId << " " << candidates[i].matches.size() << " "
+                 << imagePaths[candidates[i].imageId] << endl;
+        
+    } catch (cv::Exception& e) {
+        cerr << e.what() << endl;
+        return -1;
+    }
+    
+    return 0;
+}
@@ -25,62 +25,39 @@ using namespace boost::filesystem;
 using namespace TCLAP;
 
 
-static cv::FeatureDetector* newFeatureDetector (const std::string& featureType)
+// detector, extractor and matcher of the feature type, made ready for affine matching
+//   globalIndex to match all views at once in one FLANN index
+static Ptr<affma::AffMatcherHelper> newAffMatcherHelper (const std::string& featureType,
+                                                         int maxFeatures = 0, bool globalIndex = false,
+                                                         int verbose = 0)
 {
-    FeatureDetector* detector (NULL);
-    // if (featureType == "sift")
-    //     detector = new cv::SIFT();
-    // else if (featureType == "surf")
-    //     detector = new cv::SURF();
-    // else if (featureType == "orb")
-    //     detector = new ORB();
-    // else if (featureType == "brisk")
-    //     detector = new BRISK();
-    // else assert(0);
-    detector = new SIFT();
-    return detector;
+    Ptr<FeatureDetector> detector;
+    Ptr<DescriptorExtractor> extractor;
+    Ptr<DescriptorMatcher> matcher;
+    affma::createFeatureBackend (featureType, detector, extractor, matcher, maxFeatures);
+    if (verbose)
+        cout << "using " << featureType << " with "
+             << (globalIndex ? "one FLANN index" :
+                 extractor->descriptorType() == CV_8U ? "brute force Hamming" : "brute force L2")
+             << endl;
+    Ptr<affma::AffMatcherHelper> helper = affma::createAffMatcherHelper (detector, extractor, matcher);
+    if (globalIndex)
+        helper->setGlobalIndex (affma::createGlobalIndexMatcher (extractor->descriptorType()));
+    return helper;
 }
 
 
-static cv::DescriptorExtractor* newDescriptorExtractor (const string& featureType)
+// words of every view of KeyPoint::class_id, as AffVocabulary::computeViewBows splits them
+static void splitViewWords (const vector<KeyPoint>& keypoints, const vector<int>& words,
+                            vector<vector<int> >& viewWords)
 {
-    DescriptorExtractor* extractor (NULL);
-
-    // if (featureType == "sift")
-    //     extractor = new SIFT();
-    // else if (featureType == "surf")
-    //     extractor = new SURF();
-    // else if (featureType == "orb")
-    //     extractor = new ORB();
-    // else if (featureType == "brisk")
-    //     extractor = new BRISK();
-    // else assert(0);
-    // return extractor;
-    return new SIFT();
-}
-
-
-static cv::DescriptorMatcher* newMatcher (const std::string& featureType, int verbose = 0)
-{
-    cv::DescriptorMatcher* matcher;
-    if      (featureType == "sift" || featureType == "surf")
+    viewWords.clear();
+    for (int i = 0; i != keypoints.size(); ++i)
     {
-        if (verbose) cout << "using FlannBasedMatcher on sift or surf" << endl;
-        matcher = new FlannBasedMatcher();
+        const int view = std::max (keypoints[i].class_id, 0);
+        if (view >= viewWords.size()) viewWords.resize (view + 1);
+        viewWords[view].push_back (words[i]);
     }
-    //else if (featureType == "orb" || featureType == "brisk")
-    //{
-    //    if (verbose) cout << "using BFMatcher(NORM_HAMMING) on orb, or brisk" << endl;
-    //    matcher = new BFMatcher (NORM_HAMMING);
-    //}
-    else if (featureType == "orb" || featureType == "brisk")
-    {
-        if (verbose) cout << "using FlannBasedMatcher(LshIndexParams) on orb or brisk" << endl;
-        matcher = new FlannBasedMatcher(new flann::LshIndexParams(8, 15, 2));
-    }
-    else
-        assert (0);
-    return matcher;
 }
 
 
@@ -89,14 +66,12 @@ int main(int argc, const char * argv[])
     // parse input
     CmdLine cmd ("match pair from user input and write results");
     
-    vector<string> featureTypes;
-    featureTypes.push_back("sift");
-    featureTypes.push_back("surf");
-    featureTypes.push_back("orb");
-    featureTypes.push_back("brisk");
+    vector<string> featureTypes = affma::getFeatureBackendNames();
     ValuesConstraint<string> cmdFeatureTypes( featureTypes );
     ValueArg<string> cmdFeature("f", "feature", "feature type", true, "", &cmdFeatureTypes, cmd);
     
+    ValueArg<int>    cmdMaxFeatures ("", "max_features", "max number of keypoints per view for sift "
+                                     "and orb, 0 for the default", false, 0, "int", cmd);
     ValueArg<int>    cmdTilt ("", "max_tilt", "if not set, incremental match", false, -1, "int", cmd);
     ValueArg<float>  cmdThresh ("t", "threshold", "threshold for matcher in interval [0 1]", false, -1, "float", cmd);
     ValueArg<string> cmd1st ("1", "1st", "1st image file path", true, "", "string", cmd);
@@ -105,9 +80,23 @@ int main(int argc, const char * argv[])
     ValueArg<int>    cmdScreenWidth ("", "screenwidth", "for display", false, 1350, "int", cmd);
     MultiSwitchArg   cmdVerbose ("v", "", "level of verbosity of output", cmd);
     SwitchArg        cmdDisableImshow ("", "disable_image", "don't show image", cmd);
+    SwitchArg        cmdGlobalIndex ("", "global_index", "match descriptors of all views at once "
+                                     "in one FLANN index, instead of view pair by view pair", cmd);
+    SwitchArg        cmdOpenCL ("", "opencl", "warp views and detect on UMat, through OpenCL "
+                                "when a device or CPU runtime is available", cmd);
+    SwitchArg        cmdCrossCheck ("", "cross_check", "keep only matches that are nearest "
+                                    "neighbours both ways", cmd);
+    SwitchArg        cmdCrossViewNNDR ("", "cross_view_nndr", "ratio test against the 2nd best match "
+                                       "in all views of the other image, not only in the same view", cmd);
+    ValueArg<int>    cmdBowViewPairs ("", "bow_view_pairs", "match only this many view pairs, the most "
+                                      "similar by words of --vocabulary. Needs --max_tilt", false, 0, "int", cmd);
+    ValueArg<string> cmdVocabulary ("", "vocabulary", "vocabulary tree file for --bow_view_pairs. If it "
+                                    "does not exist, it is trained on both images and saved there",
+                                    false, "", "string", cmd);
     
     cmd.parse(argc, argv);
     string           featureType    = cmdFeature.getValue();
+    int              maxFeatures    = cmdMaxFeatures.getValue();
     int              maxTilt        = cmdTilt.getValue();
     float            thres          = cmdThresh.getValue();
     string           imageName1     = cmd1st.getValue();
@@ -116,6 +105,18 @@ int main(int argc, const char * argv[])
     int              screenWidth    = cmdScreenWidth.getValue();
     bool             disableImshow  = cmdDisableImshow.getValue();
     int              verbose        = cmdVerbose.getValue();
+    bool             crossViewNNDR  = cmdCrossViewNNDR.getValue();
+    bool             globalIndex    = cmdGlobalIndex.getValue();
+    bool             crossCheck     = cmdCrossCheck.getValue();
+    bool             useOpenCL      = cmdOpenCL.getValue();
+    int              bowViewPairs   = cmdBowViewPairs.getValue();
+    string           vocabularyName = cmdVocabulary.getValue();
+    
+    if (bowViewPairs > 0 && (maxTilt < 0 || vocabularyName.empty()))
+    {
+        cerr << "--bow_view_pairs needs --max_tilt and --vocabulary" << endl;
+        return -1;
+    }
     
     // file for output
     path outPath = absolute(path(outName));
@@ -135,17 +136,67 @@ int main(int argc, const char * argv[])
     if (!evg::loadImage(imageName2, im2)) return 0;
     
     
-    Ptr<FeatureDetector> detector = newFeatureDetector (featureType);
-    Ptr<DescriptorExtractor> extractor = newDescriptorExtractor (featureType);
-    Ptr<DescriptorMatcher> matcher = newMatcher (featureType, verbose);
-    
-    Ptr<cv::affma::AffMatcherHelper> affMatcherHelper = cv::affma::createAffMatcherHelper (detector, extractor, matcher);
+    Ptr<cv::affma::AffMatcherHelper> affMatcherHelper = newAffMatcherHelper (featureType, maxFeatures,
+                                                                                     globalIndex, verbose);
+    affMatcherHelper->setCrossViewRatio (crossViewNNDR);
+    affMatcherHelper->setCrossCheck (crossCheck);
+    affMatcherHelper->setUseOpenCL (useOpenCL);
     
     
     vector<KeyPoint> keypoints1, keypoints2;
     vector<DMatch> matches;
         
-    if (maxTilt >= 0)
+    if (maxTilt >= 0 && bowViewPairs > 0)
+    {
+        Mat descriptors1, descriptors2;
+        affMatcherHelper->computeFeatures (im1, keypoints1, descriptors1, maxTilt);
+        affMatcherHelper->computeFeatures (im2, keypoints2, descriptors2, maxTilt);
+        
+        try {
+            Ptr<affma::AffVocabulary> vocabulary = affma::createAffVocabulary();
+            if (exists(path(vocabularyName)))
+                vocabulary->load (vocabularyName);
+            else
+            {
+                Mat sample;
+                sample.push_back (descriptors1);
+                sample.push_back (descriptors2);
+                vocabulary->train (sample);
+                vocabulary->save (vocabularyName);
+            }
+            
+            // views of both images are the documents of IDF, so that words common to all views
+            //   do not make view pairs similar
+            vector<int> words1, words2;
+            vocabulary->quantize (descriptors1, words1);
+            vocabulary->quantize (descriptors2, words2);
+            vector<vector<int> > viewWords1, viewWords2;
+            splitViewWords (keypoints1, words1, viewWords1);
+            splitViewWords (keypoints2, words2, viewWords2);
+            
+            // an image without views has no matches. The empty pool would mean all pairs
+            if (!viewWords1.empty() && !viewWords2.empty())
+            {
+                vector<vector<int> > documents (viewWords1);
+                documents.insert (documents.end(), viewWords2.begin(), viewWords2.end());
+                vocabulary->trainIdf (documents);
+                
+                // the prefilter: only the view pairs with most similar words are matched
+                vector<affma::AffBowVector> bows1 (viewWords1.size()), bows2 (viewWords2.size());
+                for (int view = 0; view != viewWords1.size(); ++view)
+                    vocabulary->computeBow (viewWords1[view], bows1[view]);
+                for (int view = 0; view != viewWords2.size(); ++view)
+                    vocabulary->computeBow (viewWords2[view], bows2[view]);
+                affMatcherHelper->setViewPairsPool (affma::selectViewPairs (bows1, bows2, bowViewPairs));
+                affMatcherHelper->matchFeatures (keypoints1, keypoints2, descriptors1, descriptors2,
+                                                 matches, thres);
+            }
+        } catch (cv::Exception& e) {
+            cerr << e.what() << endl;
+            return -1;
+        }
+    }
+    else if (maxTilt >= 0)
         affMatcherHelper->matchWithMaxTilt (im1, im2, keypoints1, keypoints2, matches, thres, maxTilt);
     else
         affMatcherHelper->matchIncreasingTilt (im1, im2, keypoints1, keypoints2, matches, thres);
@@ -7,8 +7,13 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <stdexcept>
 #include <set>
 #include <map>
+#include <memory>
+#include <thread>
+#include <atomic>
 
 #include <boost/filesystem.hpp>
 
@@ -21,6 +26,7 @@
 #include "mediaIO.h"
 #include "aff_features2d.hpp"
 #include "featuresIO.h"
+#include "boundedQueue.h"
 
 
 using namespace std;
@@ -30,76 +36,722 @@ using namespace TCLAP;
 using namespace cv::affma;
 
 
-static cv::FeatureDetector* newFeatureDetector (const std::string& featureType)
+// detector, extractor and matcher of the feature type, made ready for affine matching
+//   globalIndex to match all views at once in one FLANN index
+//   codec if descriptors are matched as its codes, quantized ones take an L2 matcher for CV_8U
+static Ptr<affma::AffMatcherHelper> newAffMatcherHelper (const std::string& featureType,
+                                                         int maxFeatures = 0, bool globalIndex = false,
+                                                         int verbose = 0,
+                                                         const evg::DescriptorCodec* codec = 0)
 {
-    // FeatureDetector* detector (NULL);
-    // if (featureType == "sift")
-    //     detector = new SIFT();
-    // else if (featureType == "surf")
-    //     detector = new SURF();
-    // else if (featureType == "orb")
-    //     detector = new ORB();
-    // else if (featureType == "brisk")
-    //     detector = new BRISK();
-    // else assert(0);
-    // return detector;
-    return new SIFT();
+    Ptr<FeatureDetector> detector;
+    Ptr<DescriptorExtractor> extractor;
+    Ptr<DescriptorMatcher> matcher;
+    affma::createFeatureBackend (featureType, detector, extractor, matcher, maxFeatures);
+    if (codec && codec->quantized())
+    {
+        CV_Assert (!globalIndex);
+        matcher = affma::createL2BFMatcher (CV_8U);
+    }
+    if (verbose)
+        cout << "using " << featureType << " with "
+             << (globalIndex ? "one FLANN index" :
+                 extractor->descriptorType() == CV_8U ? "brute force Hamming" : "brute force L2")
+             << endl;
+    Ptr<affma::AffMatcherHelper> helper = affma::createAffMatcherHelper (detector, extractor, matcher);
+    if (globalIndex)
+        helper->setGlobalIndex (affma::createGlobalIndexMatcher (extractor->descriptorType()));
+    return helper;
+}
+
+
+// write matches of a frame pair as outDirPath/matches-<im1>-<im2>.txt, or .bin
+static void writePairMatches (const path& outDirPath, int im1, int im2,
+                              const vector<KeyPoint>& keypoints1,
+                              const vector<KeyPoint>& keypoints2,
+                              const vector<DMatch>& matches,
+                              bool binFormat)
+{
+    ostringstream im1str, im2str;
+    im1str << im1;
+    im2str << im2;
+    string outMatchesName = "matches-" + im1str.str() + "-" + im2str.str()
+                          + (binFormat ? ".bin" : ".txt");
+    path outMatchesPath = outDirPath / outMatchesName;
+    evg::writeSimpleMatches (outMatchesPath.string(), im1str.str(), im2str.str(),
+                             keypoints1, keypoints2, matches, binFormat);
+}
+
+
+
+/// ============================  Retained features  ============================
+//
+// Frames are turned into features as soon as they are decoded, and only features
+//   are kept until all pairs of a frame are matched. Pixels are freed right away,
+//   except for a small gray preview when matches are displayed.
+
+
+struct FrameFeatures {
+    int               frameId;
+    vector<KeyPoint>  keypoints;
+    Mat               descriptors;    // encoded if a descriptor codec is used, and matched as such
+    Mat               preview;        // gray, resized for display, or empty
+    float             previewScale;   // preview size / frame size
+};
+
+
+
+// gray preview of a frame, so that two of them fit the screen width
+static Mat makePreview (const Mat& frame, int screenWidth, float& scale)
+{
+    Mat gray;
+    cvtColor(frame, gray, CV_RGB2GRAY);
+    scale = float(screenWidth) / gray.cols / 2;
+    resize(gray, gray, Size(), scale, scale);
+    return gray;
+}
+
+
+//
+// Features of frames waiting for their pairs.
+//   When they take more memory than the budget, features of some frames are spilled
+//   to disk, and read back every time they are needed.
+//   Frames whose last use is furthest in the future go first.
+//
+class FeatureCache {
+    struct Entry {
+        std::shared_ptr<const FrameFeatures>  features;   // empty when spilled
+        size_t                                bytes;
+        float                                 previewScale;
+        int                                   lastUse;
+    };
+    
+    map<int, Entry>   _entries;
+    const size_t      _budget;         // 0 for unlimited
+    size_t            _inMemory;
+    path              _spillDir;       // created at the first spill
+    const int         _verbose;
+    const evg::DescriptorCodec*  _codec;   // of descriptors, or null
+    
+    static size_t     numBytes (const FrameFeatures& features);
+    path              spillPath (int frameId, const string& what) const;
+    void              spill (int frameId, Entry& entry);
+    void              removeSpilled (int frameId);
+    
+    FeatureCache (const FeatureCache&);
+    FeatureCache& operator= (const FeatureCache&);
+public:
+    FeatureCache (size_t budgetBytes, int verbose = 0, const evg::DescriptorCodec* codec = 0);
+    ~FeatureCache();
+    
+    void                                  insert (std::shared_ptr<const FrameFeatures> features,
+                                                  int lastUse);
+    std::shared_ptr<const FrameFeatures>  get (int frameId) const;
+    void                                  erase (int frameId);
+    vector<int>                           frameIds() const;
+};
+
+
+FeatureCache::FeatureCache (size_t budgetBytes, int verbose, const evg::DescriptorCodec* codec)
+  : _budget (budgetBytes),
+    _inMemory (0),
+    _verbose (verbose),
+    _codec (codec) { }
+
+
+FeatureCache::~FeatureCache()
+{
+    if (_spillDir.empty()) return;
+    boost::system::error_code error;
+    remove_all (_spillDir, error);
+}
+
+
+size_t FeatureCache::numBytes (const FrameFeatures& features)
+{
+    return features.keypoints.size() * sizeof(KeyPoint)
+         + features.descriptors.total() * features.descriptors.elemSize()
+         + features.preview.total() * features.preview.elemSize();
 }
 
 
-static cv::DescriptorExtractor* newDescriptorExtractor (const string& featureType)
+path FeatureCache::spillPath (int frameId, const string& what) const
 {
-    // DescriptorExtractor* extractor (NULL);
-    // if (featureType == "sift")
-    //     extractor = new SIFT();
-    // else if (featureType == "surf")
-    //     extractor = new SURF();
-    // else if (featureType == "orb")
-    //     extractor = new ORB();
-    // else if (featureType == "brisk")
-    //     extractor = new BRISK();
-    // else assert(0);
-    // return extractor;
-    return new SIFT();
+    ostringstream name;
+    name << "frame-" << frameId << "-" << what << ".bin";
+    return _spillDir / name.str();
 }
 
 
-static cv::DescriptorMatcher* newMatcher (const std::string& featureType, int verbose = 0)
+void FeatureCache::spill (int frameId, Entry& entry)
 {
-    cv::DescriptorMatcher* matcher;
-    if      (featureType == "sift" || featureType == "surf")
+    if (_spillDir.empty())
     {
-        if (verbose) cout << "using FlannBasedMatcher on sift or surf" << endl;
-        matcher = new FlannBasedMatcher();
+        _spillDir = temp_directory_path() / unique_path ("aff_match_video-%%%%-%%%%");
+        create_directories (_spillDir);
     }
-    //else if (featureType == "orb" || featureType == "brisk")
-    //{
-    //    if (verbose) cout << "using BFMatcher(NORM_HAMMING) on orb, or brisk" << endl;
-    //    matcher = new BFMatcher (NORM_HAMMING);
-    //}
-    else if (featureType == "orb" || featureType == "brisk")
+    
+    const FrameFeatures& features = *entry.features;
+    // descriptors are codes already, the codec goes to the header
+    if (!evg::writeAffFeatures (spillPath(frameId, "features").string(),
+                                features.keypoints, features.descriptors, 0, 0, _codec, true))
+        throw runtime_error("FeatureCache: cannot spill features to disk");
+    if (!features.preview.empty())
+        evg::saveMat (spillPath(frameId, "preview").string(), features.preview);
+    
+    _inMemory -= entry.bytes;
+    entry.features.reset();
+    if (_verbose > 1)
+        cout << "spilled features of frame " << frameId << " to disk" << endl;
+}
+
+
+void FeatureCache::removeSpilled (int frameId)
+{
+    boost::system::error_code error;
+    remove (spillPath(frameId, "features"), error);
+    remove (spillPath(frameId, "preview"), error);
+}
+
+
+void FeatureCache::insert (std::shared_ptr<const FrameFeatures> features, int lastUse)
+{
+    assert (features);
+    Entry& entry = _entries[features->frameId];
+    entry.features = features;
+    entry.bytes = numBytes (*features);
+    entry.previewScale = features->previewScale;
+    entry.lastUse = lastUse;
+    _inMemory += entry.bytes;
+    if (!_budget || _inMemory <= _budget) return;
+    
+    // the newest frame always stays, it is about to be matched
+    vector<pair<int, int> > candidates;  // (lastUse, frameId)
+    for (auto it : _entries)
+        if (it.first != features->frameId && it.second.features &&
+            !it.second.features->keypoints.empty() && !it.second.features->descriptors.empty())
+            candidates.push_back (make_pair (it.second.lastUse, it.first));
+    sort (candidates.rbegin(), candidates.rend());
+    
+    for (int i = 0; i != candidates.size() && _inMemory > _budget; ++i)
+        spill (candidates[i].second, _entries.at(candidates[i].second));
+}
+
+
+std::shared_ptr<const FrameFeatures> FeatureCache::get (int frameId) const
+{
+    const Entry& entry = _entries.at(frameId);
+    if (entry.features) return entry.features;
+    
+    // read back, but keep on disk, the frame may be needed again
+    std::shared_ptr<FrameFeatures> features (new FrameFeatures);
+    features->frameId = frameId;
+    features->previewScale = entry.previewScale;
+    evg::DescriptorCodec codec;
+    if (!evg::readAffFeatures (spillPath(frameId, "features").string(),
+                               features->keypoints, features->descriptors, codec))
+        throw runtime_error("FeatureCache: cannot read spilled features");
+    if (exists (spillPath(frameId, "preview")))
+        features->preview = evg::readMat (spillPath(frameId, "preview").string());
+    return features;
+}
+
+
+void FeatureCache::erase (int frameId)
+{
+    auto it = _entries.find (frameId);
+    if (it == _entries.end()) return;
+    if (it->second.features)
+        _inMemory -= it->second.bytes;
+    else
+        removeSpilled (frameId);
+    _entries.erase (it);
+}
+
+
+vector<int> FeatureCache::frameIds() const
+{
+    vector<int> ids;
+    for (auto it : _entries)
+        ids.push_back (it.first);
+    return ids;
+}
+
+
+//
+// Schedule of matching, made upfront from frame pairs.
+//   When frame im2 is decoded, it is matched with every frame in partners[im2].
+//   After that, frames in releases[im2] are not needed anymore.
+//   Only pairs with im1 <= im2 are matched, other pairs never meet in decoding order.
+//
+struct FrameSchedule {
+    map<int, vector<int> >  partners;   // im2 -> frames im1 <= im2, in increasing order
+    map<int, vector<int> >  releases;   // frame -> frames used for the last time at it
+    map<int, int>           lastUse;    // frame -> the frame it is used for the last time at
+    
+    bool isNeeded (int frameId) const { return lastUse.count(frameId) != 0; }
+};
+
+
+static FrameSchedule makeSchedule (const map<int, set<int> >& framePairs)
+{
+    FrameSchedule schedule;
+    
+    // pairs come sorted by im1, so partners of every frame are sorted too
+    for (auto it : framePairs)
     {
-        if (verbose) cout << "using FlannBasedMatcher(LshIndexParams) on orb or brisk" << endl;
-        matcher = new FlannBasedMatcher(new flann::LshIndexParams(8, 15, 2));
+        int im1 = it.first;
+        for (int im2 : it.second)
+        {
+            if (im1 > im2) continue;
+            schedule.partners[im2].push_back (im1);
+            
+            // a frame is used when it is decoded and when its later partners are
+            auto used1 = schedule.lastUse.insert (make_pair (im1, im2));
+            used1.first->second = std::max (used1.first->second, im2);
+            schedule.lastUse.insert (make_pair (im2, im2));
+        }
     }
-    else
-        assert (0);
-    return matcher;
+    
+    for (auto it : schedule.lastUse)
+        schedule.releases[it.second].push_back (it.first);
+    return schedule;
+}
+
+
+// display matches and return false if user pressed Esc
+static bool showMatches (const FrameFeatures& features1, const FrameFeatures& features2,
+                         const vector<DMatch>& matches)
+{
+    vector<KeyPoint> keypoints1im = features1.keypoints, keypoints2im = features2.keypoints;
+    for (int i = 0; i != keypoints1im.size(); ++i)
+    {
+        keypoints1im[i].pt.x = keypoints1im[i].pt.x * features1.previewScale;
+        keypoints1im[i].pt.y = keypoints1im[i].pt.y * features1.previewScale;
+    }
+    for (int i = 0; i != keypoints2im.size(); ++i)
+    {
+        keypoints2im[i].pt.x = keypoints2im[i].pt.x * features2.previewScale;
+        keypoints2im[i].pt.y = keypoints2im[i].pt.y * features2.previewScale;
+    }
+    
+    Mat imgMatches;
+    drawMatches (features1.preview, keypoints1im, features2.preview, keypoints2im, matches, imgMatches,
+                 Scalar::all(-1), Scalar::all(-1),
+                 vector<char>(), DrawMatchesFlags::NOT_DRAW_SINGLE_POINTS );
+    imshow( "matches", imgMatches );
+    return waitKey(0) != 27;
 }
 
 
+
+//
+// Reads only the frames that are needed, in increasing order.
+//   Frames in between are grabbed, but not decoded into pixels.
+//   When the next frame is at least 'seekGap' frames ahead, the video seeks instead.
+//   Seeking is exact only for some containers and codecs, so it is off by default.
+//
+class SparseFrameReader {
+    VideoCapture&  _video;
+    int            _position;   // index of the next frame in the video
+    const int      _seekGap;    // 0 to never seek
+public:
+    SparseFrameReader (VideoCapture& video, int seekGap = 0)
+      : _video(video), _position(0), _seekGap(seekGap) { }
+    
+    bool read (int frameId, Mat& frame)
+    {
+        // frames are read only forward
+        if (frameId < _position)
+        {
+            cerr << "SparseFrameReader: frame " << frameId << " is before the current frame "
+                 << _position << endl;
+            return false;
+        }
+        if (_seekGap > 0 && frameId - _position >= _seekGap &&
+            _video.set (CV_CAP_PROP_POS_FRAMES, frameId))
+        {
+            int position = int(_video.get (CV_CAP_PROP_POS_FRAMES));
+            if (position > frameId)
+            {
+                cerr << "SparseFrameReader: seeking to frame " << frameId
+                     << " ended at frame " << position << endl;
+                return false;
+            }
+            _position = position;
+        }
+        
+        for (; _position < frameId; ++_position)
+            if (!_video.grab()) return false;
+        
+        if (!_video.read (frame)) return false;
+        ++_position;
+        return true;
+    }
+};
+
+
+// codec is trained on descriptors of one frame
+static bool trainCodec (const string& videoName, int frameId, const string& featureType,
+                        int maxFeatures, int maxTilt,
+                        evg::DescriptorCodec::Method method, int numComponents,
+                        evg::DescriptorCodec& codec)
+{
+    VideoCapture video = evg::openVideo (videoName);
+    SparseFrameReader reader (video);
+    Mat frame;
+    if (!reader.read (frameId, frame)) return false;
+    
+    Ptr<AffMatcherHelper> affMatcherHelper = newAffMatcherHelper (featureType, maxFeatures);
+    vector<KeyPoint> keypoints;
+    Mat descriptors;
+    affMatcherHelper->computeFeatures (frame, keypoints, descriptors, maxTilt);
+    if (descriptors.rows < numComponents) return false;
+    
+    codec.train (descriptors, method, numComponents);
+    return true;
+}
+
+
+
+//
+// Writes matches in its own thread, so that matching does not wait for the disk.
+//   Matches go either to a file per pair, or to one match archive for the whole run.
+//   Pairs are written in the order they are pushed.
+//
+class AsyncMatchWriter {
+    struct Job {
+        int                                   im1, im2;
+        std::shared_ptr<const FrameFeatures>  features1, features2;
+        vector<DMatch>                        matches;
+    };
+    
+    const path                _outDirPath;
+    const bool                _binFormat;
+    evg::MatchArchiveWriter   _archive;
+    evg::BoundedQueue<Job>    _queue;
+    std::thread               _thread;
+    
+    void run ();
+    
+    AsyncMatchWriter (const AsyncMatchWriter&);
+    AsyncMatchWriter& operator= (const AsyncMatchWriter&);
+public:
+    // empty archiveName for a file per pair
+    AsyncMatchWriter (const path& outDirPath, bool binFormat, const string& archiveName);
+    ~AsyncMatchWriter ();
+    
+    void push (std::shared_ptr<const FrameFeatures> features1,
+               std::shared_ptr<const FrameFeatures> features2,
+               vector<DMatch> matches);
+    
+    // write what is left, and close the archive
+    void finish ();
+};
+
+
+AsyncMatchWriter::AsyncMatchWriter (const path& outDirPath, bool binFormat, const string& archiveName)
+  : _outDirPath (outDirPath),
+    _binFormat (binFormat),
+    _queue (64)
+{
+    if (!archiveName.empty() && !_archive.open ((outDirPath / archiveName).string()))
+        throw runtime_error("AsyncMatchWriter: cannot open match archive " + archiveName);
+    _thread = std::thread (&AsyncMatchWriter::run, this);
+}
+
+
+AsyncMatchWriter::~AsyncMatchWriter ()
+{
+    finish();
+}
+
+
+void AsyncMatchWriter::push (std::shared_ptr<const FrameFeatures> features1,
+                             std::shared_ptr<const FrameFeatures> features2,
+                             vector<DMatch> matches)
+{
+    Job job;
+    job.im1 = features1->frameId;
+    job.im2 = features2->frameId;
+    job.features1 = features1;
+    job.features2 = features2;
+    job.matches.swap (matches);
+    _queue.push (std::move(job));
+}
+
+
+void AsyncMatchWriter::run ()
+{
+    Job job;
+    while (_queue.pop (job))
+    {
+        if (_archive.isOpen())
+        {
+            ostringstream im1str, im2str;
+            im1str << job.im1;
+            im2str << job.im2;
+            _archive.write (im1str.str(), im2str.str(), job.features1->keypoints,
+                            job.features2->keypoints, job.matches);
+        }
+        else
+            writePairMatches (_outDirPath, job.im1, job.im2, job.features1->keypoints,
+                              job.features2->keypoints, job.matches, _binFormat);
+        
+        // features may be the last references to frames
+        job = Job();
+    }
+}
+
+
+void AsyncMatchWriter::finish ()
+{
+    _queue.close();
+    if (_thread.joinable()) _thread.join();
+    _archive.close();
+}
+
+
+
+/// ============================  Pipelined matching  ============================
+//
+// Stages decode -> featurize -> match -> write are connected with bounded queues.
+//   Decoding and scheduling of pairs run in one thread each, featurizing and matching
+//   in 'numThreads' threads each, and writing in the main thread.
+//   Every frame is featurized once, so that I/O and decoding hide behind computation.
+//   Pairs are written in the same order as in the sequential loop.
+
+
+struct PipelineSettings {
+    string  featureType;
+    int     maxFeatures;
+    int     maxTilt;
+    float   threshold;
+    bool    crossViewNNDR;
+    bool    globalIndex;
+    bool    crossCheck;
+    bool    useOpenCL;
+    int     numThreads;
+    int     seekGap;
+    size_t  memoryBudget;
+    int     verbose;
+    const evg::DescriptorCodec*  codec;   // or null
+};
+
+struct DecodedFrame {
+    long  seq;          // order of decoding
+    int   frameId;
+    Mat   image;
+};
+
+struct FeaturizedFrame {
+    long                                   seq;
+    std::shared_ptr<const FrameFeatures>   features;
+};
+
+struct PairJob {
+    long                                   seq;   // order of output
+    std::shared_ptr<const FrameFeatures>   features1, features2;
+};
+
+struct PairResult {
+    long                                   seq;
+    std::shared_ptr<const FrameFeatures>   features1, features2;
+    vector<DMatch>                         matches;
+};
+
+
+static void decodeStage (VideoCapture& video, const FrameSchedule& schedule, int seekGap,
+                         evg::BoundedQueue<DecodedFrame>& out)
+{
+    SparseFrameReader reader (video, seekGap);
+    long seq = 0;
+    for (auto used : schedule.lastUse)
+    {
+        int frameId = used.first;
+        
+        // a new Mat every time, because the frame is passed to another thread
+        DecodedFrame item;
+        if (!reader.read (frameId, item.image))
+        {
+            cout << "finished before frame " << frameId << endl;
+            break;
+        }
+        
+        item.seq = seq++;
+        item.frameId = frameId;
+        if (!out.push (std::move(item))) break;
+    }
+    out.close();
+}
+
+
+static void featurizeStage (const PipelineSettings& settings,
+                            evg::BoundedQueue<DecodedFrame>& in,
+                            evg::BoundedQueue<FeaturizedFrame>& out,
+                            std::atomic<int>& numRunning)
+{
+    // every thread has its own detector and extractor
+    Ptr<AffMatcherHelper> affMatcherHelper = newAffMatcherHelper (settings.featureType,
+                                                                  settings.maxFeatures);
+    affMatcherHelper->setUseOpenCL (settings.useOpenCL);
+    
+    DecodedFrame frame;
+    while (in.pop (frame))
+    {
+        std::shared_ptr<FrameFeatures> features (new FrameFeatures);
+        features->frameId = frame.frameId;
+        features->previewScale = 1;
+        affMatcherHelper->computeFeatures (frame.image, features->keypoints, features->descriptors,
+                                           settings.maxTilt);
+        if (settings.codec)
+            settings.codec->encode (features->descriptors, features->descriptors);
+        frame.image.release();
+        
+        FeaturizedFrame item;
+        item.seq = frame.seq;
+        item.features = features;
+        out.push (item);
+    }
+    
+    // the last featurizer closes the queue
+    if (--numRunning == 0) out.close();
+}
+
+
+static void scheduleStage (const FrameSchedule& schedule, const PipelineSettings& settings,
+                           evg::BoundedQueue<FeaturizedFrame>& in,
+                           evg::BoundedQueue<PairJob>& out)
+{
+    map<long, std::shared_ptr<const FrameFeatures> > waiting;  // featurized out of order
+    FeatureCache frames (settings.memoryBudget, settings.verbose, settings.codec);  // waiting for pairs
+    long nextSeq = 0, jobSeq = 0;
+    
+    FeaturizedFrame item;
+    while (in.pop (item))
+    {
+        waiting[item.seq] = item.features;
+        
+        // frames are scheduled in the order of decoding, as in the sequential loop
+        while (waiting.count (nextSeq))
+        {
+            std::shared_ptr<const FrameFeatures> features2 = waiting[nextSeq];
+            waiting.erase (nextSeq++);
+            
+            int im2 = features2->frameId;
+            frames.insert (features2, schedule.lastUse.at(im2));
+            
+            if (schedule.partners.count(im2))
+                for (int im1 : schedule.partners.at(im2))
+                {
+                    PairJob job;
+                    job.seq = jobSeq++;
+                    job.features1 = frames.get(im1);
+                    job.features2 = features2;
+                    out.push (job);
+                }
+            
+            // features stay alive in the jobs that use them
+            if (schedule.releases.count(im2))
+                for (int im1 : schedule.releases.at(im2))
+                    frames.erase(im1);
+        }
+    }
+    out.close();
+}
+
+
+static void matchStage (const PipelineSettings& settings,
+                        evg::BoundedQueue<PairJob>& in,
+                        evg::BoundedQueue<PairResult>& out,
+                        std::atomic<int>& numRunning)
+{
+    // every thread has its own matcher
+    Ptr<AffMatcherHelper> affMatcherHelper = newAffMatcherHelper (settings.featureType,
+                                                                  settings.maxFeatures,
+                                                                  settings.globalIndex,
+                                                                  settings.verbose,
+                                                                  settings.codec);
+    affMatcherHelper->setVerbosity (settings.verbose);
+    affMatcherHelper->setCrossViewRatio (settings.crossViewNNDR);
+    affMatcherHelper->setCrossCheck (settings.crossCheck);
+    
+    PairJob job;
+    while (in.pop (job))
+    {
+        PairResult result;
+        result.seq = job.seq;
+        result.features1 = job.features1;
+        result.features2 = job.features2;
+        affMatcherHelper->matchFeatures (job.features1->keypoints, job.features2->keypoints,
+                                         job.features1->descriptors, job.features2->descriptors,
+                                         result.matches, settings.threshold);
+        out.push (std::move(result));
+    }
+    
+    // the last matcher closes the queue
+    if (--numRunning == 0) out.close();
+}
+
+
+static void matchPipelined (VideoCapture& video, const FrameSchedule& schedule,
+                            const PipelineSettings& settings,
+                            AsyncMatchWriter* writer)
+{
+    const int numThreads = std::max (1, settings.numThreads);
+    evg::BoundedQueue<DecodedFrame>     decoded (numThreads);
+    evg::BoundedQueue<FeaturizedFrame>  featurized (2 * numThreads);
+    evg::BoundedQueue<PairJob>          jobs (2 * numThreads);
+    evg::BoundedQueue<PairResult>       results (2 * numThreads);
+    std::atomic<int>                    numFeaturizers (numThreads), numMatchers (numThreads);
+    
+    vector<std::thread> threads;
+    threads.push_back (std::thread (decodeStage, std::ref(video), std::cref(schedule),
+                                    settings.seekGap, std::ref(decoded)));
+    for (int i = 0; i != numThreads; ++i)
+        threads.push_back (std::thread (featurizeStage, std::cref(settings), std::ref(decoded),
+                                        std::ref(featurized), std::ref(numFeaturizers)));
+    threads.push_back (std::thread (scheduleStage, std::cref(schedule), std::cref(settings),
+                                    std::ref(featurized), std::ref(jobs)));
+    for (int i = 0; i != numThreads; ++i)
+        threads.push_back (std::thread (matchStage, std::cref(settings), std::ref(jobs),
+                                        std::ref(results), std::ref(numMatchers)));
+    
+    // write stage restores the order of pairs
+    map<long, PairResult> waiting;
+    long nextSeq = 0;
+    PairResult result;
+    while (results.pop (result))
+    {
+        waiting[result.seq] = std::move(result);
+        while (waiting.count (nextSeq))
+        {
+            const PairResult& ready = waiting[nextSeq];
+            int im1 = ready.features1->frameId, im2 = ready.features2->frameId;
+            if (settings.verbose > 0)
+                cout << "frame pair: " << im1 << " " << im2 << endl;
+            if (writer)
+                writer->push (ready.features1, ready.features2, ready.matches);
+            waiting.erase (nextSeq++);
+        }
+    }
+    
+    for (unsigned int i = 0; i != threads.size(); ++i)
+        threads[i].join();
+}
+
+
+
 int main(int argc, const char * argv[])
 {
     CmdLine cmd ("match video frames between themselves, frames match are given in a file");
     
-    vector<string> featureTypes;
-    featureTypes.push_back("sift");
-    featureTypes.push_back("surf");
-    featureTypes.push_back("orb");
-    featureTypes.push_back("brisk");
+    vector<string> featureTypes = affma::getFeatureBackendNames();
     ValuesConstraint<string> cmdFeatureTypes( featureTypes );
     ValueArg<string> cmdFeature("f", "feature", "feature type", true, "", &cmdFeatureTypes, cmd);
 
+    ValueArg<int>    cmdMaxFeatures ("", "max_features", "max number of keypoints per view for sift "
+                                     "and orb, 0 for the default", false, 0, "int", cmd);
     ValueArg<int>    cmdTilt ("", "max_tilt", "if not set, incremental match", false, -1, "int", cmd);
     ValueArg<float>  cmdThresh ("t", "threshold", "threshold for matcher", false, -1, "float", cmd);
     ValueArg<string> cmdInVideo ("i", "input", "input video", true, "", "string", cmd);
@@ -107,11 +759,49 @@ int main(int argc, const char * argv[])
     ValueArg<string> cmdOutDirName ("o", "output", "output dir. for matches", false, "/dev/null", "string", cmd);
     ValueArg<string> cmdTimeFile ("", "time_name", "write a file with times", false, "", "string", cmd);
     SwitchArg        cmdDisableImshow ("", "disable_image", "don't show image", cmd);
+    SwitchArg        cmdGlobalIndex ("", "global_index", "match descriptors of all views at once "
+                                     "in one FLANN index, instead of view pair by view pair", cmd);
+    SwitchArg        cmdOpenCL ("", "opencl", "warp views and detect on UMat, through OpenCL "
+                                "when a device or CPU runtime is available", cmd);
+    SwitchArg        cmdCrossCheck ("", "cross_check", "keep only matches that are nearest "
+                                    "neighbours both ways", cmd);
+    SwitchArg        cmdCrossViewNNDR ("", "cross_view_nndr", "ratio test against the 2nd best match "
+                                       "in all views of the other image, not only in the same view", cmd);
     ValueArg<int>    cmdScreenWidth ("", "screenwidth", "for display", false, 1350, "int", cmd);
     MultiSwitchArg   cmdVerbose ("v", "", "level of verbosity of output", cmd);
+    SwitchArg        cmdPipeline ("", "pipeline", "decode, featurize and match frames in parallel "
+                                  "stages, needs --max_tilt", cmd);
+    ValueArg<int>    cmdNumThreads ("", "threads", "number of featurizing and of matching threads "
+                                    "with --pipeline", false, 2, "int", cmd);
+    ValueArg<string> cmdArchive ("", "archive", "write matches of all pairs into one indexed archive "
+                                 "with this name in the output dir, appends if it exists",
+                                 false, "", "string", cmd);
+    SwitchArg        cmdBinMatches ("", "bin_matches", "write matches in binary simple format, "
+                                    "as matches-<im1>-<im2>.bin", cmd);
+    ValueArg<int>    cmdSeekGap ("", "seek_gap", "seek instead of grabbing frames when the next "
+                                 "needed frame is that far ahead, 0 to never seek. "
+                                 "Seeking is not exact for some videos", false, 0, "int", cmd);
+    ValueArg<int>    cmdMemoryBudget ("", "memory_budget", "MB for features of frames waiting for "
+                                      "pairs, the rest goes to disk, 0 for unlimited. "
+                                      "Only with --max_tilt", false, 1024, "int", cmd);
+    vector<string> codecTypes;
+    codecTypes.push_back("none");
+    codecTypes.push_back("quant8");
+    codecTypes.push_back("pca");
+    codecTypes.push_back("pca_quant8");
+    ValuesConstraint<string> cmdCodecTypes( codecTypes );
+    ValueArg<string> cmdCodec ("", "codec", "keep descriptors compressed, to fit more frames "
+                               "in --memory_budget, codes are matched as they are. Only with --max_tilt "
+                               "and sift or surf, quantized codes not with --global_index",
+                               false, "none", &cmdCodecTypes, cmd);
+    ValueArg<int>    cmdCodecDim ("", "codec_dim", "number of PCA components", false, 64, "int", cmd);
+    ValueArg<string> cmdCodecFile ("", "codec_file", "load the codec from this file if it exists, "
+                                   "otherwise train on the first frame and save it there",
+                                   false, "", "string", cmd);
     
     cmd.parse(argc, argv);
     string           featureType    = cmdFeature.getValue();
+    int              maxFeatures    = cmdMaxFeatures.getValue();
     int              maxTilt        = cmdTilt.getValue();
     float            threshold      = cmdThresh.getValue();
     string           inVideoName    = cmdInVideo.getValue();
@@ -121,6 +811,36 @@ int main(int argc, const char * argv[])
     int              screenWidth    = cmdScreenWidth.getValue();
     bool             disableImshow  = cmdDisableImshow.getValue();
     int              verbose        = cmdVerbose.getValue();
+    bool             crossViewNNDR  = cmdCrossViewNNDR.getValue();
+    bool             globalIndex    = cmdGlobalIndex.getValue();
+    bool             crossCheck     = cmdCrossCheck.getValue();
+    bool             useOpenCL      = cmdOpenCL.getValue();
+    bool             pipeline       = cmdPipeline.getValue();
+    int              numThreads     = cmdNumThreads.getValue();
+    int              seekGap        = cmdSeekGap.getValue();
+    bool             binMatches     = cmdBinMatches.getValue();
+    string           archiveName    = cmdArchive.getValue();
+    size_t           memoryBudget   = size_t(std::max(0, cmdMemoryBudget.getValue())) << 20;
+    string           codecType      = cmdCodec.getValue();
+    int              codecDim       = cmdCodecDim.getValue();
+    string           codecFileName  = cmdCodecFile.getValue();
+    
+    if (pipeline && maxTilt < 0)
+    {
+        cerr << "--pipeline needs --max_tilt, incremental matching is not pipelined" << endl;
+        return -1;
+    }
+    if (codecType != "none" && (maxTilt < 0 || featureType == "orb" || featureType == "brisk"
+                                            || featureType == "akaze"))
+    {
+        cerr << "--codec needs --max_tilt and float descriptors of sift or surf" << endl;
+        return -1;
+    }
+    if (globalIndex && (codecType == "quant8" || codecType == "pca_quant8"))
+    {
+        cerr << "--global_index needs float descriptors, it does not work with quantized --codec" << endl;
+        return -1;
+    }
     
     // dir for output
     path outDirPath (outDirName);
@@ -167,114 +887,177 @@ int main(int argc, const char * argv[])
     map<int, set<int> > framePairs;
     for (int row = 0; row != pairsMat.rows; ++row)
     {
-        int im1 (pairsMat.at<float>(row,0));
-        int im2 (pairsMat.at<float>(row,1));
+        const float value1 = pairsMat.at<float>(row,0), value2 = pairsMat.at<float>(row,1);
+        int im1 (value1);
+        int im2 (value2);
+        if (im1 < 0 || im2 < 0 || im1 != value1 || im2 != value2)
+        {
+            cerr << "bad frame pair at line " << row + 1 << " of " << inPairsName << ": "
+                 << value1 << " " << value2 << ". Frame ids are non-negative integers" << endl;
+            return -1;
+        }
         framePairs[im1].insert(im2);
     }
+    const FrameSchedule schedule = makeSchedule (framePairs);
     
+    // codec for descriptors
+    evg::DescriptorCodec codec;
+    if (codecType != "none" && !codecFileName.empty() && exists(path(codecFileName)))
+    {
+        if (!codec.load (codecFileName)) return -1;
+        if (verbose) cout << "loaded descriptor codec from " << codecFileName << endl;
+    }
+    else if (codecType != "none" && !schedule.lastUse.empty())
+    {
+        evg::DescriptorCodec::Method method = (codecType == "quant8") ? evg::DescriptorCodec::Quantize8 :
+                                              (codecType == "pca")    ? evg::DescriptorCodec::Pca
+                                                                      : evg::DescriptorCodec::PcaQuantize8;
+        if (!trainCodec (inVideoName, schedule.lastUse.begin()->first, featureType, maxFeatures, maxTilt,
+                         method, codecDim, codec))
+        {
+            cerr << "cannot train the descriptor codec on the first frame" << endl;
+            return -1;
+        }
+        if (!codecFileName.empty() && !codec.save (codecFileName)) return -1;
+    }
+    const evg::DescriptorCodec* codecPtr = codec.empty() ? 0 : &codec;
     
-    Ptr<FeatureDetector> detector = newFeatureDetector (featureType);
-    Ptr<DescriptorExtractor> extractor = newDescriptorExtractor (featureType);
-    Ptr<DescriptorMatcher> matcher = newMatcher (featureType, verbose);
     
-    Ptr<AffMatcherHelper> affMatcherHelper = createAffMatcherHelper (detector, extractor, matcher);
+    // matches are written in a separate thread
+    std::unique_ptr<AsyncMatchWriter> writer;
+    if (outDirName != "/dev/null")
+        writer.reset (new AsyncMatchWriter (outDirPath, binMatches, archiveName));
+    
+    if (pipeline)
+    {
+        if (!disableImshow)
+            cout << "images are not shown with --pipeline" << endl;
+        
+        PipelineSettings settings;
+        settings.featureType = featureType;
+        settings.maxFeatures = maxFeatures;
+        settings.maxTilt     = maxTilt;
+        settings.threshold   = threshold;
+        settings.crossViewNNDR = crossViewNNDR;
+        settings.globalIndex = globalIndex;
+        settings.crossCheck  = crossCheck;
+        settings.useOpenCL   = useOpenCL;
+        settings.numThreads  = numThreads;
+        settings.seekGap     = seekGap;
+        settings.memoryBudget = memoryBudget;
+        settings.verbose     = verbose;
+        settings.codec       = codecPtr;
+        matchPipelined (video, schedule, settings, writer.get());
+        if (writer) writer->finish();
+        
+        ofsTime.close();
+        return 0;
+    }
+    
+    
+    Ptr<AffMatcherHelper> affMatcherHelper = newAffMatcherHelper (featureType, maxFeatures,
+                                                                  globalIndex, verbose, codecPtr);
     affMatcherHelper->setVerbosity(verbose);
+    affMatcherHelper->setCrossViewRatio (crossViewNNDR);
+    affMatcherHelper->setCrossCheck (crossCheck);
+    affMatcherHelper->setUseOpenCL (useOpenCL);
+    
+    // with --max_tilt every frame is featurized once and only features are kept,
+    //   incremental matching needs the pixels of frames
+    const bool keepFeatures = (maxTilt >= 0);
+    FeatureCache cache (memoryBudget, verbose, codecPtr);
     
     Mat frame;
     map<int, Mat> frames;
+    SparseFrameReader reader (video, seekGap);
     
-    for (int im2 = 0; ; ++im2)
+    // only the needed frames are decoded
+    for (auto used : schedule.lastUse)
     {
+        int im2 = used.first;
         if (verbose > 2)
             cout << "frame: " << im2 << endl;
         
-        video >> frame;
-        if (frame.empty())
+        if (!reader.read (im2, frame))
         {
-            cout << "finished at frame " << im2 << endl;
+            cout << "finished before frame " << im2 << endl;
             break;
         }
-        frames[im2] = frame.clone();
         
-        set<int> framesToRemove;
-        for (auto im1it : frames)
+        if (keepFeatures)
         {
-            int im1 = im1it.first;
-            if (framePairs.count(im1) && framePairs.at(im1).count(im2))
+            std::shared_ptr<FrameFeatures> features (new FrameFeatures);
+            features->frameId = im2;
+            features->previewScale = 1;
+            affMatcherHelper->computeFeatures (frame, features->keypoints, features->descriptors,
+                                               maxTilt);
+            if (codecPtr)
+                codecPtr->encode (features->descriptors, features->descriptors);
+            if (!disableImshow)
+                features->preview = makePreview (frame, screenWidth, features->previewScale);
+            cache.insert (features, schedule.lastUse.at(im2));
+        }
+        else
+            frames[im2] = frame.clone();
+        
+        if (schedule.partners.count(im2))
+            for (int im1 : schedule.partners.at(im2))
             {
                 if (verbose > 0)
                     cout << "frame pair: " << im1 << " " << im2 << endl;
 
-                vector<KeyPoint> keypoints1, keypoints2;
+                std::shared_ptr<const FrameFeatures> features1, features2;
                 vector<DMatch> matches;
                 
-                if (maxTilt >= 0)
-                    affMatcherHelper->matchWithMaxTilt (frames[im1], frames[im2],
-                                          keypoints1, keypoints2, matches, threshold, maxTilt);
+                if (keepFeatures)
+                {
+                    features1 = cache.get(im1);
+                    features2 = cache.get(im2);
+                    affMatcherHelper->matchFeatures (features1->keypoints, features2->keypoints,
+                                                     features1->descriptors, features2->descriptors,
+                                                     matches, threshold);
+                }
                 else
+                {
+                    std::shared_ptr<FrameFeatures> new1 (new FrameFeatures), new2 (new FrameFeatures);
+                    new1->frameId = im1;
+                    new2->frameId = im2;
                     affMatcherHelper->matchIncreasingTilt (frames[im1], frames[im2],
-                                          keypoints1, keypoints2, matches, threshold);
+                                          new1->keypoints, new2->keypoints, matches, threshold);
+                    if (!disableImshow)
+                    {
+                        new1->preview = makePreview (frames[im1], screenWidth, new1->previewScale);
+                        new2->preview = makePreview (frames[im2], screenWidth, new2->previewScale);
+                    }
+                    features1 = new1;
+                    features2 = new2;
+                }
 
                 //const float cutoff = 1.f;
                 //filterDuplicateMatches (keypoints1, keypoints2, matches, cutoff);
                 
                 if (!disableImshow)
-                {
-                    Mat im1gray, im2gray;
-                    cvtColor(frames[im1], im1gray, CV_RGB2GRAY);
-                    cvtColor(frames[im2], im2gray, CV_RGB2GRAY);
-                    float factor = float(screenWidth) / im1gray.cols / 2;
-                    vector<KeyPoint> keypoints1im = keypoints1, keypoints2im = keypoints2;
-                    for (int i = 0; i != keypoints1im.size(); ++i)
-                    {
-                        keypoints1im[i].pt.x = keypoints1im[i].pt.x * factor;
-                        keypoints1im[i].pt.y = keypoints1im[i].pt.y * factor;
-                    }
-                    for (int i = 0; i != keypoints2im.size(); ++i)
-                    {
-                        keypoints2im[i].pt.x = keypoints2im[i].pt.x * factor;
-                        keypoints2im[i].pt.y = keypoints2im[i].pt.y * factor;
-                    }
-                    
-                    resize(im1gray, im1gray, Size(), factor, factor);
-                    resize(im2gray, im2gray, Size(), factor, factor);
-                    Mat imgMatches;
-                    drawMatches (im1gray, keypoints1im, im2gray, keypoints2im, matches, imgMatches,
-                                 Scalar::all(-1), Scalar::all(-1),
-                                 vector<char>(), DrawMatchesFlags::NOT_DRAW_SINGLE_POINTS );
-                    imshow( "matches", imgMatches );
-                    if (waitKey(0) == 27) return 0;
-                }
+                    if (!showMatches (*features1, *features2, matches)) return 0;
 
 
                 // write results
-                if (outDirName != "/dev/null")
-                {
-                    ostringstream im1str, im2str;
-                    im1str << im1;
-                    im2str << im2;
-                    string outMatchesName = "matches-" + im1str.str() + "-" + im2str.str() + ".txt";
-                    path outMatchesPath = outDirPath / outMatchesName;
-                    evg::writeSimpleMatches (outMatchesPath.string(), im1str.str(), im2str.str(),
-                                             keypoints1, keypoints2, matches);
-                }
-                
-                // remove processed pair
-                assert (framePairs.at(im1).count(im2));
-                framePairs.at(im1).erase(im2);
-                if (framePairs.at(im1).empty())
-                    framesToRemove.insert(im1);
+                if (writer)
+                    writer->push (features1, features2, matches);
             }
-        }
         
-        for (int im1 : framesToRemove)
-        {
-            frames.erase(im1);
-            if (verbose > 1)
-                cout << "removed frame: " << im1 << endl;
-        }
+        // release frames at their last use
+        if (schedule.releases.count(im2))
+            for (int im1 : schedule.releases.at(im2))
+            {
+                frames.erase(im1);
+                cache.erase(im1);
+                if (verbose > 1)
+                    cout << "removed frame: " << im1 << endl;
+            }
 
     }
+    
+    if (writer) writer->finish();
     ofsTime.close();
     
     return 0;
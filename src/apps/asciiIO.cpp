@@ -0,0 +1,448 @@
+#include <fstream>
+#include <stdexcept>
+#include <limits>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+#include "asciiIO.h"
+
+namespace cv {
+namespace evg {
+
+using namespace std;
+
+
+namespace {
+
+inline bool isDigit (char c)  { return c >= '0' && c <= '9'; }
+inline bool isSpace (char c)  { return c == ' ' || c == '\t' || c == '\r'; }
+inline char toLower (char c)  { return (c >= 'A' && c <= 'Z') ? char(c - 'A' + 'a') : c; }
+
+// case-insensitive comparison of [p, end) with a lowercase word
+bool startsWith (const char* p, const char* end, const char* word)
+{
+    for (; *word; ++p, ++word)
+        if (p == end || toLower(*p) != *word) return false;
+    return true;
+}
+
+// powers of ten that are exact in double
+const double ExactPowersOf10[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                   1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                   1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+const int MaxExactPowerOf10 = 22;
+
+} // namespace
+
+
+const char* parseNumber (const char* p, const char* end, double& value)
+{
+    bool negative = false;
+    if (p != end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+
+    // nan and inf, as written by iostreams and printf
+    if (p != end && !isDigit(*p) && *p != '.')
+    {
+        if (startsWith (p, end, "nan"))
+        {
+            value = numeric_limits<double>::quiet_NaN();
+            return p + 3;
+        }
+        if (startsWith (p, end, "inf"))
+        {
+            value = negative ? -numeric_limits<double>::infinity() : numeric_limits<double>::infinity();
+            return p + (startsWith (p, end, "infinity") ? 8 : 3);
+        }
+        return 0;
+    }
+
+    // up to 19 significant digits go to the mantissa, the rest only shift the exponent
+    uint64_t mantissa = 0;
+    int numSignificant = 0, exponent = 0;
+    bool anyDigit = false;
+    for (; p != end && isDigit(*p); ++p)
+    {
+        anyDigit = true;
+        if (numSignificant < 19)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa) ++numSignificant;
+        }
+        else
+            ++exponent;
+    }
+    if (p != end && *p == '.')
+    {
+        for (++p; p != end && isDigit(*p); ++p)
+        {
+            anyDigit = true;
+            if (numSignificant < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa) ++numSignificant;
+                --exponent;
+            }
+        }
+    }
+    if (!anyDigit) return 0;
+
+    // exponent is taken only if it has digits, as strtod does
+    if (p != end && (*p == 'e' || *p == 'E'))
+    {
+        const char* q = p + 1;
+        bool negativeExp = false;
+        if (q != end && (*q == '-' || *q == '+'))
+            negativeExp = (*q++ == '-');
+        if (q != end && isDigit(*q))
+        {
+            int exp = 0;
+            for (; q != end && isDigit(*q); ++q)
+                if (exp < 100000) exp = exp * 10 + (*q - '0');
+            exponent += negativeExp ? -exp : exp;
+            p = q;
+        }
+    }
+
+    // exact when both the mantissa and the power of ten are exact in double
+    double result = double(mantissa);
+    if (mantissa == 0)
+        result = 0;
+    else if (mantissa < (uint64_t(1) << 53) && exponent >= -MaxExactPowerOf10 && exponent <= MaxExactPowerOf10)
+        result = exponent < 0 ? result / ExactPowersOf10[-exponent] : result * ExactPowersOf10[exponent];
+    else
+        result = result * pow(10.0, exponent);
+
+    value = negative ? -result : result;
+    return p;
+}
+
+
+const char* parseNumber (const char* p, const char* end, long& value)
+{
+    bool negative = false;
+    if (p != end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+    if (p == end || !isDigit(*p)) return 0;
+
+    // a number that does not fit into long is not a number
+    long result = 0;
+    for (; p != end && isDigit(*p); ++p)
+    {
+        const int digit = *p - '0';
+        if (result > (LONG_MAX - digit) / 10) return 0;
+        result = result * 10 + digit;
+    }
+    value = negative ? -result : result;
+    return p;
+}
+
+
+
+AsciiReader::AsciiReader (const std::string& filepath)
+{
+    std::ifstream ifs (filepath.c_str(), ios::binary);
+    if (!ifs) throw runtime_error("evg::AsciiReader: cannot open file " + filepath);
+    ifs.seekg (0, ios::end);
+    const streamoff size = ifs.tellg();
+    ifs.seekg (0, ios::beg);
+    if (size < 0) throw runtime_error("evg::AsciiReader: cannot get size of file " + filepath);
+
+    _buffer.resize (size_t(size) + 1);
+    if (size > 0) ifs.read (&_buffer[0], size);
+    if (!ifs) throw runtime_error("evg::AsciiReader: cannot read file " + filepath);
+    _buffer.back() = '\0';
+
+    _pos = &_buffer[0];
+    _end = _pos + size;
+}
+
+
+void AsciiReader::skipBlank (bool crossLines)
+{
+    while (_pos != _end && (isSpace(*_pos) || (crossLines && *_pos == '\n')))
+        ++_pos;
+}
+
+
+bool AsciiReader::atEnd ()
+{
+    const char* p = _pos;
+    while (p != _end && (isSpace(*p) || *p == '\n')) ++p;
+    return p == _end;
+}
+
+
+bool AsciiReader::atLineEnd ()
+{
+    skipBlank (false);
+    return _pos == _end || *_pos == '\n';
+}
+
+
+bool AsciiReader::atEmptyLine () const
+{
+    const char* p = _pos;
+    if (p != _end && *p == '\r') ++p;
+    return p != _end && *p == '\n';
+}
+
+
+bool AsciiReader::nextLine ()
+{
+    while (_pos != _end && *_pos != '\n') ++_pos;
+    if (_pos == _end) return false;
+    ++_pos;
+    return _pos != _end;
+}
+
+
+bool AsciiReader::readLine (std::string& line)
+{
+    if (_pos == _end) return false;
+    const char* lineEnd = _pos;
+    while (lineEnd != _end && *lineEnd != '\n') ++lineEnd;
+    const char* contentEnd = lineEnd;
+    if (contentEnd != _pos && *(contentEnd - 1) == '\r') --contentEnd;
+    line.assign (_pos, contentEnd);
+    _pos = (lineEnd == _end) ? _end : lineEnd + 1;
+    return true;
+}
+
+
+bool AsciiReader::read (double& value, bool crossLines)
+{
+    skipBlank (crossLines);
+    const char* next = parseNumber (_pos, _end, value);
+    if (!next) return false;
+    _pos = next;
+    return true;
+}
+
+
+bool AsciiReader::read (float& value, bool crossLines)
+{
+    double number;
+    if (!read (number, crossLines)) return false;
+    value = float(number);
+    return true;
+}
+
+
+bool AsciiReader::read (int& value, bool crossLines)
+{
+    skipBlank (crossLines);
+    long number;
+    const char* next = parseNumber (_pos, _end, number);
+    if (!next || number > numeric_limits<int>::max() || number < numeric_limits<int>::min())
+        return false;
+    _pos = next;
+    value = int(number);
+    return true;
+}
+
+
+bool AsciiReader::read (unsigned int& value, bool crossLines)
+{
+    skipBlank (crossLines);
+    long number;
+    const char* next = parseNumber (_pos, _end, number);
+    if (!next || number < 0 || number > long(numeric_limits<unsigned int>::max()))
+        return false;
+    _pos = next;
+    value = (unsigned int)number;
+    return true;
+}
+
+
+char* formatNumber (char* dst, long long value)
+{
+    unsigned long long magnitude = value < 0 ? 0ull - (unsigned long long)value : (unsigned long long)value;
+    if (value < 0) *dst++ = '-';
+    
+    char digits[24];
+    int numDigits = 0;
+    do {
+        digits[numDigits++] = char('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    while (numDigits) *dst++ = digits[--numDigits];
+    return dst;
+}
+
+
+char* formatNumber (char* dst, double value)
+{
+    const int Precision = 6;
+    
+    if (value != value)
+    {
+        memcpy (dst, "nan", 3);
+        return dst + 3;
+    }
+    if (signbit(value)) *dst++ = '-';
+    value = fabs(value);
+    if (value == numeric_limits<double>::infinity())
+    {
+        memcpy (dst, "inf", 3);
+        return dst + 3;
+    }
+    if (value == 0)
+    {
+        *dst++ = '0';
+        return dst;
+    }
+    
+    // 6 significant digits as an integer, rounded half to even like printf
+    int exponent = int(floor(log10(value)));
+    double digits = 0;
+    for (int attempt = 0; attempt != 2; ++attempt)
+    {
+        const int shift = Precision - 1 - exponent;
+        if (shift >= 0)
+            digits = shift <= MaxExactPowerOf10 ? value * ExactPowersOf10[shift]
+                   : shift <= 300 ? value * pow(10.0, shift) : value * 1e300 * pow(10.0, shift - 300);
+        else
+            digits = -shift <= MaxExactPowerOf10 ? value / ExactPowersOf10[-shift] : value / pow(10.0, -shift);
+        digits = nearbyint(digits);
+        
+        // log10 may be off by one near powers of ten, and rounding may carry to a new digit
+        if (digits >= 1e6)       ++exponent;
+        else if (digits < 1e5)   --exponent;
+        else break;
+    }
+    if (digits >= 1e6) digits = 1e5;   // the carry case 999999.5 -> 1000000
+    
+    char text[Precision];
+    long long mantissa = (long long)digits;
+    for (int i = Precision - 1; i >= 0; --i, mantissa /= 10)
+        text[i] = char('0' + mantissa % 10);
+    int numDigits = Precision;
+    while (numDigits > 1 && text[numDigits - 1] == '0') --numDigits;
+    
+    if (exponent < -4 || exponent >= Precision)
+    {
+        // scientific: d.ddddde+XX
+        *dst++ = text[0];
+        if (numDigits > 1)
+        {
+            *dst++ = '.';
+            memcpy (dst, text + 1, numDigits - 1);
+            dst += numDigits - 1;
+        }
+        *dst++ = 'e';
+        *dst++ = exponent < 0 ? '-' : '+';
+        int absExponent = abs(exponent);
+        if (absExponent < 10) *dst++ = '0';
+        dst = formatNumber (dst, (long long)absExponent);
+    }
+    else if (exponent >= 0)
+    {
+        // integer part, then the fraction if any
+        for (int i = 0; i <= exponent; ++i)
+            *dst++ = i < numDigits ? text[i] : '0';
+        if (numDigits > exponent + 1)
+        {
+            *dst++ = '.';
+            memcpy (dst, text + exponent + 1, numDigits - exponent - 1);
+            dst += numDigits - exponent - 1;
+        }
+    }
+    else
+    {
+        // 0.000ddd
+        *dst++ = '0';
+        *dst++ = '.';
+        for (int i = 0; i != -exponent - 1; ++i)
+            *dst++ = '0';
+        memcpy (dst, text, numDigits);
+        dst += numDigits;
+    }
+    return dst;
+}
+
+
+
+AsciiWriter::AsciiWriter (const std::string& filepath, size_t bufferSize)
+  : _ofs (filepath.c_str(), ios::binary),
+    _buffer (std::max (bufferSize, size_t(MaxNumberLength))),
+    _size (0)
+{
+    if (!_ofs) throw runtime_error("evg::AsciiWriter: cannot open file for writing: " + filepath);
+}
+
+
+AsciiWriter::~AsciiWriter ()
+{
+    if (_ofs.is_open()) flush();
+}
+
+
+void AsciiWriter::flush ()
+{
+    if (_size) _ofs.write (&_buffer[0], _size);
+    _size = 0;
+}
+
+
+AsciiWriter& AsciiWriter::operator<< (const std::string& str)
+{
+    if (str.size() > _buffer.size())
+    {
+        flush();
+        _ofs.write (str.data(), str.size());
+        return *this;
+    }
+    reserve (str.size());
+    memcpy (&_buffer[_size], str.data(), str.size());
+    _size += str.size();
+    return *this;
+}
+
+
+AsciiWriter& AsciiWriter::operator<< (const char* str)
+{
+    return *this << std::string(str);
+}
+
+
+AsciiWriter& AsciiWriter::operator<< (char c)
+{
+    reserve (1);
+    _buffer[_size++] = c;
+    return *this;
+}
+
+
+AsciiWriter& AsciiWriter::operator<< (long long value)
+{
+    reserve (MaxNumberLength);
+    _size = formatNumber (&_buffer[_size], value) - &_buffer[0];
+    return *this;
+}
+
+
+AsciiWriter& AsciiWriter::operator<< (double value)
+{
+    reserve (MaxNumberLength);
+    _size = formatNumber (&_buffer[_size], value) - &_buffer[0];
+    return *this;
+}
+
+
+void AsciiWriter::close ()
+{
+    flush();
+    _ofs.close();
+    if (!_ofs) throw runtime_error("evg::AsciiWriter: failed writing the file");
+}
+
+
+
+
+} // namespace evg
+} // namespace cv
@@ -0,0 +1,114 @@
+#ifndef EVG_ASCII_IO
+#define EVG_ASCII_IO
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+//
+// Fast reading and writing of text files with numbers, shared by featuresIO and mediaIO.
+//
+// Rationale: parsing line by line with getline and istringstream is the slowest part
+//   of loading big feature and match dumps. Here a file is read with one read,
+//   and numbers are parsed in place. Writing is buffered the same way.
+//
+// Notes:
+//   numbers are parsed without iostreams and independently of locale, '.' is the decimal point
+//   values are separated by spaces and tabs, lines end with '\n', '\r' before it is skipped
+//   error policy: the constructor throws std::runtime_error, read functions return false
+//
+
+namespace cv {
+namespace evg {
+
+
+class AsciiReader {
+    std::vector<char>  _buffer;     // file contents and a terminating '\0'
+    const char*        _pos;
+    const char*        _end;
+
+    void  skipBlank (bool crossLines);
+
+    AsciiReader (const AsciiReader&);
+    AsciiReader& operator= (const AsciiReader&);
+public:
+    explicit AsciiReader (const std::string& filepath);
+
+    // true when only whitespace is left in the file
+    bool  atEnd ();
+
+    // true when only spaces are left in the current line
+    bool  atLineEnd ();
+
+    // true when the current line has no characters at all
+    bool  atEmptyLine () const;
+
+    // move to the beginning of the next line, false if there is none
+    bool  nextLine ();
+
+    // rest of the current line without '\r\n', moves to the next line
+    bool  readLine (std::string& line);
+
+    // parse the next number in the current line, or also in the next lines if crossLines
+    //   On failure only the blanks before it are skipped
+    bool  read (double& value, bool crossLines = false);
+    bool  read (float& value, bool crossLines = false);
+    bool  read (int& value, bool crossLines = false);
+    bool  read (unsigned int& value, bool crossLines = false);
+};
+
+
+// parse a number from [begin, end), returns the end of the number or 0 if there is none,
+//   or if an integer does not fit into long
+const char* parseNumber (const char* begin, const char* end, double& value);
+const char* parseNumber (const char* begin, const char* end, long& value);
+
+
+//
+// Buffered writing of text files with numbers.
+//   Text is formatted into a buffer and written in big chunks.
+//   Floats are written as by iostreams with default settings (like "%g"), but independently
+//   of locale and without iostreams formatting.
+//   close() throws std::runtime_error on failure, the destructor only flushes.
+//
+
+class AsciiWriter {
+    std::ofstream      _ofs;
+    std::vector<char>  _buffer;
+    size_t             _size;
+    
+    void  reserve (size_t n)  { if (_size + n > _buffer.size()) flush(); }
+    void  flush ();
+    
+    AsciiWriter (const AsciiWriter&);
+    AsciiWriter& operator= (const AsciiWriter&);
+public:
+    explicit AsciiWriter (const std::string& filepath, size_t bufferSize = 1 << 16);
+    ~AsciiWriter ();
+    
+    AsciiWriter&  operator<< (const std::string& str);
+    AsciiWriter&  operator<< (const char* str);
+    AsciiWriter&  operator<< (char c);
+    AsciiWriter&  operator<< (int value)                 { return *this << (long long)(value); }
+    AsciiWriter&  operator<< (unsigned int value)        { return *this << (long long)(value); }
+    AsciiWriter&  operator<< (long value)                { return *this << (long long)(value); }
+    AsciiWriter&  operator<< (unsigned long value)       { return *this << (long long)(value); }
+    AsciiWriter&  operator<< (long long value);
+    AsciiWriter&  operator<< (float value)               { return *this << double(value); }
+    AsciiWriter&  operator<< (double value);
+    
+    void  close ();
+};
+
+
+// format a number into dst and return the end of the text, dst needs MaxNumberLength chars
+//   Doubles are formatted with 6 significant digits, like "%g"
+const int MaxNumberLength = 32;
+char* formatNumber (char* dst, double value);
+char* formatNumber (char* dst, long long value);
+
+
+} // namespace evg
+} // namespace cv
+
+#endif // EVG_ASCII_IO
@@ -0,0 +1,69 @@
+#ifndef EVG_BOUNDED_QUEUE
+#define EVG_BOUNDED_QUEUE
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+//
+// Blocking FIFO queue of limited capacity, to connect the stages of a pipeline
+//   running in different threads.
+//
+// Notes:
+//   push() waits while the queue is full, pop() waits while it is empty.
+//   close() is called by the producer when it is done. After that push() returns false,
+//     and pop() returns the remaining items and then false.
+//
+
+namespace cv {
+namespace evg {
+
+
+template<typename T>
+class BoundedQueue {
+    std::deque<T>            _items;
+    const size_t             _capacity;
+    bool                     _closed;
+    std::mutex               _mutex;
+    std::condition_variable  _notFull, _notEmpty;
+
+    BoundedQueue (const BoundedQueue&);
+    BoundedQueue& operator= (const BoundedQueue&);
+public:
+    explicit BoundedQueue (size_t capacity) : _capacity(capacity > 0 ? capacity : 1), _closed(false) { }
+
+    bool push (T item)
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        _notFull.wait (lock, [this] { return _closed || _items.size() < _capacity; });
+        if (_closed) return false;
+        _items.push_back (std::move(item));
+        _notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop (T& item)
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        _notEmpty.wait (lock, [this] { return _closed || !_items.empty(); });
+        if (_items.empty()) return false;
+        item = std::move (_items.front());
+        _items.pop_front();
+        _notFull.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock (_mutex);
+        _closed = true;
+        _notFull.notify_all();
+        _notEmpty.notify_all();
+    }
+};
+
+
+} // namespace evg
+} // namespace cv
+
+#endif // EVG_BOUNDED_QUEUE
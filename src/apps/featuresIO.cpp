@@ -6,10 +6,15 @@
 #include <fstream>
 #include <sstream>
 #include <stdexcept>
+#include <cstring>
+#include <cstdint>
 
 #include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 #include "featuresIO.h"
+#include "asciiIO.h"
 
 namespace cv {
 namespace evg {
@@ -59,6 +64,36 @@ double correct_endiannes (double src)
     return dst;
 }
 
+// convert an array of big-endian doubles in one pass
+void big_endian_to_host_doubles (const char* src, double* dst, size_t n)
+{
+    if (is_big_endian())
+    {
+        memcpy (dst, src, n * sizeof(double));
+        return;
+    }
+    for (size_t i = 0; i != n; ++i)
+    {
+        uint64_t word;
+        memcpy (&word, src + i * sizeof(double), sizeof(word));
+        word = ((word & 0x00000000000000ffull) << 56) | ((word & 0x000000000000ff00ull) << 40) |
+               ((word & 0x0000000000ff0000ull) << 24) | ((word & 0x00000000ff000000ull) << 8)  |
+               ((word & 0x000000ff00000000ull) >> 8)  | ((word & 0x0000ff0000000000ull) >> 24) |
+               ((word & 0x00ff000000000000ull) >> 40) | ((word & 0xff00000000000000ull) >> 56);
+        memcpy (dst + i, &word, sizeof(word));
+    }
+}
+
+// read the whole file with one read
+void read_whole_file (const std::string& filepath, vector<char>& buffer)
+{
+    std::ifstream ifs (filepath.c_str(), ios::binary);
+    if (!ifs) throw runtime_error("evg::read_whole_file: cannot open file " + filepath);
+    buffer.resize (size_t(file_size(path(filepath))));
+    if (!buffer.empty()) ifs.read (&buffer[0], buffer.size());
+    if (!ifs) throw runtime_error("evg::read_whole_file: cannot read file " + filepath);
+}
+
 
 
 
@@ -72,54 +107,46 @@ bool readVLFeatFileAscii (const std::string& filepath,
                           cv::Mat& descriptors)
 {
     try {
-        std::ifstream ifs (filepath.c_str());
-        if (!ifs) throw runtime_error("evg::readVLFeatFile: cannot open file of vlfeat format");
+        AsciiReader reader (filepath);
         
         // clear
         keypoints = vector<KeyPoint> ();
         descriptors = Mat ();
         
-        // read line by line
-        while (true)
+        // read line by line, descriptors grow in one buffer
+        vector<uchar> descrData;
+        size_t descrSize = 0;
+        for (; !reader.atEnd(); reader.nextLine())
         {
-            string line;
-            getline (ifs, line);
-            
-            // condition to exit the loop
-            if (ifs.eof()) break;
-            
-            if (!ifs) throw runtime_error("evg::readVLFeatFile: failed reading a line '" + line + "'");
+            if (reader.atLineEnd()) continue;
             
-            istringstream iss(line);
-        
             // read header (4 floats in format "x y size angle")
             float x, y, size, angle;
-            iss >> x >> y >> size >> angle;
+            if (!reader.read(x) || !reader.read(y) || !reader.read(size) || !reader.read(angle))
+                throw runtime_error("evg::readVLFeatFile: cannot read keypoint data");
             keypoints.push_back(KeyPoint (x, y, size, angle));
-            if (!ifs) throw runtime_error("evg::readVLFeatFile: cannot read keypoint data");
             
             // read descriptor (N uchar-s)
-            vector<uchar> descrVector;
+            const size_t descrBegin = descrData.size();
             unsigned int value;
-            while (iss >> value)
+            while (reader.read (value))
             {
-                descrVector.push_back(value);
                 if (value > 255)
                     throw runtime_error("evg::readVLFeatFile: descritptors are not in range [0 255]");
+                descrData.push_back(uchar(value));
             }
             
-            if (descrVector.size() == 0)
+            const size_t lineDescrSize = descrData.size() - descrBegin;
+            if (lineDescrSize == 0)
                 throw runtime_error("evg::readVLFeatFile: descriptor size was 0");
             
-            if (descriptors.rows > 0 && descriptors.cols != descrVector.size())
+            if (descrSize > 0 && descrSize != lineDescrSize)
                 throw runtime_error("evg::readVLFeatFile: inconsistent descriptor size across lines");
-            
-            Mat descriptor = Mat(descrVector).t();
-            descriptors.push_back(descriptor);
+            descrSize = lineDescrSize;
         }
-        descriptors.convertTo (descriptors, CV_8U);
-                    
-        ifs.close();
+        
+        if (!keypoints.empty())
+            Mat (int(keypoints.size()), int(descrSize), CV_8U, &descrData[0]).copyTo (descriptors);
         return true;
     } catch (exception& e) {
         cerr << e.what() << endl;
@@ -133,57 +160,41 @@ bool readVLFeatFileBin (const std::string& filepath,
                         cv::Mat& descriptors)
 {
     const int DescrSize = 128;
+    const int HeaderSize = 4;   // 4 doubles in format "x y size angle"
+    const size_t RecordSize = HeaderSize * sizeof(double) + DescrSize;
     
     try {
-        std::ifstream ifs (filepath.c_str(), ios::binary);
-        if (!ifs) throw runtime_error("evg::readVLFeatFile: cannot open file of vlfeat format");
-        
         // clear
         keypoints = vector<KeyPoint> ();
         descriptors = Mat ();
         
-        // read line by line
-        while (true)
+        vector<char> buffer;
+        read_whole_file (filepath, buffer);
+        
+        // a cut header at the end is ignored, a cut descriptor is an error
+        const size_t numPoints = buffer.size() / RecordSize;
+        if (buffer.size() % RecordSize >= HeaderSize * sizeof(double))
+            throw runtime_error("evg::readVLFeatFile: cannot read descriptor data");
+        if (numPoints == 0) return true;
+        
+        // gather headers, then swap their bytes in one pass
+        vector<char> rawHeaders (numPoints * HeaderSize * sizeof(double));
+        descriptors.create (int(numPoints), DescrSize, CV_8U);
+        for (size_t i = 0; i != numPoints; ++i)
         {
-            // read header (4 doubles in format "x y size angle")
-            const int HeaderSize = 4;
-            double header[HeaderSize];
-            ifs.read ((char*)&header, sizeof(header));
-            
-            // condition to exit the cycle
-            if (ifs.eof())
-                break;
-            
-            if (!ifs)
-                throw runtime_error("evg::readVLFeatFile: cannot read keypoint data");
-
-            for (int i = 0; i != HeaderSize; ++i)
-                header[i] = correct_endiannes(header[i]);
-
-            float x, y, size, angle;
-            x = float(header[0]);
-            y = float(header[1]);
-            size = float(header[2]);
-            angle = float(header[3]);
-            keypoints.push_back(KeyPoint (x, y, size, angle));
-            
-            // read descriptor (128 uchar-s)
-            uchar body[DescrSize];
-            ifs.read ((char*)&body, sizeof(body));
-            if (!ifs)
-                throw runtime_error("evg::readVLFeatFile: cannot read descriptor data");
-
-            vector<uchar> descrVector (body, body + DescrSize);
-            Mat descriptor = Mat(descrVector).t();
-
-            if (descriptor.cols != DescrSize)
-                throw runtime_error("evg::readVLFeatFile: descriptor size should be 128");
-            
-            descriptors.push_back(descriptor);
+            const char* record = &buffer[i * RecordSize];
+            memcpy (&rawHeaders[i * HeaderSize * sizeof(double)], record, HeaderSize * sizeof(double));
+            memcpy (descriptors.ptr(int(i)), record + HeaderSize * sizeof(double), DescrSize);
+        }
+        vector<double> headers (numPoints * HeaderSize);
+        big_endian_to_host_doubles (&rawHeaders[0], &headers[0], headers.size());
+        
+        keypoints.resize (numPoints);
+        for (size_t i = 0; i != numPoints; ++i)
+        {
+            const double* header = &headers[i * HeaderSize];
+            keypoints[i] = KeyPoint (float(header[0]), float(header[1]), float(header[2]), float(header[3]));
         }
-        descriptors.convertTo (descriptors, CV_8U);
-                    
-        ifs.close();
         return true;
     } catch (exception& e) {
         cerr << e.what() << endl;
@@ -203,8 +214,7 @@ bool writeVLFeatFileAscii (const std::string& filepath,
         if (descriptors.type() != CV_8U)
             throw runtime_error("evg::writeVLFeatFileAscii: descriptors Mat type is not CV_8U");
     
-        std::ofstream ofs (filepath.c_str());
-        if (!ofs) throw runtime_error("evg::writeVLFeatFileAscii: cannot open file for ascii writing");
+        AsciiWriter ofs (filepath);
         
         for (int iKey = 0; iKey < descriptors.rows; ++iKey)
         {
@@ -215,11 +225,9 @@ bool writeVLFeatFileAscii (const std::string& filepath,
             // write descriptor in the same line: descr[0] descr[1] ... descr[N]
             const uchar* p = descriptors.ptr (iKey);
             for (int iBin = 0; iBin < descriptors.cols; ++iBin)
-                ofs << int(*p++) << ((iBin == descriptors.cols - 1) ? "" : " ");
-            ofs << endl;
+                ofs << int(*p++) << ((iBin == descriptors.cols - 1) ? '\n' : ' ');
         }
         
-        ofs.flush();
         ofs.close();
         return true;
     } catch(exception& e) {
@@ -302,8 +310,7 @@ bool readUbcFileAscii (const std::string& filepath,
                        std::vector<cv::KeyPoint>& keypoints, cv::Mat& descriptors)
 {
     try {
-        std::ifstream ifs (filepath.c_str());
-        if (!ifs) throw runtime_error("evg::readUbcFileAscii: cannot open file of ubc format");
+        AsciiReader reader (filepath);
         
         // clear
         keypoints = vector<KeyPoint> ();
@@ -311,61 +318,38 @@ bool readUbcFileAscii (const std::string& filepath,
         
         // read global header
         int numPoints, descrSize;
-        string line;
-        getline (ifs, line);
-        istringstream iss(line);
-        iss >> numPoints >> descrSize;
-
-        if (!iss) throw runtime_error("evg::readUbcFileAscii: failed reading header from line '" + line + "'");
+        if (!reader.read(numPoints) || !reader.read(descrSize) || numPoints < 0 || descrSize <= 0)
+            throw runtime_error("evg::readUbcFileAscii: failed reading header [numPoints descrSize]");
         
-        // read line by line
-        while (true)
+        // descriptors may span several lines, as in Lowe's files
+        keypoints.reserve (numPoints);
+        if (numPoints > 0)
+            descriptors.create (numPoints, descrSize, CV_8U);
+        for (int i = 0; i != numPoints; ++i)
         {
-            string line;
-            getline (ifs, line);
-            
-            // condition to exit the loop
-            if (ifs.eof()) break;
-        
             // read header (4 floats in format "y x size angle")
             float x, y, size, angle;
-            istringstream iss(line);
-            iss >> y >> x >> size >> angle;
+            if (!reader.read(y, true) || !reader.read(x, true) ||
+                !reader.read(size, true) || !reader.read(angle, true))
+                throw runtime_error("evg::readUbcFileAscii: cannot read keypoint data");
             keypoints.push_back(KeyPoint (x, y, size, angle));
-            if (!iss) throw runtime_error("evg::readUbcFileAscii: cannot read keypoint from line '" + line + "'");
             
             // read descriptor (N uchar-s)
-            line = string();
-            getline (ifs, line);
-            if (!ifs) throw runtime_error("evg::readUbcFileAscii: cannot read descriptor line");
-
-            istringstream iss2(line);
-            vector<uchar> descrVector;
-            unsigned int value;
-            while (iss2 >> value)
+            uchar* descr = descriptors.ptr(i);
+            for (int j = 0; j != descrSize; ++j)
             {
-                descrVector.push_back(value);
+                unsigned int value;
+                if (!reader.read (value, true))
+                    throw runtime_error("evg::readUbcFileAscii: descriptor size differs from the declared");
                 if (value > 255)
                     throw runtime_error("evg::readUbcFileAscii: descritptors are not in range [0 255]");
+                descr[j] = uchar(value);
             }
-            
-            if (descrVector.size() == 0)
-                throw runtime_error("evg::readUbcFileAscii: descriptor size was 0 from line '" + line + "'");
-            
-            if (descriptors.rows > 0 && descriptors.cols != descrVector.size())
-                throw runtime_error("evg::readUbcFileAscii: inconsistent descriptor size across lines");
-            Mat descriptor = Mat(descrVector).t();
-            descriptors.push_back(descriptor);
         }
-        descriptors.convertTo (descriptors, CV_8U);
-                    
-        if (descriptors.rows != numPoints)
+        
+        if (!reader.atEnd())
             throw runtime_error("evg::readUbcFileAscii: read different number of points from declared");
-            
-        if (descriptors.cols != descrSize)
-            throw runtime_error("evg::readUbcFileAscii: descriptor size differs from the declared");
-
-        ifs.close();
+        
         return true;
     } catch(exception& e) {
         cerr << e.what() << endl;
@@ -384,25 +368,25 @@ bool writeUbcFileAscii  (const std::string& filepath,
         if (descriptors.type() != CV_8U)
             throw runtime_error("evg::writeUbcFileAscii: descriptors Mat type is not CV_8U");
     
-        std::ofstream ofs (filepath.c_str());
-        if (!ofs) throw runtime_error("evg::writeUbcFileAscii: cannot open file for ascii writing");
+        AsciiWriter ofs (filepath);
         
         // write number of keypoints and descriptor size
-        ofs << descriptors.rows << ' ' << descriptors.cols << endl;
+        ofs << descriptors.rows << ' ' << descriptors.cols << '\n';
         
         for (int iKey = 0; iKey != keypoints.size(); ++iKey)
         {
             // write keypoint header
             const KeyPoint& key = keypoints[iKey];
-            ofs << ' ' << key.pt.y << ' ' << key.pt.x << ' ' << key.size << ' ' << key.angle << endl;
+            ofs << ' ' << key.pt.y << ' ' << key.pt.x << ' ' << key.size << ' ' << key.angle << '\n';
             
             // write descriptor: descr[0] descr[1] ... descr[N]
             const uchar* p = descriptors.ptr (iKey);
             for (int iBin = 0; iBin < descriptors.cols; ++iBin)
                 ofs << ' ' << int(*p++);
-            ofs << endl;
+            ofs << '\n';
         }
         
+        ofs.close();
         return true;
     } catch(exception& e) {
         cerr << e.what() << endl;
@@ -418,19 +402,24 @@ bool readUbcFileBin (const std::string& filepath,
                      std::vector<cv::KeyPoint>& keypoints, cv::Mat& descriptors)
 {
     const int DescrSize = 128;
+    const int KeypointSize = 5;   // 5 floats in format "x y color size angle"
+    const size_t HeaderSize = 5 * sizeof(int);
+    const size_t RecordSize = KeypointSize * sizeof(float) + DescrSize;
     
     try {
-        std::ifstream ifs (filepath.c_str(), ios::binary);
-        if (!ifs) throw runtime_error("evg::readUbcFile: cannot open file of ubc format");
-        
         // clear
         keypoints = vector<KeyPoint> ();
         descriptors = Mat ();
         
+        vector<char> buffer;
+        read_whole_file (filepath, buffer);
+        if (buffer.size() < HeaderSize)
+            throw runtime_error("evg::readUbcFile: file is too short for ubc format");
+        
         int header1[2];
-        ifs.read ((char*)&header1, sizeof(header1));
+        memcpy (header1, &buffer[0], sizeof(header1));
         int header2[3];
-        ifs.read ((char*)&header2, sizeof(header2));
+        memcpy (header2, &buffer[sizeof(header1)], sizeof(header2));
         
         // ground truth
         int name = ('S'+ ('I'<<8)+('F'<<16)+('T'<<24));
@@ -444,66 +433,34 @@ bool readUbcFileBin (const std::string& filepath,
         
         // the header's 9-11 bytes are [NPoints 5 128]
         int numPoints = header2[0];
-        if (header2[1] != 5 || header2[2] != DescrSize)
+        if (numPoints < 0 || header2[1] != KeypointSize || header2[2] != DescrSize)
             throw runtime_error("evg::readUbcFile: bytes 9-12 in binary file in ubc (Lowe's) format "
                               "are [numPoints 5 128]");
         
-        // read line by line
+        const size_t dataEnd = HeaderSize + numPoints * RecordSize;
+        if (buffer.size() < dataEnd)
+            throw runtime_error("evg::readUbcFile: cannot read keypoint or descriptor data");
+        
+        keypoints.resize (numPoints);
+        if (numPoints > 0)
+            descriptors.create (numPoints, DescrSize, CV_8U);
         for (int i = 0; i != numPoints; ++i)
         {
-            // read header (5 floats in format "x y color size angle")
-            const int KeypointSize = 5;
-            float header[KeypointSize];
-            ifs.read ((char*)&header, sizeof(header));
-            
-            if (!ifs)
-                throw runtime_error("evg::readUbcFile: cannot read keypoint data");
-
-            //for (int i = 0; i != KeypointSize; ++i)
-            //    header[i] = correct_endiannes(header[i]);
-
-            float x, y, color, size, angle;
-            x = header[0];
-            y = header[1];
-            color = header[2]; // is never used
-            size = header[3];
-            angle = header[4];
-            keypoints.push_back(KeyPoint (x, y, size, angle));
+            const char* record = &buffer[HeaderSize + i * RecordSize];
             
-//            cout << "keypoints: " << x << " " << y << " " << color << " " << size << " " << angle << endl;
-            
-            // read descriptor (128 uchar-s)
-            uchar descr[DescrSize];
-            ifs.read ((char*)&descr, sizeof(descr));
-            if (!ifs)
-                throw runtime_error("evg::readUbcFile: cannot read descriptor data");
-
-            vector<uchar> descrVector (descr, descr + DescrSize);
-            Mat descriptor = Mat(descrVector).t();
-            
-//            for (int j = 0; j != 100; ++j)
-//                cout << (int) descr[j] << ", " << flush;
-//            cout << endl;
-
-            if (descriptor.cols != DescrSize)
-                throw runtime_error("evg::readUbcFile: descriptor size should be 128");
+            // color is never used
+            float header[KeypointSize];
+            memcpy (header, record, sizeof(header));
+            keypoints[i] = KeyPoint (header[0], header[1], header[3], header[4]);
             
-            descriptors.push_back(descriptor);
+            memcpy (descriptors.ptr(i), record + sizeof(header), DescrSize);
         }
-        descriptors.convertTo (descriptors, CV_8U);
-                    
-        // read footer (4 doubles in format "x y size angle")
-        int footer;
-        ifs.read ((char*)&footer, sizeof(footer));
-        
-        // try to read again. If didn't yet reach the eof, return success but print a warning
-        char dummy;
-        ifs.read ((char*)&dummy, sizeof(dummy));
-        if (!ifs.eof())
+        
+        // the footer takes 4 bytes. If there is more, return success but print a warning
+        if (buffer.size() > dataEnd + sizeof(int))
             cerr << "evg::readUbcFile: warning: number of points in the file seems "
                     "acceed the number declared in the header" << endl;
         
-        ifs.close();
         return true;
     } catch (exception& e) {
         cerr << e.what() << endl;
@@ -603,8 +560,7 @@ bool writeVsfmMatches (const string& filepath, const string& imName1, const stri
                        const vector<DMatch>& matches)
 {
     try {
-        std::ofstream ofs (filepath.c_str(), ios::binary);
-        if (!ofs) throw runtime_error("evg::writeVsfmMatches: cannot open file for writing");
+        AsciiWriter ofs (filepath);
         
         // header
         ofs << imName1 << ' ' << imName2 << ' ' << matches.size() << '\n';
@@ -617,7 +573,6 @@ bool writeVsfmMatches (const string& filepath, const string& imName1, const stri
             ofs << matches[i].trainIdx << ' ';
         ofs << '\n';
  
-        ofs.flush();
         ofs.close();
         return true;
     } catch(exception& e) {
@@ -669,11 +624,75 @@ bool readVsfmMatches    (const string& filepath, string& imName1, string& imName
 }
 
 
+bool writeSimpleMatchesAscii (const std::string& filepath,
+                              const std::string& imName1, const std::string& imName2,
+                              const std::vector<Point2f>& points1,
+                              const std::vector<Point2f>& points2)
+{
+    AsciiWriter ofs (filepath);
+    
+    // header
+    ofs << imName1 << '\n';
+    ofs << imName2 << '\n';
+    ofs << points1.size() << '\n';
+    ofs << "x1 y1 x2 y2" << '\n';
+    
+    // matches
+    for (int i = 0; i != points1.size(); ++i)
+        ofs << points1[i].x << ' ' << points1[i].y << ' ' << points2[i].x << ' ' << points2[i].y << '\n';
+    
+    ofs.close();
+    return true;
+}
+
+
+// binary: "SMAT", version, image names as length and chars, number of matches,
+//   then "x1 y1 x2 y2" as floats for every match, in the byte order of the host
+const char     SimpleMatchesMagic[4] = { 'S', 'M', 'A', 'T' };
+const uint32_t SimpleMatchesVersion  = 1;
+
+bool writeSimpleMatchesBin (const std::string& filepath,
+                            const std::string& imName1, const std::string& imName2,
+                            const std::vector<Point2f>& points1,
+                            const std::vector<Point2f>& points2)
+{
+    std::ofstream ofs (filepath.c_str(), ios::binary);
+    if (!ofs) throw runtime_error("evg::writeSimpleMatches: cannot open file for writing");
+    
+    // header
+    const uint32_t length1 = uint32_t(imName1.size()), length2 = uint32_t(imName2.size());
+    const uint32_t numMatches = uint32_t(points1.size());
+    ofs.write (SimpleMatchesMagic, sizeof(SimpleMatchesMagic));
+    ofs.write ((const char*)&SimpleMatchesVersion, sizeof(SimpleMatchesVersion));
+    ofs.write ((const char*)&length1, sizeof(length1));
+    ofs.write (imName1.data(), length1);
+    ofs.write ((const char*)&length2, sizeof(length2));
+    ofs.write (imName2.data(), length2);
+    ofs.write ((const char*)&numMatches, sizeof(numMatches));
+    
+    // matches
+    vector<float> data (4 * numMatches);
+    for (uint32_t i = 0; i != numMatches; ++i)
+    {
+        data[4*i]   = points1[i].x;
+        data[4*i+1] = points1[i].y;
+        data[4*i+2] = points2[i].x;
+        data[4*i+3] = points2[i].y;
+    }
+    if (!data.empty()) ofs.write ((const char*)&data[0], data.size() * sizeof(float));
+    
+    if (!ofs) throw runtime_error("evg::writeSimpleMatches: failed writing the file");
+    ofs.close();
+    return true;
+}
+
+
 bool writeSimpleMatches (const std::string& outFileName,
                          const std::string& imName1, const std::string& imName2,
                          const std::vector<cv::KeyPoint>& keypoints1,
                          const std::vector<cv::KeyPoint>& keypoints2,
-                         const std::vector<cv::DMatch>& matches)
+                         const std::vector<cv::DMatch>& matches,
+                         bool binFormat)
 {
     try {
         path outFilePath (outFileName);
@@ -688,31 +707,23 @@ bool writeSimpleMatches (const std::string& outFileName,
             return 0;
         }
         
-        std::ofstream ofs (outFilePath.string().c_str(), ios::binary);
-        if (!ofs) throw runtime_error("evg::writeSimpleMatches: cannot open file for writing");
-        
-        // header
-        ofs << imName1 << endl;
-        ofs << imName2 << endl;
-        ofs << matches.size() << endl;
-        ofs << "x1 y1 x2 y2" << endl;
-        
-        // matches
+        // matched points
+        vector<Point2f> points1 (matches.size()), points2 (matches.size());
         for (int i = 0; i != matches.size(); ++i)
         {
-            if (keypoints1.size() < matches[i].queryIdx || keypoints2.size() < matches[i].trainIdx)
+            if (keypoints1.size() <= matches[i].queryIdx || keypoints2.size() <= matches[i].trainIdx)
             {
                 cerr << "match " << i << " refers to an out-of-range keypoint." << endl;
                 return 0;
             }
-            const Point2f& pt1 = keypoints1[matches[i].queryIdx].pt;
-            const Point2f& pt2 = keypoints2[matches[i].trainIdx].pt;
-            ofs << pt1.x << " " << pt1.y << " " << pt2.x << " " << pt2.y << "\n";
+            points1[i] = keypoints1[matches[i].queryIdx].pt;
+            points2[i] = keypoints2[matches[i].trainIdx].pt;
         }
-
-        ofs.flush();
-        ofs.close();
-        return true;
+        
+        if (binFormat)
+            return writeSimpleMatchesBin (outFilePath.string(), imName1, imName2, points1, points2);
+        else
+            return writeSimpleMatchesAscii (outFilePath.string(), imName1, imName2, points1, points2);
     } catch(exception& e) {
         cerr << e.what() << endl;
         return false;
@@ -721,50 +732,42 @@ bool writeSimpleMatches (const std::string& outFileName,
 
 
 
-bool readSimpleMatches  (const std::string& filepath,
-                         std::string& imName1, std::string& imName2,
-                         std::vector<cv::KeyPoint>& keypoints1,
-                         std::vector<cv::KeyPoint>& keypoints2,
-                         std::vector<cv::DMatch>& matches)
+bool readSimpleMatchesAscii (const std::string& filepath,
+                             std::string& imName1, std::string& imName2,
+                             std::vector<cv::KeyPoint>& keypoints1,
+                             std::vector<cv::KeyPoint>& keypoints2,
+                             std::vector<cv::DMatch>& matches)
 {
     try {
-        std::ifstream ifs (filepath.c_str());
-        if (!ifs) throw runtime_error("evg::readSimpleMatches: cannot open file: " + filepath);
+        AsciiReader reader (filepath);
         
-        string line;
-
         // header
         
         // image names
-        getline(ifs, imName1);
-        getline(ifs, imName2);
-        
-        // number of matches
-        getline(ifs, line);
-        istringstream iss(line);
+        string dummy;
         int n;
-        iss >> n;
+        if (!reader.readLine(imName1) || !reader.readLine(imName2) ||
+            // number of matches
+            !reader.read(n) || !reader.readLine(dummy) ||
+            // dummy line of format: "x1 y1 x2 y2"
+            !reader.readLine(dummy))
+            throw runtime_error("evg::readSimpleMatches: failed to read header");
+        
         keypoints1.reserve(n);
         keypoints2.reserve(n);
         matches.reserve(n);
 
-        // dummy line of format: "x1 y1 x2 y2"
-        getline(ifs, line);
-    
-        if (!ifs) throw runtime_error("evg::readSimpleMatches: failed to read header");
-        
         // data
-        for (int i = 0; getline(ifs, line); ++i)
+        for (int i = 0; !reader.atEnd(); ++i, reader.nextLine())
         {
             float x1, y1, x2, y2;
-            istringstream iss (line);
-            iss >> x1 >> y1 >> x2 >> y2;
+            if (!reader.read(x1) || !reader.read(y1) || !reader.read(x2) || !reader.read(y2))
+                throw runtime_error("evg::readSimpleMatches: cannot read a match from " + filepath);
             keypoints1.push_back( KeyPoint(Point2f(x1, y1), 1, 1) );
             keypoints2.push_back( KeyPoint(Point2f(x2, y2), 1, 1) );
             matches.push_back( DMatch(i, i, 1) );
         }
                 
-        ifs.close();
         return true;
     } catch(exception& e) {
         cerr << e.what() << endl;
@@ -773,6 +776,899 @@ bool readSimpleMatches  (const std::string& filepath,
 }
 
 
+bool readSimpleMatchesBin (const std::string& filepath,
+                           std::string& imName1, std::string& imName2,
+                           std::vector<cv::KeyPoint>& keypoints1,
+                           std::vector<cv::KeyPoint>& keypoints2,
+                           std::vector<cv::DMatch>& matches)
+{
+    try {
+        vector<char> buffer;
+        read_whole_file (filepath, buffer);
+        
+        // header
+        size_t pos = 0;
+        auto take = [&] (void* dst, size_t size)
+        {
+            if (pos + size > buffer.size())
+                throw runtime_error("evg::readSimpleMatches: file is truncated: " + filepath);
+            if (size) memcpy (dst, &buffer[pos], size);
+            pos += size;
+        };
+        char magic[4];
+        uint32_t version, length1, length2, numMatches;
+        take (magic, sizeof(magic));
+        take (&version, sizeof(version));
+        if (memcmp (magic, SimpleMatchesMagic, sizeof(magic)) != 0 || version != SimpleMatchesVersion)
+            throw runtime_error("evg::readSimpleMatches: not a binary matches file: " + filepath);
+        take (&length1, sizeof(length1));
+        imName1.resize (length1);
+        take (length1 ? &imName1[0] : 0, length1);
+        take (&length2, sizeof(length2));
+        imName2.resize (length2);
+        take (length2 ? &imName2[0] : 0, length2);
+        take (&numMatches, sizeof(numMatches));
+        
+        // data, checked against the file before allocating it
+        const size_t numFloats = size_t(numMatches) * 4;
+        if (numFloats > (buffer.size() - pos) / sizeof(float))
+            throw runtime_error("evg::readSimpleMatches: file is truncated: " + filepath);
+        vector<float> data (numFloats);
+        take (data.empty() ? 0 : &data[0], data.size() * sizeof(float));
+        keypoints1.reserve(keypoints1.size() + numMatches);
+        keypoints2.reserve(keypoints2.size() + numMatches);
+        matches.reserve(matches.size() + numMatches);
+        for (uint32_t i = 0; i != numMatches; ++i)
+        {
+            keypoints1.push_back( KeyPoint(Point2f(data[4*i], data[4*i+1]), 1, 1) );
+            keypoints2.push_back( KeyPoint(Point2f(data[4*i+2], data[4*i+3]), 1, 1) );
+            matches.push_back( DMatch(i, i, 1) );
+        }
+        return true;
+    } catch(exception& e) {
+        cerr << e.what() << endl;
+        return false;
+    }
+}
+
+
+bool readSimpleMatches  (const std::string& filepath,
+                         std::string& imName1, std::string& imName2,
+                         std::vector<cv::KeyPoint>& keypoints1,
+                         std::vector<cv::KeyPoint>& keypoints2,
+                         std::vector<cv::DMatch>& matches,
+                         bool binFormat)
+{
+    if (binFormat)
+        return readSimpleMatchesBin (filepath, imName1, imName2, keypoints1, keypoints2, matches);
+    else
+        return readSimpleMatchesAscii (filepath, imName1, imName2, keypoints1, keypoints2, matches);
+}
+
+
+
+
+/// ============================   Match archive   =============================
+
+
+namespace {
+
+// file: magic, version, records, index, index offset, index magic
+//   record: names as length and chars, number of matches, "x1 y1 x2 y2" floats per match
+//   index: number of entries, then names, record offset and number of matches per entry
+const char     MatchArchiveMagic[4]      = { 'M', 'A', 'R', 'C' };
+const char     MatchArchiveIndexMagic[4] = { 'M', 'I', 'D', 'X' };
+const uint32_t MatchArchiveVersion       = 1;
+const uint64_t MatchArchiveHeaderSize    = sizeof(MatchArchiveMagic) + sizeof(uint32_t);
+const uint64_t MatchArchiveFooterSize    = sizeof(uint64_t) + sizeof(MatchArchiveIndexMagic);
+
+template<typename T>
+void putValue (std::ostream& os, const T& value)
+{
+    os.write ((const char*)&value, sizeof(value));
+}
+
+void putString (std::ostream& os, const string& str)
+{
+    putValue (os, uint32_t(str.size()));
+    os.write (str.data(), str.size());
+}
+
+template<typename T>
+void getValue (std::istream& is, T& value)
+{
+    is.read ((char*)&value, sizeof(value));
+}
+
+void getString (std::istream& is, string& str)
+{
+    uint32_t length = 0;
+    getValue (is, length);
+    if (!is) return;
+    str.resize (length);
+    if (length) is.read (&str[0], length);
+}
+
+// reads the index of a closed archive and returns its offset
+uint64_t readMatchArchiveIndex (const string& filepath, vector<MatchArchiveEntry>& index)
+{
+    std::ifstream ifs (filepath.c_str(), ios::binary);
+    if (!ifs) throw runtime_error("evg::MatchArchive: cannot open file " + filepath);
+    
+    const uint64_t fileSize = file_size(path(filepath));
+    if (fileSize < MatchArchiveHeaderSize + MatchArchiveFooterSize)
+        throw runtime_error("evg::MatchArchive: file is too short: " + filepath);
+    
+    char magic[4];
+    uint32_t version;
+    ifs.read (magic, sizeof(magic));
+    getValue (ifs, version);
+    if (!ifs || memcmp (magic, MatchArchiveMagic, sizeof(magic)) != 0)
+        throw runtime_error("evg::MatchArchive: not a match archive: " + filepath);
+    if (version != MatchArchiveVersion)
+        throw runtime_error("evg::MatchArchive: unknown version of archive: " + filepath);
+    
+    uint64_t indexOffset;
+    ifs.seekg (fileSize - MatchArchiveFooterSize);
+    getValue (ifs, indexOffset);
+    ifs.read (magic, sizeof(magic));
+    if (!ifs || memcmp (magic, MatchArchiveIndexMagic, sizeof(magic)) != 0 ||
+        indexOffset < MatchArchiveHeaderSize || indexOffset > fileSize - MatchArchiveFooterSize)
+        throw runtime_error("evg::MatchArchive: archive has no index, was it closed? " + filepath);
+    
+    ifs.seekg (indexOffset);
+    uint32_t numEntries = 0;
+    getValue (ifs, numEntries);
+    index.resize (numEntries);
+    for (uint32_t i = 0; i != numEntries && ifs; ++i)
+    {
+        uint64_t offset;
+        uint32_t numMatches;
+        getString (ifs, index[i].imName1);
+        getString (ifs, index[i].imName2);
+        getValue (ifs, offset);
+        getValue (ifs, numMatches);
+        index[i].offset = offset;
+        index[i].numMatches = numMatches;
+    }
+    if (!ifs) throw runtime_error("evg::MatchArchive: index is corrupted: " + filepath);
+    return indexOffset;
+}
+
+} // namespace
+
+
+MatchArchiveWriter::MatchArchiveWriter () : _offset(0) { }
+
+
+MatchArchiveWriter::~MatchArchiveWriter ()
+{
+    if (isOpen()) close();
+}
+
+
+bool MatchArchiveWriter::open (const std::string& filepath)
+{
+    try {
+        if (isOpen()) close();
+        _index.clear();
+        
+        if (exists(path(filepath)))
+        {
+            // drop the old index, it is written again with the new records
+            _offset = readMatchArchiveIndex (filepath, _index);
+            resize_file (path(filepath), _offset);
+            _ofs.open (filepath.c_str(), ios::binary | ios::app);
+        }
+        else
+        {
+            _ofs.open (filepath.c_str(), ios::binary);
+            _ofs.write (MatchArchiveMagic, sizeof(MatchArchiveMagic));
+            putValue (_ofs, MatchArchiveVersion);
+            _offset = MatchArchiveHeaderSize;
+        }
+        if (!_ofs) throw runtime_error("evg::MatchArchiveWriter: cannot open file for writing: " + filepath);
+        return true;
+    } catch(exception& e) {
+        cerr << e.what() << endl;
+        if (_ofs.is_open()) _ofs.close();
+        return false;
+    }
+}
+
+
+bool MatchArchiveWriter::write (const std::string& imName1, const std::string& imName2,
+                                const std::vector<cv::KeyPoint>& keypoints1,
+                                const std::vector<cv::KeyPoint>& keypoints2,
+                                const std::vector<cv::DMatch>& matches)
+{
+    try {
+        if (!isOpen()) throw runtime_error("evg::MatchArchiveWriter: archive is not open");
+        
+        // matched points
+        vector<float> data (4 * matches.size());
+        for (size_t i = 0; i != matches.size(); ++i)
+        {
+            if (keypoints1.size() <= matches[i].queryIdx || keypoints2.size() <= matches[i].trainIdx)
+                throw runtime_error("evg::MatchArchiveWriter: a match refers to an out-of-range keypoint");
+            const Point2f& pt1 = keypoints1[matches[i].queryIdx].pt;
+            const Point2f& pt2 = keypoints2[matches[i].trainIdx].pt;
+            data[4*i]   = pt1.x;
+            data[4*i+1] = pt1.y;
+            data[4*i+2] = pt2.x;
+            data[4*i+3] = pt2.y;
+        }
+        
+        MatchArchiveEntry entry;
+        entry.imName1 = imName1;
+        entry.imName2 = imName2;
+        entry.offset = _offset;
+        entry.numMatches = uint32_t(matches.size());
+        
+        putString (_ofs, imName1);
+        putString (_ofs, imName2);
+        putValue (_ofs, uint32_t(entry.numMatches));
+        if (!data.empty()) _ofs.write ((const char*)&data[0], data.size() * sizeof(float));
+        if (!_ofs) throw runtime_error("evg::MatchArchiveWriter: failed writing a record");
+        
+        _offset += 3 * sizeof(uint32_t) + imName1.size() + imName2.size() + data.size() * sizeof(float);
+        _index.push_back (entry);
+        return true;
+    } catch(exception& e) {
+        cerr << e.what() << endl;
+        return false;
+    }
+}
+
+
+bool MatchArchiveWriter::close ()
+{
+    try {
+        if (!isOpen()) return true;
+        
+        // index and footer
+        putValue (_ofs, uint32_t(_index.size()));
+        for (size_t i = 0; i != _index.size(); ++i)
+        {
+            putString (_ofs, _index[i].imName1);
+            putString (_ofs, _index[i].imName2);
+            putValue (_ofs, uint64_t(_index[i].offset));
+            putValue (_ofs, uint32_t(_index[i].numMatches));
+        }
+        putValue (_ofs, uint64_t(_offset));
+        _ofs.write (MatchArchiveIndexMagic, sizeof(MatchArchiveIndexMagic));
+        
+        _ofs.close();
+        if (!_ofs) throw runtime_error("evg::MatchArchiveWriter: failed writing the index");
+        return true;
+    } catch(exception& e) {
+        cerr << e.what() << endl;
+        return false;
+    }
+}
+
+
+bool MatchArchiveReader::open (const std::string& filepath)
+{
+    try {
+        _index.clear();
+        readMatchArchiveIndex (filepath, _index);
+        _filepath = filepath;
+        return true;
+    } catch(exception& e) {
+        cerr << e.what() << endl;
+        return false;
+    }
+}
+
+
+int MatchArchiveReader::find (const std::string& imName1, const std::string& imName2) const
+{
+    for (int i = 0; i != size(); ++i)
+        if (_index[i].imName1 == imName1 && _index[i].imName2 == imName2)
+            return i;
+    return -1;
+}
+
+
+bool MatchArchiveReader::read (int i,
+                               std::vector<cv::KeyPoint>& keypoints1,
+                               std::vector<cv::KeyPoint>& keypoints2,
+                               std::vector<cv::DMatch>& matches) const
+{
+    try {
+        const MatchArchiveEntry& entry = _index.at(i);
+        std::ifstream ifs (_filepath.c_str(), ios::binary);
+        if (!ifs) throw runtime_error("evg::MatchArchiveReader: cannot open file " + _filepath);
+        
+        // skip the names, they are in the index
+        ifs.seekg (entry.offset + 2 * sizeof(uint32_t) + entry.imName1.size() + entry.imName2.size());
+        uint32_t numMatches = 0;
+        getValue (ifs, numMatches);
+        if (numMatches != entry.numMatches)
+            throw runtime_error("evg::MatchArchiveReader: record does not agree with the index");
+        
+        // checked against the file before allocating
+        const size_t numFloats = size_t(numMatches) * 4;
+        const uint64_t position = uint64_t(ifs.tellg());
+        if (!ifs || numFloats > (file_size(path(_filepath)) - position) / sizeof(float))
+            throw runtime_error("evg::MatchArchiveReader: record is beyond the end of file");
+        vector<float> data (numFloats);
+        if (!data.empty()) ifs.read ((char*)&data[0], data.size() * sizeof(float));
+        if (!ifs) throw runtime_error("evg::MatchArchiveReader: cannot read a record");
+        
+        keypoints1.resize (numMatches);
+        keypoints2.resize (numMatches);
+        matches.resize (numMatches);
+        for (uint32_t m = 0; m != numMatches; ++m)
+        {
+            keypoints1[m] = KeyPoint(Point2f(data[4*m], data[4*m+1]), 1, 1);
+            keypoints2[m] = KeyPoint(Point2f(data[4*m+2], data[4*m+3]), 1, 1);
+            matches[m] = DMatch(m, m, 1);
+        }
+        return true;
+    } catch(exception& e) {
+        cerr << e.what() << endl;
+        return false;
+    }
+}
+
+
+
+
+
+/// ============================   Aff features   ==============================
+
+
+namespace {
+
+const char     AffFeaturesMagic[4]  = { 'A', 'F', 'F', 'T' };
+const uint32_t AffFeaturesVersion   = 2;  // 2: with a descriptor codec
+const uint32_t AffFeaturesByteOrder = 0x01020304;
+const int      NumKeypointFields    = MappedAffFeatures::NumFloatFields + 2;  // + octave, class_id
+
+struct AffFeaturesHeader {
+    char      magic[4];
+    uint32_t  byteOrder;
+    uint32_t  version;
+    uint32_t  numKeypoints;
+    int32_t   descriptorType;
+    uint32_t  descriptorCols;
+    uint32_t  numViews;
+    int32_t   minTilt;
+    int32_t   maxTilt;
+    uint32_t  codecSize;            // 0 if descriptors are not encoded, always 0 in version 1
+    uint64_t  viewsOffset;          // all offsets are from the start of file
+    uint64_t  keypointsOffset;
+    uint64_t  descriptorsOffset;
+};
+static_assert (sizeof(AffFeaturesHeader) == 64, "AffFeaturesHeader must take 64 bytes");
+
+uint64_t alignUp (uint64_t offset, uint64_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+// Mat-s of descriptors() share the mapping, the last one of them and MappedAffFeatures unmap the file
+class SharedRegionAllocator : public MatAllocator {
+public:
+    UMatData* allocate (int, const int*, int, void*, size_t*, int, UMatUsageFlags) const
+    {
+        return 0;
+    }
+    bool allocate (UMatData*, int, UMatUsageFlags) const
+    {
+        return false;
+    }
+    void deallocate (UMatData* u) const
+    {
+        if (!u) return;
+        CV_Assert (u->urefcount == 0 && u->refcount == 0);
+        delete static_cast<std::shared_ptr<boost::interprocess::mapped_region>*>(u->userdata);
+        delete u;
+    }
+};
+
+void padTo (std::ofstream& ofs, uint64_t offset)
+{
+    const uint64_t position = uint64_t(ofs.tellp());
+    assert (position <= offset);
+    const vector<char> zeros (size_t(offset - position), 0);
+    if (!zeros.empty()) ofs.write (&zeros[0], zeros.size());
+}
+
+} // namespace
+
+
+bool writeAffFeatures (const std::string& filepath,
+                       const std::vector<cv::KeyPoint>& keypoints,
+                       const cv::Mat& descriptors,
+                       int minTilt, int maxTilt,
+                       const DescriptorCodec* codec, bool encoded)
+{
+    try {
+        if (keypoints.size() != descriptors.rows)
+            throw runtime_error("evg::writeAffFeatures: keypoints number != descriptors number");
+        if (!descriptors.empty() && descriptors.channels() != 1)
+            throw runtime_error("evg::writeAffFeatures: descriptors must have one channel");
+
+        const uint32_t numKeypoints = uint32_t(keypoints.size());
+
+        vector<char> codecBytes;
+        Mat codes = descriptors;
+        if (codec && !codec->empty())
+        {
+            if (!encoded && !descriptors.empty())
+                codec->encode (descriptors, codes);
+            codec->toBytes (codecBytes);
+        }
+
+        // views are known if keypoints are grouped by view id
+        bool haveViews = numKeypoints > 0;
+        for (uint32_t i = 0; haveViews && i != numKeypoints; ++i)
+            if (keypoints[i].class_id < 0 || (i > 0 && keypoints[i].class_id < keypoints[i-1].class_id))
+                haveViews = false;
+        vector<uint32_t> viewOffsets;
+        if (haveViews)
+        {
+            viewOffsets.assign (keypoints.back().class_id + 2, 0);
+            for (uint32_t i = 0; i != numKeypoints; ++i)
+                ++viewOffsets[keypoints[i].class_id + 1];
+            for (size_t v = 1; v != viewOffsets.size(); ++v)
+                viewOffsets[v] += viewOffsets[v-1];
+        }
+
+        AffFeaturesHeader header;
+        memset (&header, 0, sizeof(header));
+        memcpy (header.magic, AffFeaturesMagic, sizeof(header.magic));
+        header.byteOrder         = AffFeaturesByteOrder;
+        header.version           = AffFeaturesVersion;
+        header.numKeypoints      = numKeypoints;
+        header.descriptorType    = codes.empty() ? CV_32F : codes.type();
+        header.descriptorCols    = codes.cols;
+        header.numViews          = haveViews ? uint32_t(viewOffsets.size() - 1) : 0;
+        header.minTilt           = minTilt;
+        header.maxTilt           = maxTilt;
+        header.codecSize         = uint32_t(codecBytes.size());
+        header.viewsOffset       = sizeof(header);
+        const uint64_t codecOffset = header.viewsOffset + viewOffsets.size() * sizeof(uint32_t);
+        header.keypointsOffset   = alignUp (codecOffset + codecBytes.size(), 16);
+        header.descriptorsOffset = alignUp (header.keypointsOffset
+                                            + uint64_t(NumKeypointFields) * numKeypoints * 4, 64);
+
+        std::ofstream ofs (filepath.c_str(), ios::binary);
+        if (!ofs) throw runtime_error("evg::writeAffFeatures: cannot open file for writing: " + filepath);
+
+        ofs.write ((const char*)&header, sizeof(header));
+        if (!viewOffsets.empty())
+            ofs.write ((const char*)&viewOffsets[0], viewOffsets.size() * sizeof(uint32_t));
+        if (!codecBytes.empty())
+            ofs.write (&codecBytes[0], codecBytes.size());
+
+        // keypoints field by field
+        padTo (ofs, header.keypointsOffset);
+        vector<float> floats (numKeypoints);
+        vector<int32_t> ints (numKeypoints);
+        for (int f = 0; f != MappedAffFeatures::NumFloatFields && numKeypoints; ++f)
+        {
+            for (uint32_t i = 0; i != numKeypoints; ++i)
+            {
+                const KeyPoint& kp = keypoints[i];
+                switch (f) {
+                    case MappedAffFeatures::X:        floats[i] = kp.pt.x;     break;
+                    case MappedAffFeatures::Y:        floats[i] = kp.pt.y;     break;
+                    case MappedAffFeatures::Size:     floats[i] = kp.size;     break;
+                    case MappedAffFeatures::Angle:    floats[i] = kp.angle;    break;
+                    case MappedAffFeatures::Response: floats[i] = kp.response; break;
+                }
+            }
+            ofs.write ((const char*)&floats[0], numKeypoints * sizeof(float));
+        }
+        for (int f = 0; f != 2 && numKeypoints; ++f)
+        {
+            for (uint32_t i = 0; i != numKeypoints; ++i)
+                ints[i] = (f == 0) ? keypoints[i].octave : keypoints[i].class_id;
+            ofs.write ((const char*)&ints[0], numKeypoints * sizeof(int32_t));
+        }
+
+        // descriptors as one block
+        padTo (ofs, header.descriptorsOffset);
+        for (int row = 0; row != codes.rows; ++row)
+            ofs.write ((const char*)codes.ptr(row), codes.cols * codes.elemSize());
+
+        if (!ofs) throw runtime_error("evg::writeAffFeatures: failed writing file: " + filepath);
+        ofs.close();
+        return true;
+    } catch(exception& e) {
+        cerr << e.what() << endl;
+        return false;
+    }
+}
+
+
+MappedAffFeatures::MappedAffFeatures () : _data(0) { }
+
+
+bool MappedAffFeatures::open (const std::string& filepath)
+{
+    using namespace boost::interprocess;
+    close();
+    try {
+        if (!exists(path(filepath)))
+            throw runtime_error("evg::MappedAffFeatures: file does not exist: " + filepath);
+
+        // writes to descriptors() go to private pages and never to the file
+        file_mapping file (filepath.c_str(), read_only);
+        std::shared_ptr<mapped_region> region (new mapped_region (file, copy_on_write));
+        const char* data = static_cast<const char*>(region->get_address());
+        const uint64_t fileSize = region->get_size();
+
+        // validate the header and that all blocks fit in the file
+        if (fileSize < sizeof(AffFeaturesHeader))
+            throw runtime_error("evg::MappedAffFeatures: file is too short: " + filepath);
+        const AffFeaturesHeader& header = *reinterpret_cast<const AffFeaturesHeader*>(data);
+        if (memcmp (header.magic, AffFeaturesMagic, sizeof(header.magic)) != 0)
+            throw runtime_error("evg::MappedAffFeatures: not an aff features file: " + filepath);
+        if (header.byteOrder != AffFeaturesByteOrder)
+            throw runtime_error("evg::MappedAffFeatures: file has another byte order: " + filepath);
+        if (header.version != 1 && header.version != AffFeaturesVersion)
+            throw runtime_error("evg::MappedAffFeatures: unknown version of file: " + filepath);
+
+        const uint64_t viewsSize = (header.numViews ? header.numViews + 1 : 0) * sizeof(uint32_t);
+        const uint64_t keypointsSize = uint64_t(NumKeypointFields) * header.numKeypoints * 4;
+        const uint64_t descriptorsSize = uint64_t(header.numKeypoints) * header.descriptorCols
+                                       * CV_ELEM_SIZE(header.descriptorType);
+        if (header.version == 1 && header.codecSize != 0)
+            throw runtime_error("evg::MappedAffFeatures: bad header of file: " + filepath);
+        if (header.viewsOffset + viewsSize + header.codecSize > fileSize ||
+            header.keypointsOffset + keypointsSize > fileSize ||
+            header.descriptorsOffset + descriptorsSize > fileSize)
+            throw runtime_error("evg::MappedAffFeatures: file is truncated: " + filepath);
+
+        if (header.codecSize != 0 &&
+            !DescriptorCodec().fromBytes (data + header.viewsOffset + viewsSize, header.codecSize))
+            throw runtime_error("evg::MappedAffFeatures: bad descriptor codec in file: " + filepath);
+
+        _region = region;
+        _data = data;
+        return true;
+    } catch(exception& e) {
+        cerr << e.what() << endl;
+        return false;
+    }
+}
+
+
+void MappedAffFeatures::close ()
+{
+    _region.reset();
+    _data = 0;
+}
+
+
+int MappedAffFeatures::numKeypoints () const
+{
+    assert (!empty());
+    return reinterpret_cast<const AffFeaturesHeader*>(_data)->numKeypoints;
+}
+
+int MappedAffFeatures::minTilt () const
+{
+    assert (!empty());
+    return reinterpret_cast<const AffFeaturesHeader*>(_data)->minTilt;
+}
+
+int MappedAffFeatures::maxTilt () const
+{
+    assert (!empty());
+    return reinterpret_cast<const AffFeaturesHeader*>(_data)->maxTilt;
+}
+
+int MappedAffFeatures::numViews () const
+{
+    assert (!empty());
+    return reinterpret_cast<const AffFeaturesHeader*>(_data)->numViews;
+}
+
+int MappedAffFeatures::viewOffset (int view) const
+{
+    assert (view >= 0 && view <= numViews());
+    const AffFeaturesHeader& header = *reinterpret_cast<const AffFeaturesHeader*>(_data);
+    return reinterpret_cast<const uint32_t*>(_data + header.viewsOffset)[view];
+}
+
+bool MappedAffFeatures::getCodec (DescriptorCodec& codec) const
+{
+    assert (!empty());
+    const AffFeaturesHeader& header = *reinterpret_cast<const AffFeaturesHeader*>(_data);
+    if (header.codecSize == 0) return false;
+    const uint64_t viewsSize = (header.numViews ? header.numViews + 1 : 0) * sizeof(uint32_t);
+    return codec.fromBytes (_data + header.viewsOffset + viewsSize, header.codecSize);
+}
+
+const float* MappedAffFeatures::field (Field f) const
+{
+    assert (!empty() && f >= 0 && f < NumFloatFields);
+    const AffFeaturesHeader& header = *reinterpret_cast<const AffFeaturesHeader*>(_data);
+    return reinterpret_cast<const float*>(_data + header.keypointsOffset) + f * header.numKeypoints;
+}
+
+const int* MappedAffFeatures::octaves () const
+{
+    assert (!empty());
+    const AffFeaturesHeader& header = *reinterpret_cast<const AffFeaturesHeader*>(_data);
+    return reinterpret_cast<const int*>(_data + header.keypointsOffset)
+           + NumFloatFields * header.numKeypoints;
+}
+
+const int* MappedAffFeatures::classIds () const
+{
+    return octaves() + numKeypoints();
+}
+
+
+void MappedAffFeatures::getKeypoints (std::vector<cv::KeyPoint>& keypoints) const
+{
+    const int n = numKeypoints();
+    const float *x = field(X), *y = field(Y), *size = field(Size), *angle = field(Angle),
+                *response = field(Response);
+    const int *octave = octaves(), *classId = classIds();
+    keypoints.resize (n);
+    for (int i = 0; i != n; ++i)
+        keypoints[i] = KeyPoint (x[i], y[i], size[i], angle[i], response[i], octave[i], classId[i]);
+}
+
+
+cv::Mat MappedAffFeatures::descriptors () const
+{
+    assert (!empty());
+    const AffFeaturesHeader& header = *reinterpret_cast<const AffFeaturesHeader*>(_data);
+    if (header.numKeypoints == 0) return Mat();
+    
+    // the matrix keeps the mapping through its refcount, as evg::mapMat
+    static const SharedRegionAllocator* allocator = new SharedRegionAllocator;
+    UMatData* u = new UMatData (allocator);
+    u->data = u->origdata = (uchar*)(_data + header.descriptorsOffset);
+    u->size = size_t(header.numKeypoints) * header.descriptorCols * CV_ELEM_SIZE(header.descriptorType);
+    u->userdata = new std::shared_ptr<boost::interprocess::mapped_region> (_region);
+    u->refcount = 1;
+    
+    Mat descriptors (header.numKeypoints, header.descriptorCols, header.descriptorType, u->data);
+    descriptors.u = u;
+    return descriptors;
+}
+
+
+bool readAffFeatures (const std::string& filepath,
+                      std::vector<cv::KeyPoint>& keypoints,
+                      cv::Mat& descriptors)
+{
+    DescriptorCodec codec;
+    if (!readAffFeatures (filepath, keypoints, descriptors, codec)) return false;
+    if (!codec.empty() && !descriptors.empty())
+        codec.decode (descriptors, descriptors);
+    return true;
+}
+
+
+bool readAffFeatures (const std::string& filepath,
+                      std::vector<cv::KeyPoint>& keypoints,
+                      cv::Mat& descriptors,
+                      DescriptorCodec& codec)
+{
+    MappedAffFeatures mapped;
+    if (!mapped.open (filepath)) return false;
+    mapped.getKeypoints (keypoints);
+    descriptors = mapped.descriptors().clone();
+    if (!mapped.getCodec (codec))
+        codec = DescriptorCodec();
+    return true;
+}
+
+
+
+
+/// ==========================   Descriptor codec   ============================
+
+
+DescriptorCodec::DescriptorCodec ()
+  : _method (None),
+    _inputCols (0),
+    _offset (0),
+    _scale (1) { }
+
+
+void DescriptorCodec::train (const cv::Mat& descriptors, Method method, int numComponents)
+{
+    CV_Assert (!descriptors.empty() && descriptors.channels() == 1);
+    CV_Assert (method >= Quantize8 && method <= PcaQuantize8);
+    
+    Mat data;
+    descriptors.convertTo (data, CV_32F);
+    
+    _method = method;
+    _inputCols = data.cols;
+    _mean = Mat();
+    _eigenvectors = Mat();
+    _offset = 0;
+    _scale = 1;
+    
+    if (method == Pca || method == PcaQuantize8)
+    {
+        CV_Assert (numComponents > 0 && numComponents <= data.cols);
+        PCA pca (data, noArray(), PCA::DATA_AS_ROW, numComponents);
+        _mean = pca.mean.clone();
+        _eigenvectors = pca.eigenvectors.clone();
+        data = pca.project (data);
+    }
+    
+    // the range of the sample is mapped to [0, 255], outliers are saturated
+    if (method == Quantize8 || method == PcaQuantize8)
+    {
+        double minValue, maxValue;
+        minMaxLoc (data, &minValue, &maxValue);
+        _offset = float(minValue);
+        _scale = maxValue > minValue ? float(255. / (maxValue - minValue)) : 1.f;
+    }
+}
+
+
+int DescriptorCodec::dimension () const
+{
+    CV_Assert (!empty());
+    return _eigenvectors.empty() ? _inputCols : _eigenvectors.rows;
+}
+
+
+void DescriptorCodec::encode (const cv::Mat& descriptors, cv::Mat& encoded) const
+{
+    CV_Assert (!empty());
+    Mat data;
+    descriptors.convertTo (data, CV_32F);
+    
+    CV_Assert (data.cols == _inputCols);
+    if (!_eigenvectors.empty())
+    {
+        gemm (data - repeat (_mean, data.rows, 1), _eigenvectors, 1, noArray(), 0, data, GEMM_2_T);
+    }
+    
+    if (_method == Quantize8 || _method == PcaQuantize8)
+        data.convertTo (encoded, CV_8U, _scale, -_offset * _scale);
+    else
+        encoded = data;
+}
+
+
+void DescriptorCodec::decode (const cv::Mat& encoded, cv::Mat& descriptors) const
+{
+    CV_Assert (!empty());
+    if (_method == Quantize8 || _method == PcaQuantize8)
+    {
+        CV_Assert (encoded.type() == CV_8U);
+        encoded.convertTo (descriptors, CV_32F, 1. / _scale, _offset);
+    }
+    else
+        encoded.convertTo (descriptors, CV_32F);
+}
+
+
+bool DescriptorCodec::save (const std::string& filepath) const
+{
+    try {
+        FileStorage fs (filepath, FileStorage::WRITE);
+        if (!fs.isOpened())
+            throw runtime_error("evg::DescriptorCodec::save: cannot open file " + filepath);
+        fs << "method" << _method;
+        fs << "inputCols" << _inputCols;
+        fs << "offset" << _offset;
+        fs << "scale" << _scale;
+        fs << "mean" << _mean;
+        fs << "eigenvectors" << _eigenvectors;
+        return true;
+    } catch(exception& e) {
+        cerr << e.what() << endl;
+        return false;
+    }
+}
+
+
+bool DescriptorCodec::load (const std::string& filepath)
+{
+    try {
+        FileStorage fs (filepath, FileStorage::READ);
+        if (!fs.isOpened())
+            throw runtime_error("evg::DescriptorCodec::load: cannot open file " + filepath);
+        int method;
+        fs["method"] >> method;
+        fs["inputCols"] >> _inputCols;
+        fs["offset"] >> _offset;
+        fs["scale"] >> _scale;
+        fs["mean"] >> _mean;
+        fs["eigenvectors"] >> _eigenvectors;
+        if (method < Quantize8 || method > PcaQuantize8 || _inputCols <= 0 || _scale == 0 ||
+            ((method == Pca || method == PcaQuantize8) && _eigenvectors.empty()))
+            throw runtime_error("evg::DescriptorCodec::load: bad codec in file " + filepath);
+        _method = method;
+        return true;
+    } catch(exception& e) {
+        _method = None;
+        cerr << e.what() << endl;
+        return false;
+    }
+}
+
+
+namespace {
+
+struct CodecBytesHeader {
+    int32_t  method;
+    int32_t  inputCols;
+    float    offset;
+    float    scale;
+    int32_t  numComponents;     // rows of eigenvectors, 0 without Pca
+};
+
+} // namespace
+
+
+void DescriptorCodec::toBytes (std::vector<char>& bytes) const
+{
+    CV_Assert (!empty());
+    CodecBytesHeader header;
+    header.method = _method;
+    header.inputCols = _inputCols;
+    header.offset = _offset;
+    header.scale = _scale;
+    header.numComponents = _eigenvectors.rows;
+    
+    // mean and eigenvectors follow the header as floats
+    const size_t numFloats = header.numComponents ? size_t(header.numComponents + 1) * _inputCols : 0;
+    bytes.resize (sizeof(header) + numFloats * sizeof(float));
+    memcpy (&bytes[0], &header, sizeof(header));
+    if (numFloats)
+    {
+        // via an aligned Mat, bytes of the buffer may be unaligned for floats
+        Mat floats (1, int(numFloats), CV_32F);
+        Mat mean = floats.colRange (0, _inputCols);
+        _mean.reshape(1, 1).convertTo (mean, CV_32F);
+        Mat eigenvectors = floats.colRange (_inputCols, int(numFloats)).reshape (1, header.numComponents);
+        _eigenvectors.convertTo (eigenvectors, CV_32F);
+        memcpy (&bytes[sizeof(header)], floats.data, numFloats * sizeof(float));
+    }
+}
+
+
+bool DescriptorCodec::fromBytes (const char* bytes, size_t size)
+{
+    CodecBytesHeader header;
+    if (size < sizeof(header)) return false;
+    memcpy (&header, bytes, sizeof(header));
+    if (header.method < Quantize8 || header.method > PcaQuantize8 || header.inputCols <= 0 ||
+        header.scale == 0 || header.numComponents < 0 || header.numComponents > header.inputCols ||
+        ((header.method == Pca || header.method == PcaQuantize8) != (header.numComponents > 0)))
+        return false;
+    const size_t numFloats = header.numComponents ? size_t(header.numComponents + 1) * header.inputCols : 0;
+    if (size != sizeof(header) + numFloats * sizeof(float)) return false;
+    
+    _method = header.method;
+    _inputCols = header.inputCols;
+    _offset = header.offset;
+    _scale = header.scale;
+    _mean = Mat();
+    _eigenvectors = Mat();
+    if (numFloats)
+    {
+        // bytes may be unaligned, floats are copied
+        Mat floats (1, int(numFloats), CV_32F);
+        memcpy (floats.data, bytes + sizeof(header), numFloats * sizeof(float));
+        _mean = floats.colRange (0, _inputCols).clone();
+        _eigenvectors = floats.colRange (_inputCols, int(numFloats)).clone()
+                                         .reshape (1, header.numComponents);
+    }
+    return true;
+}
+
+
 
 
 } // namespace evg
@@ -10,12 +10,18 @@
 #define __Eerie__io__
 
 #include <iostream>
+#include <fstream>
 #include <string>
+#include <vector>
+#include <memory>
 #include <opencv2/core/core.hpp>
 #include <opencv2/opencv.hpp>
 
 #include <opencv2/xfeatures2d.hpp>
 using namespace cv::xfeatures2d;
+
+namespace boost { namespace interprocess { class mapped_region; } }
+
 namespace cv {
 namespace evg {
 
@@ -54,13 +60,196 @@ bool writeSimpleMatches (const std::string& filepath,
                          const std::string& imName1, const std::string& imName2,
                          const std::vector<cv::KeyPoint>& keypoints1,
                          const std::vector<cv::KeyPoint>& keypoints2,
-                         const std::vector<cv::DMatch>& matches);
+                         const std::vector<cv::DMatch>& matches,
+                         bool binFormat = false);
     
 bool readSimpleMatches  (const std::string& filepath,
                          std::string& imName1, std::string& imName2,
                          std::vector<cv::KeyPoint>& keypoints1,
                          std::vector<cv::KeyPoint>& keypoints2,
-                         std::vector<cv::DMatch>& matches);
+                         std::vector<cv::DMatch>& matches,
+                         bool binFormat = false);
+
+
+//
+// Archive of simple matches of many image pairs in one file.
+//   Records of pairs are appended one after another, and close() writes an index of pairs
+//   at the end. Opening an existing archive for writing appends new records to it.
+//   An archive that was not closed has no index and cannot be read.
+//   Data is in the byte order of the host.
+//
+
+struct MatchArchiveEntry {
+    std::string         imName1, imName2;
+    unsigned long long  offset;         // of the record from the start of file
+    unsigned int        numMatches;
+};
+
+class MatchArchiveWriter {
+public:
+    MatchArchiveWriter ();
+    ~MatchArchiveWriter ();
+    
+    bool  open (const std::string& filepath);
+    bool  isOpen () const               { return _ofs.is_open(); }
+    bool  write (const std::string& imName1, const std::string& imName2,
+                 const std::vector<cv::KeyPoint>& keypoints1,
+                 const std::vector<cv::KeyPoint>& keypoints2,
+                 const std::vector<cv::DMatch>& matches);
+    bool  close ();
+    
+private:
+    std::ofstream                   _ofs;
+    std::vector<MatchArchiveEntry>  _index;
+    unsigned long long              _offset;
+    
+    MatchArchiveWriter (const MatchArchiveWriter&);
+    MatchArchiveWriter& operator= (const MatchArchiveWriter&);
+};
+
+class MatchArchiveReader {
+public:
+    bool  open (const std::string& filepath);
+    
+    int                       size () const          { return int(_index.size()); }
+    const MatchArchiveEntry&  entry (int i) const    { return _index.at(i); }
+    
+    // index of the pair, or -1 if it is not in the archive
+    int   find (const std::string& imName1, const std::string& imName2) const;
+    
+    // matches of the i-th pair in the same form as from readSimpleMatches
+    bool  read (int i,
+                std::vector<cv::KeyPoint>& keypoints1,
+                std::vector<cv::KeyPoint>& keypoints2,
+                std::vector<cv::DMatch>& matches) const;
+    
+private:
+    std::string                     _filepath;
+    std::vector<MatchArchiveEntry>  _index;
+};
+    
+
+
+//
+// Codec for compact storage of float descriptors, e.g. in feature caches.
+//   Quantize8:     values are mapped linearly to [0, 255] and stored as CV_8U
+//   Pca:           descriptors are projected on the first principal components, CV_32F
+//   PcaQuantize8:  projected, then quantized
+//   decode() returns CV_32F descriptors in the reduced space. Matching them with L2 gives
+//   the same neighbors as the projected descriptors up to quantization, and the ratio test
+//   does not depend on the scale of quantization.
+//   Since decode() only scales and shifts codes, encoded descriptors can be matched with L2
+//   as they are: Pca codes are CV_32F, quantized ones need an L2 matcher for CV_8U
+//   (affma::createL2BFMatcher(CV_8U)). Distances are then those of decoded ones times 'scale'.
+//   The codec is trained on a sample of descriptors. It is stored in the header of
+//   writeAffFeatures files, or alone with save().
+//
+
+class DescriptorCodec {
+public:
+    enum Method { None = -1, Quantize8 = 0, Pca = 1, PcaQuantize8 = 2 };
+    
+    DescriptorCodec ();
+    
+    // numComponents is used only for Pca methods
+    void  train (const cv::Mat& descriptors, Method method, int numComponents = 64);
+    
+    bool  empty () const                  { return _method == None; }
+    int   method () const                 { return _method; }
+    bool  quantized () const              { return _method == Quantize8 || _method == PcaQuantize8; }
+    
+    // length of decoded descriptors
+    int   dimension () const;
+    
+    void  encode (const cv::Mat& descriptors, cv::Mat& encoded) const;
+    void  decode (const cv::Mat& encoded, cv::Mat& descriptors) const;
+    
+    // via cv::FileStorage
+    bool  save (const std::string& filepath) const;
+    bool  load (const std::string& filepath);
+    
+    // compact binary form, in the byte order of the host, as in writeAffFeatures files
+    void  toBytes (std::vector<char>& bytes) const;
+    bool  fromBytes (const char* bytes, size_t size);
+    
+private:
+    int      _method;
+    int      _inputCols;
+    cv::Mat  _mean;             // 1 x N, for Pca
+    cv::Mat  _eigenvectors;     // numComponents x N, for Pca
+    float    _offset, _scale;   // for quantization: code = (value - offset) * scale
+};
+
+
+
+//
+// Container of affine features for fast loading.
+//   Layout: 64-byte header, per-view offsets, keypoints as separate arrays of fields,
+//   then descriptors as one contiguous block aligned to 64 bytes.
+//   Keypoints of view v are [viewOffset(v), viewOffset(v+1)). Views are known only
+//   if keypoints are grouped by view id in class_id, as AffFeatureDetector leaves them.
+//   With a codec, descriptors are stored encoded and the codec follows the view offsets.
+//   Data is in the byte order of the host, files are not portable between byte orders.
+//
+
+// descriptors are encoded with 'codec' if it is given and not empty,
+//   'encoded' if they are codes of 'codec' already
+bool writeAffFeatures   (const std::string& filepath,
+                         const std::vector<cv::KeyPoint>& keypoints,
+                         const cv::Mat& descriptors,
+                         int minTilt = 0, int maxTilt = 0,
+                         const DescriptorCodec* codec = 0, bool encoded = false);
+
+// descriptors are decoded if the file has a codec
+bool readAffFeatures    (const std::string& filepath,
+                         std::vector<cv::KeyPoint>& keypoints,
+                         cv::Mat& descriptors);
+
+// descriptors as stored, and the codec of the file or an empty one
+bool readAffFeatures    (const std::string& filepath,
+                         std::vector<cv::KeyPoint>& keypoints,
+                         cv::Mat& descriptors,
+                         DescriptorCodec& codec);
+
+// the file is memory-mapped, and descriptors() points to the mapped bytes without a copy.
+//   Mat-s returned by descriptors() keep the mapping after close() or destruction.
+//   The mapping is copy-on-write: writes to them are allowed, they are seen by other
+//   Mat-s of the same object but never go to the file
+class MappedAffFeatures {
+public:
+    enum Field { X = 0, Y, Size, Angle, Response, NumFloatFields };
+    
+    MappedAffFeatures ();
+    
+    bool                  open (const std::string& filepath);
+    void                  close ();
+    bool                  empty () const        { return !_region; }
+    
+    int                   numKeypoints () const;
+    int                   minTilt () const;
+    int                   maxTilt () const;
+    
+    // 0 if keypoints were not grouped by views
+    int                   numViews () const;
+    int                   viewOffset (int view) const;
+    
+    // arrays of numKeypoints() elements
+    const float*          field (Field f) const;
+    const int*            octaves () const;
+    const int*            classIds () const;
+    
+    void                  getKeypoints (std::vector<cv::KeyPoint>& keypoints) const;
+    
+    // encoded if the file has a codec
+    cv::Mat               descriptors () const;
+    
+    // false if the file has no codec
+    bool                  getCodec (DescriptorCodec& codec) const;
+    
+private:
+    std::shared_ptr<boost::interprocess::mapped_region>  _region;
+    const char*                                          _data;
+};
     
 
 
@@ -2,13 +2,19 @@
 #include <fstream>
 #include <sstream>
 #include <exception>
+#include <memory>
+#include <cstring>
+#include <cstdint>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 #include "mediaIO.h"
+#include "asciiIO.h"
 
 namespace cv {
 namespace evg {
@@ -301,6 +307,8 @@ bool testImageBool (const cv::Mat& image)
 
 
 
+// one pass over the text: values of every row are appended to one buffer,
+//   and the matrix is made when its size is known
 template<typename Tp>
 Mat dlmread (const std::string& dlmfilePath, cv::Mat matrix, int row1)
 {
@@ -311,59 +319,38 @@ Mat dlmread (const std::string& dlmfilePath, cv::Mat matrix, int row1)
         cerr << "evg::dlmread(): Path " << p << " does not exist." << endl;
         throw exception();
     }
-    std::ifstream fileStream (p.string().c_str());
-    if (!fileStream.good())
-    {
-        cerr << "evg::dlmread(): File " << p << " failed to open." << endl;
-        throw exception();
-    }
     
-    // read file to compute the matrix size [numRows, numCols]
-    string line;
-    istringstream iss;
-    unsigned int row = 0, col = 0, numRows = 0, numCols = 0;
-    for (row = 0; getline(fileStream, line); ++row)
-    {
-        // process the empty line in the end of file
-        if (line == "") { --row; break; }
-        iss.clear();
-        iss.str(line);
-        double dummy;
-        for (col = 0; (iss >> dummy); ++col)
-            ;
-        if (col > numCols) numCols = col;
-    }
-    numRows = row - row1;
-    if(fileStream.bad() || iss.bad())
-    {
-        std::cerr << "evg::dlmread(): error reading the file " << p << std::endl;
+    // rows end at the first empty line, the number of columns is from the longest row
+    vector<float> values;
+    vector<size_t> rowStarts;
+    size_t numCols = 0;
+    try {
+        AsciiReader reader (p.string());
+        for (int row = 0; !reader.atEnd() && !reader.atEmptyLine(); ++row, reader.nextLine())
+        {
+            // skip header
+            if (row < row1) continue;
+            
+            rowStarts.push_back (values.size());
+            float num;
+            while (reader.read (num))
+                values.push_back (num);
+            numCols = std::max (numCols, values.size() - rowStarts.back());
+        }
+    } catch (exception& e) {
+        std::cerr << "evg::dlmread(): error reading the file " << p << ": " << e.what() << std::endl;
         throw exception();
     }
     
-    // rewind the file
-    fileStream.clear();
-    fileStream.seekg(ios_base::beg);
-    
-    // create the matrix of result size and of given type (8U by default)
-    matrix = Mat::zeros(numRows, numCols, DataType<Tp>::channel_type);
-    
-    // skip header
-    for (int row = 0; row != row1; ++row)
-        getline(fileStream, line);
-    // read file and put values into Mat
-    float num;
-    for (int row = 0; getline(fileStream, line) && row != matrix.rows; ++row)
+    // create the matrix of result size and of given type
+    const int numRows = int(rowStarts.size());
+    matrix = Mat::zeros(numRows, int(numCols), DataType<Tp>::channel_type);
+    for (int row = 0; row != numRows; ++row)
     {
-        iss.clear();
-        iss.str(line);
-        for (int col = 0; col != matrix.cols && (iss >> num); ++col)
-            matrix.at<Tp>(row, col) = num;
-    }
-    
-    if(fileStream.bad() || iss.bad())
-    {
-        std::cerr << "evg::dlmread(): error reading the file." << std::endl;
-        throw exception();
+        const size_t rowEnd = (row + 1 == numRows) ? values.size() : rowStarts[row + 1];
+        Tp* dst = matrix.ptr<Tp>(row);
+        for (size_t i = rowStarts[row]; i != rowEnd; ++i)
+            dst[i - rowStarts[row]] = Tp(values[i]);
     }
     
     return matrix;
@@ -376,69 +363,7 @@ Mat dlmread (const std::string& dlmfilePath, cv::Mat matrix, int row1)
 // matrix will put zeros for missing values
 Mat dlmread (const std::string& dlmfilePath, cv::Mat matrix, int row1)
 {
-    // open file
-    path p = absolute(path(dlmfilePath));
-    if (! exists(p) )
-    {
-        cerr << "evg::dlmread(): Path " << p << " does not exist." << endl;
-        throw exception();
-    }
-    std::ifstream fileStream (p.string().c_str());
-    if (!fileStream.good())
-    {
-        cerr << "evg::dlmread(): File " << p << " failed to open." << endl;
-        throw exception();
-    }
-    
-    // read file to compute the matrix size [numRows, numCols]
-    string line;
-    istringstream iss;
-    unsigned int row = 0, col = 0, numRows = 0, numCols = 0;
-    for (row = 0; getline(fileStream, line); ++row)
-    {
-        // process the empty line in the end of file
-        if (line == "") { --row; break; }
-        iss.clear();
-        iss.str(line);
-        double dummy;
-        for (col = 0; (iss >> dummy); ++col)
-            ;
-        if (col > numCols) numCols = col;
-    }
-    numRows = row - row1;
-    if(fileStream.bad() || iss.bad())
-    {
-        std::cerr << "evg::dlmread(): error reading the file " << p << std::endl;
-        throw exception();
-    }
-    
-    // rewind the file
-    fileStream.clear();
-    fileStream.seekg(ios_base::beg);
-    
-    // create the matrix of result size and of given type (8U by default)
-    matrix = Mat::zeros(numRows, numCols, CV_32F);
-    
-    // skip header
-    for (int row = 0; row != row1; ++row)
-        getline(fileStream, line);
-    // read file and put values into Mat
-    float num;
-    for (int row = 0; getline(fileStream, line) && row != matrix.rows; ++row)
-    {
-        iss.clear();
-        iss.str(line);
-        for (int col = 0; col != matrix.cols && (iss >> num); ++col)
-            matrix.at<float>(row, col) = num;
-    }
-    
-    if(fileStream.bad() || iss.bad())
-    {
-        std::cerr << "evg::dlmread(): error reading the file." << std::endl;
-        throw exception();
-    }
-    
-    return matrix;
+    return dlmread<float> (dlmfilePath, matrix, row1);
 }
 
 
@@ -466,22 +391,24 @@ void dlmwrite (const std::string& dlmfilePath, const Mat& _matrix)
         throw exception();
     }
 
-    // open file
-    std::ofstream ofs (p.string().c_str());
-    if (!ofs.good())
-    {
-        cerr << "evg::dlmwrite(): File " << p << " failed to open." << endl;
+    try {
+        AsciiWriter ofs (p.string());
+        
+        // write stuff
+        Mat matrix = _matrix;
+        if (matrix.type() != CV_32F)
+            matrix.convertTo(matrix, CV_32F);
+        for (int i = 0; i != matrix.rows; ++i)
+        {
+            const float* row = matrix.ptr<float>(i);
+            for (int j = 0; j != matrix.cols; ++j)
+                ofs << row[j] << (j == matrix.cols-1 ? '\n' : ' ');
+        }
+        ofs.close();
+    } catch (exception& e) {
+        cerr << "evg::dlmwrite(): File " << p << " failed to write: " << e.what() << endl;
         throw exception();
     }
-    
-    // write stuff
-    Mat matrix = _matrix;
-    if (matrix.type() != CV_32F)
-        matrix.convertTo(matrix, CV_32F);
-    for (int i = 0; i != matrix.rows; ++i)
-        for (int j = 0; j != matrix.cols; ++j)
-            ofs << matrix.at<float>(i, j) << (j == matrix.cols-1 ? '\n' : ' ');
-    ofs << flush;
 }
 
 
@@ -497,13 +424,96 @@ bool dlmwriteBool (const std::string& dlmfilePath, const Mat& matrix)
 }
 
 
+// header of Mat files, the legacy header is 4 ints: cols, rows, channels, element size
+const char   MatFileMagic[4]   = { 'E', 'V', 'G', 'M' };
+const int    MatFileVersion    = 1;
+const size_t MatFileDataOffset = 64;
+
+struct MatFileHeader {
+    char     magic[4];
+    int32_t  version;
+    int32_t  type;
+    int32_t  rows;
+    int32_t  cols;
+    int32_t  dataOffset;
+};
+
+static bool parseMatFileHeader (const char* data, size_t size,
+                                int& type, int& rows, int& cols, size_t& dataOffset)
+{
+    if (size >= sizeof(MatFileHeader) && memcmp (data, MatFileMagic, sizeof(MatFileMagic)) == 0)
+    {
+        MatFileHeader header;
+        memcpy (&header, data, sizeof(header));
+        if (header.version != MatFileVersion)
+        {
+            cerr << "evg::readMat(): unknown version of matrix file" << endl;
+            return false;
+        }
+        type = header.type;
+        rows = header.rows;
+        cols = header.cols;
+        dataOffset = size_t(header.dataOffset);
+        return rows >= 0 && cols >= 0;
+    }
+    
+    // legacy header: only 1 channel, type from the element size
+    int legacy[4];
+    if (size < sizeof(legacy))
+    {
+        cerr << "evg::readMat(): bad matrix header" << endl;
+        return false;
+    }
+    memcpy (legacy, data, sizeof(legacy));
+    cols = legacy[0];
+    rows = legacy[1];
+    const int chan = legacy[2], eSiz = legacy[3];
+    switch (eSiz){
+        case sizeof(char):
+            type = CV_8UC(chan);
+            break;
+        case sizeof(float):
+            type = CV_32FC(chan);
+            break;
+        case sizeof(double):
+            type = CV_64FC(chan);
+            break;
+        default:
+            cerr << "evg::readMat(): bad matrix header" << endl;
+            return false;
+    }
+    dataOffset = sizeof(legacy);
+    return rows >= 0 && cols >= 0;
+}
+
+
+// unmaps the file when the last Mat referring to it is released
+class MappedMatAllocator : public MatAllocator {
+public:
+    UMatData* allocate (int, const int*, int, void*, size_t*, int, UMatUsageFlags) const
+    {
+        return 0;
+    }
+    bool allocate (UMatData*, int, UMatUsageFlags) const
+    {
+        return false;
+    }
+    void deallocate (UMatData* u) const
+    {
+        if (!u) return;
+        CV_Assert (u->urefcount == 0 && u->refcount == 0);
+        delete static_cast<boost::interprocess::mapped_region*>(u->userdata);
+        delete u;
+    }
+};
+
+
 // from http://stackoverflow.com/questions/3190378/opencv-store-to-database
+// The header is versioned and keeps the full type, data starts at MatFileDataOffset
+//   so that mapped data is aligned
 void saveMat ( const string& filename, const Mat& M)
 {
     try {
-        // only one channel
-        assert (M.channels() == 1);
-    
         // check the parent path for output video
         path p = absolute(path(filename));
         if (! exists(p.parent_path()) )
@@ -517,29 +527,42 @@ void saveMat ( const string& filename, const Mat& M)
             cerr << "evg::saveMat(): matrix is empty" << endl;
             throw exception();
         }
+        if (M.dims != 2)
+        {
+            cerr << "evg::saveMat(): only 2-dimensional matrices are supported." << endl;
+            throw exception();
+        }
         std::ofstream out(p.string().c_str(), ios::out|ios::binary);
         if (!out)
         {
             cerr << "evg::saveMat(): cannot open file for writing" << endl;
             throw exception();
         }
-        int cols = M.cols;
-        int rows = M.rows;
-        int chan = M.channels();
-        int eSiz = int((M.dataend-M.datastart)/(cols*rows*chan));
         
         // Write header
-        out.write((char*)&cols,sizeof(cols));
-        out.write((char*)&rows,sizeof(rows));
-        out.write((char*)&chan,sizeof(chan));
-        out.write((char*)&eSiz,sizeof(eSiz));
+        MatFileHeader header;
+        memset (&header, 0, sizeof(header));
+        memcpy (header.magic, MatFileMagic, sizeof(header.magic));
+        header.version    = MatFileVersion;
+        header.type       = M.type();
+        header.rows       = M.rows;
+        header.cols       = M.cols;
+        header.dataOffset = MatFileDataOffset;
+        out.write((char*)&header, sizeof(header));
+        const vector<char> padding (MatFileDataOffset - sizeof(header), 0);
+        out.write(&padding[0], padding.size());
         
-        // Write data.
+        // Write data, row by row if the matrix is not continuous
+        const size_t rowSize = M.cols * M.elemSize();
         if (M.isContinuous())
-            out.write((char *)M.data,cols*rows*chan*eSiz);
+            out.write((const char *)M.data, rowSize * M.rows);
         else
+            for (int row = 0; row != M.rows; ++row)
+                out.write((const char *)M.ptr(row), rowSize);
+        
+        if (!out)
         {
-            cerr << "evg::saveMat(): matrix must be continious." << endl;
+            cerr << "evg::saveMat(): failed writing the file." << endl;
             throw exception();
         }
         out.close();
@@ -566,13 +589,11 @@ bool saveMatBool ( const string& filename, const Mat& M)
 Mat readMat( const string& filename)
 {
     try {
-        Mat M;
-    
         // open file
         path p = absolute(path(filename));
         if (! exists(p) )
         {
-            cerr << "evg::dlmread(): Path " << p << " does not exist." << endl;
+            cerr << "evg::readMat(): Path " << p << " does not exist." << endl;
             throw exception();
         }
         std::ifstream in (p.string().c_str(), ios::in|ios::binary);
@@ -581,40 +602,28 @@ Mat readMat( const string& filename)
             cerr << "evg::readMat(): cannot open file " << p << " for reading" << endl;
             throw exception();
         }
-        int cols;
-        int rows;
-        int chan;
-        int eSiz;
-        
-        // Read header
-        in.read((char*)&cols,sizeof(cols));
-        in.read((char*)&rows,sizeof(rows));
-        in.read((char*)&chan,sizeof(chan));
-        in.read((char*)&eSiz,sizeof(eSiz));
         
-        // Determine type of the matrix
-        int type = 0;
-        switch (eSiz){
-            case sizeof(char):
-                type = CV_8UC(chan);
-                break;
-            case sizeof(float):
-                type = CV_32FC(chan);
-                break;
-            case sizeof(double):
-                type = CV_64FC(chan);
-                break;
-            default:
-                cerr << "evg::readMat(): bad matrix header" << endl;
-                throw exception();
-        }
+        // Read header, the legacy one is shorter
+        char headerData[sizeof(MatFileHeader)];
+        in.read(headerData, sizeof(headerData));
+        int type, rows, cols;
+        size_t dataOffset;
+        if (!parseMatFileHeader (headerData, size_t(in.gcount()), type, rows, cols, dataOffset))
+            throw exception();
         
         // Alocate Matrix.
-        M = Mat(rows,cols,type,Scalar(1));
+        Mat M (rows, cols, type);
         
         // Read data.
         assert(M.isContinuous());
-        in.read((char *)M.data,cols*rows*chan*eSiz);
+        in.clear();
+        in.seekg(dataOffset);
+        in.read((char *)M.data, M.total() * M.elemSize());
+        if (!in)
+        {
+            cerr << "evg::readMat(): file " << p << " is truncated" << endl;
+            throw exception();
+        }
 
         in.close();
         return M;
@@ -634,6 +643,60 @@ bool readMat( const string& filename, Mat& M )
 }
 
 
+Mat mapMat( const string& filename)
+{
+    using namespace boost::interprocess;
+    try {
+        path p = absolute(path(filename));
+        if (! exists(p) )
+        {
+            cerr << "evg::mapMat(): Path " << p << " does not exist." << endl;
+            throw exception();
+        }
+        
+        // writes to the matrix go to private pages and never to the file
+        file_mapping file (p.string().c_str(), read_only);
+        std::unique_ptr<mapped_region> region (new mapped_region (file, copy_on_write));
+        const char* data = static_cast<const char*>(region->get_address());
+        
+        int type, rows, cols;
+        size_t dataOffset;
+        if (!parseMatFileHeader (data, region->get_size(), type, rows, cols, dataOffset))
+            throw exception();
+        const size_t dataSize = size_t(rows) * cols * CV_ELEM_SIZE(type);
+        if (dataOffset + dataSize > region->get_size())
+        {
+            cerr << "evg::mapMat(): file " << p << " is truncated" << endl;
+            throw exception();
+        }
+        
+        // the matrix owns the mapping through its refcount, the last copy unmaps the file
+        static const MappedMatAllocator* allocator = new MappedMatAllocator;
+        UMatData* u = new UMatData (allocator);
+        u->data = u->origdata = (uchar*)(data + dataOffset);
+        u->size = dataSize;
+        u->userdata = region.release();
+        u->refcount = 1;
+        
+        Mat M (rows, cols, type, u->data);
+        M.u = u;
+        return M;
+    } catch(...) {
+        cerr << "evg::mapMat(): exception caught." << endl;
+        throw exception();
+    }
+}
+
+
+bool mapMat( const string& filename, Mat& M )
+{
+    try {
+        M = mapMat(filename);
+        return 1;
+    } catch(...) { return 0; }
+}
+
+
 
 SrcVideo::SrcVideo (const Type _type, const std::string _videoPath)
   : type (_type),
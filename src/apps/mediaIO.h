@@ -21,7 +21,7 @@
 //   load/save/start images/video
 //   smth extra for images
 //   read/write space-delimited files
-//   read/write cv::Mat as bin files (to save space compared to cv::FileStorage)
+//   read/write cv::Mat as bin files (to save space compared to cv::FileStorage), map them
 //   class to switch between video input from camera and from file
 //
 // Dependences:
@@ -106,12 +106,19 @@ bool             dlmreadBool (const std::string& dlmfilePath, cv::Mat matrix = c
 // read/write Mat files as .bin
 //
 
-// only for 1 channel, CV_8U, CV_32F, CV_64F matrices
+// any 2-dimensional matrix, the header keeps its full type
+//   readMat also reads files of the old format (1 channel, CV_8U, CV_32F, CV_64F)
 void             saveMat (const std::string& binFilepath, const cv::Mat& matrix);
 bool             saveMatBool (const std::string& binFilepath, const cv::Mat& matrix);
 cv::Mat          readMat (const std::string& binFilepath);
 bool             readMat (const std::string& binFilepath, cv::Mat& matrix);
 
+// the matrix points to the memory-mapped file, without reading or copying data
+//   Pages are shared with other processes that map the same file. Writes to the matrix
+//   are private and never reach the file. The file is unmapped with the last copy of the Mat
+cv::Mat          mapMat (const std::string& binFilepath);
+bool             mapMat (const std::string& binFilepath, cv::Mat& matrix);
+
 
 
 //